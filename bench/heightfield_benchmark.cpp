@@ -0,0 +1,59 @@
+/**
+ * Prints the vertices per second of the heightfield normals with SIMD and
+ * scalar code and of a parallel mesh build of a size x size heightmap.
+ *
+ *   heightfield_benchmark [size]
+ */
+
+#include "HeightfieldMesh.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace mars::vsg_graphics;
+using Clock = std::chrono::steady_clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    long size = argc > 1 ? std::atol(argv[1]) : 2048;
+    if(size < 2)
+    {
+        fprintf(stderr, "heightfield_benchmark: the heightmap needs at least 2x2 vertices\n");
+        return 1;
+    }
+    uint32_t n = static_cast<uint32_t>(size);
+    auto heights = vsg::floatArray2D::create(n, n, vsg::Data::Properties{VK_FORMAT_R32_SFLOAT});
+    for(uint32_t y=0; y<n; ++y)
+    {
+        for(uint32_t x=0; x<n; ++x)
+        {
+            heights->set(x, y, 0.5f + 0.25f*std::sin(0.05f*x)*std::cos(0.03f*y));
+        }
+    }
+    const double vertices = static_cast<double>(n)*n;
+    std::vector<vsg::vec3> normals(static_cast<size_t>(n)*n);
+
+    auto start = Clock::now();
+    HeightfieldMesh::computeNormals(*heights, 100.0, 100.0, 10.0, 0, 0, n, n, normals.data(), false);
+    double scalarMs = elapsedMs(start);
+    start = Clock::now();
+    HeightfieldMesh::computeNormals(*heights, 100.0, 100.0, 10.0, 0, 0, n, n, normals.data(), true);
+    double simdMs = elapsedMs(start);
+    start = Clock::now();
+    auto mesh = HeightfieldMesh::build(*heights, 100.0, 100.0, 10.0);
+    double buildMs = elapsedMs(start);
+
+    printf("normals of %.1f M vertices: scalar %.1f M/s, SIMD %.1f M/s (%.2fx)\n",
+           vertices*1e-6, vertices*1e-3/scalarMs, vertices*1e-3/simdMs, scalarMs/simdMs);
+    printf("parallel build: %.1f M vertices/s, %zu chunks\n",
+           vertices*1e-3/buildMs, mesh->children.size());
+    return 0;
+}
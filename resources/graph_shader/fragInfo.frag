@@ -6,4 +6,12 @@ void fragInfo(out vec4 ambient, out vec4 diffuse, out vec4 specular, out vec4 em
   diffuse = pbr.diffuseFactor;
   specular = pbr.specularFactor;
   emission = pbr.emissiveFactor;
+#ifdef MARS_TEXTURE
+  texCoord = marsTexCoord;
+  diffuse *= texture(diffuseTexture, texCoord);
+#endif
+#ifdef MARS_VERTEX_COLORS
+  ambient *= marsColor;
+  diffuse *= marsColor;
+#endif
 }
\ No newline at end of file
@@ -331,7 +331,8 @@ void pixellight_frag(vec4 base, vec3 n, float shadow, out vec4 outcol) {
   // }
 
   // calculate output color
-  outcol = vec4(color, 1.0);
+  // the alpha is only used by the blended pipelines of transparent materials
+  outcol = vec4(color, pbr.diffuseFactor.a);
   //outcol = brightness* ((ambient + diffuse_)*base  + specular_ + gl_FrontMaterial.emission*base);
 
   /* if(drawLineLaser == 1) { */
@@ -0,0 +1,65 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(constant_id = 0) const int terrainDataSize = 4;
+#ifdef MARS_MATERIAL_TABLE
+layout(std430, set = 0, binding = 1) readonly buffer TerrainData
+{
+    vec4 values[terrainDataSize];
+} terrain;
+#else
+layout(set = 0, binding = 1) uniform TerrainData
+{
+    vec4 values[terrainDataSize];
+} terrain;
+#endif
+
+// ViewDependentState
+layout(constant_id = 3) const int lightDataSize = 256;
+layout(set = 1, binding = 0) uniform LightData
+{
+    vec4 values[lightDataSize];
+} lightData;
+
+layout(location = 0) in vec3 viewNormal;
+layout(location = 1) in vec3 viewPos;
+layout(location = 2) in vec2 terrainPos;
+layout(location = 3) flat in vec4 innerBounds;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+    vec4 info = terrain.values[0];
+    // the finer level is drawn there and outside of the heightmap is nothing
+    if(all(greaterThan(terrainPos, innerBounds.xy)) && all(lessThan(terrainPos, innerBounds.zw)))
+    {
+        discard;
+    }
+    if(any(greaterThan(abs(terrainPos), 0.5*info.xy)))
+    {
+        discard;
+    }
+
+    vec4 baseColor = terrain.values[2];
+    vec3 normal = normalize(viewNormal);
+    vec3 color = vec3(0.0);
+    vec4 numLights = lightData.values[0];
+    int numAmbientLights = int(numLights[0]);
+    int numDirectionalLights = int(numLights[1]);
+    int lightDataIndex = 1;
+    for(int i=0; i<numAmbientLights; ++i)
+    {
+        vec4 lightColor = lightData.values[lightDataIndex++];
+        color += baseColor.rgb*lightColor.rgb*lightColor.a;
+    }
+    for(int i=0; i<numDirectionalLights; ++i)
+    {
+        vec4 lightColor = lightData.values[lightDataIndex++];
+        vec3 direction = -lightData.values[lightDataIndex++].xyz;
+        int shadowMapCount = int(lightData.values[lightDataIndex].r);
+        lightDataIndex += shadowMapCount > 0 ? 1 + 8*shadowMapCount : 1;
+        color += baseColor.rgb*lightColor.rgb*lightColor.a*max(dot(normal, direction), 0.0);
+    }
+    outColor = vec4(color, 1.0);
+}
@@ -0,0 +1,96 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Geometry clipmap of a heightmap terrain. The same grid of gridSize cells
+// is drawn once per level (gl_InstanceIndex), every level doubles the cell
+// size. The grid is given in cell coordinates [0, gridSize].
+
+layout(push_constant) uniform PushConstants {
+    mat4 projection;
+    mat4 modelView;
+} pc;
+
+// [0]: terrain size x, y, height scale, number of levels
+// [1]: grid size, morph start, finest drawn level, unused
+// [2]: diffuse color
+// [3+i]: center x, y and cell size of level i
+layout(constant_id = 0) const int terrainDataSize = 4;
+#ifdef MARS_MATERIAL_TABLE
+layout(std430, set = 0, binding = 1) readonly buffer TerrainData
+{
+    vec4 values[terrainDataSize];
+} terrain;
+#else
+layout(set = 0, binding = 1) uniform TerrainData
+{
+    vec4 values[terrainDataSize];
+} terrain;
+#endif
+
+layout(set = 0, binding = 2) uniform sampler2D heightMap;
+
+layout(location = 0) in vec2 gridPos;
+
+layout(location = 0) out vec3 viewNormal;
+layout(location = 1) out vec3 viewPos;
+layout(location = 2) out vec2 terrainPos;
+// area drawn by the next finer level
+layout(location = 3) flat out vec4 innerBounds;
+
+out gl_PerVertex{ vec4 gl_Position; };
+
+// bilinear interpolation of the texels, float textures may not support
+// linear filtering
+float getHeight(vec2 uv)
+{
+    ivec2 size = textureSize(heightMap, 0);
+    vec2 p = clamp(uv, vec2(0.0), vec2(1.0))*vec2(size - ivec2(1));
+    ivec2 i = min(ivec2(floor(p)), size - ivec2(2));
+    vec2 f = p - vec2(i);
+    float h00 = texelFetch(heightMap, i, 0).r;
+    float h10 = texelFetch(heightMap, i + ivec2(1, 0), 0).r;
+    float h01 = texelFetch(heightMap, i + ivec2(0, 1), 0).r;
+    float h11 = texelFetch(heightMap, i + ivec2(1, 1), 0).r;
+    return mix(mix(h00, h10, f.x), mix(h01, h11, f.x), f.y);
+}
+
+void main()
+{
+    vec4 info = terrain.values[0];
+    vec4 grid = terrain.values[1];
+    int level = gl_InstanceIndex;
+    vec4 levelData = terrain.values[3 + level];
+    float halfSize = 0.5*grid.x;
+
+    // morph odd vertices onto the coarser grid towards the border of the
+    // level, there the next coarser level takes over
+    vec2 p = gridPos - vec2(halfSize);
+    float d = max(abs(p.x), abs(p.y))/halfSize;
+    float morph = clamp((d - grid.y)/(1.0 - grid.y), 0.0, 1.0);
+    p -= mod(gridPos, vec2(2.0))*morph;
+
+    terrainPos = levelData.xy + p*levelData.z;
+    vec2 uv = terrainPos/info.xy + vec2(0.5);
+    float h = getHeight(uv)*info.z;
+
+    // central differences over one texel
+    vec2 texel = 1.0/vec2(textureSize(heightMap, 0) - ivec2(1));
+    float hx = (getHeight(uv + vec2(texel.x, 0.0)) - getHeight(uv - vec2(texel.x, 0.0)))*info.z;
+    float hy = (getHeight(uv + vec2(0.0, texel.y)) - getHeight(uv - vec2(0.0, texel.y)))*info.z;
+    vec3 normal = normalize(vec3(-hx/(2.0*texel.x*info.x), -hy/(2.0*texel.y*info.y), 1.0));
+
+    if(level > int(grid.z))
+    {
+        vec4 inner = terrain.values[2 + level];
+        innerBounds = vec4(inner.xy - vec2(halfSize*inner.z), inner.xy + vec2(halfSize*inner.z));
+    }
+    else
+    {
+        innerBounds = vec4(1.0, 1.0, -1.0, -1.0);
+    }
+
+    vec4 pos = pc.modelView*vec4(terrainPos, h, 1.0);
+    viewPos = pos.xyz;
+    viewNormal = mat3(pc.modelView)*normal;
+    gl_Position = pc.projection*pos;
+}
@@ -5,4 +5,10 @@ void vertexOut(in vec4 viewPos, in vec3 modelPos, in vec3 normalV) {
   //normalVarying = vsg_Normal;
   //normalVarying = (pc.modelView*vec4(0.0, 0.0, 1.0, 0.0)).xyz;
   modelVertex = vec4(modelPos, 1);
+#ifdef MARS_TEXTURE
+  marsTexCoord = vsg_TexCoord0;
+#endif
+#ifdef MARS_VERTEX_COLORS
+  marsColor = vsg_Color;
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "CacheFile.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        void CacheFile::hashBytes(uint64_t &h, const void *data, size_t size)
+        {
+            const uint8_t *bytes = static_cast<const uint8_t*>(data);
+            for(size_t i=0; i<size; ++i)
+            {
+                h ^= bytes[i];
+                h *= 1099511628211ull;
+            }
+        }
+
+        bool CacheFile::write(const std::string &file,
+                              const std::vector<std::pair<const void*, size_t>> &chunks)
+        {
+            // the pid separates processes, the counter the threads of
+            // this process
+            static std::atomic<unsigned long> counter(0);
+            std::string tmpFile = file + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+            bool ok;
+            {
+                std::ofstream out(tmpFile, std::ios::binary);
+                for(auto &chunk: chunks)
+                {
+                    out.write(static_cast<const char*>(chunk.first), chunk.second);
+                }
+                out.close();
+                ok = static_cast<bool>(out);
+            }
+            std::error_code ec;
+            if(ok)
+            {
+                std::filesystem::rename(tmpFile, file, ec);
+                ok = !ec;
+            }
+            if(!ok)
+            {
+                LOG_ERROR("CacheFile: can not write %s", file.c_str());
+                std::filesystem::remove(tmpFile, ec);
+            }
+            return ok;
+        }
+    }
+}
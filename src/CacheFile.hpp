@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Helpers shared by the on-disk caches (shaders, pipelines, textures,
+         * heightmaps).
+         *
+         * The keys are 64 bit FNV-1a hashes. Files are written to a temporary
+         * file unique to the process and thread and renamed once the write
+         * succeeded, thus other processes reading the cache at the same time
+         * only ever see complete files.
+         */
+        class CacheFile
+        {
+        public:
+            static constexpr uint64_t hashSeed = 14695981039346656037ull;
+
+            static void hashBytes(uint64_t &h, const void *data, size_t size);
+            template<typename T>
+            static void hashValue(uint64_t &h, const T &value)
+                { hashBytes(h, &value, sizeof(T)); }
+            static void hashString(uint64_t &h, const std::string &value)
+                { hashBytes(h, value.data(), value.size()+1); }
+
+            /** Writes the chunks in order, returns false if anything failed. */
+            static bool write(const std::string &file,
+                              const std::vector<std::pair<const void*, size_t>> &chunks);
+            static bool write(const std::string &file, const void *data, size_t size)
+                { return write(file, {{data, size}}); }
+        };
+    }
+}
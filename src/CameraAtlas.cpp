@@ -0,0 +1,326 @@
+#include "CameraAtlas.hpp"
+#include "MARSStateGroup.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        CameraAtlas::CameraAtlas(vsg::ref_ptr<vsg::Node> scene_) :
+            scene(scene_), rebuild(false), pendingReadBack(false), atlasWidth(0), atlasHeight(0)
+        {
+        }
+
+        CameraAtlas::~CameraAtlas()
+        {
+        }
+
+        void CameraAtlas::addCamera(unsigned long id, uint32_t width, uint32_t height)
+        {
+            Tile tile;
+            tile.x = tile.y = 0;
+            tile.placed = false;
+            tile.width = width;
+            tile.height = height;
+            tile.lookAt = vsg::LookAt::create(vsg::dvec3(0.0, 0.0, 0.0), vsg::dvec3(1.0, 0.0, 0.0), vsg::dvec3(0.0, 0.0, 1.0));
+            tile.perspective = vsg::Perspective::create(45.0, static_cast<double>(width) / static_cast<double>(height), 0.01, 100.0);
+            tile.worldTransformUniform = WorldTransformUniformValue::create();
+            tile.worldTransformUniform->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+            std::lock_guard<std::mutex> lock(imageMutex);
+            tiles[id] = tile;
+            rebuild = true;
+        }
+
+        void CameraAtlas::removeCamera(unsigned long id)
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            if(tiles.erase(id))
+            {
+                rebuild = true;
+            }
+        }
+
+        bool CameraAtlas::hasCamera(unsigned long id) const
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            return tiles.count(id) > 0;
+        }
+
+        void CameraAtlas::setCameraPose(unsigned long id, const utils::Vector &pos,
+                                        const utils::Quaternion &q)
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            auto it = tiles.find(id);
+            if(it == tiles.end())
+            {
+                return;
+            }
+            utils::Vector center = pos + q*utils::Vector(1.0, 0.0, 0.0);
+            utils::Vector up = q*utils::Vector(0.0, 0.0, 1.0);
+            it->second.lookAt->set(vsg::dvec3(pos.x(), pos.y(), pos.z()),
+                                   vsg::dvec3(center.x(), center.y(), center.z()),
+                                   vsg::dvec3(up.x(), up.y(), up.z()));
+        }
+
+        void CameraAtlas::setCameraProjection(unsigned long id, double fovy,
+                                              double nearPlane, double farPlane)
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            auto it = tiles.find(id);
+            if(it == tiles.end())
+            {
+                return;
+            }
+            it->second.perspective->fieldOfViewY = fovy;
+            it->second.perspective->nearDistance = nearPlane;
+            it->second.perspective->farDistance = farPlane;
+        }
+
+        vsg::ref_ptr<vsg::CommandGraph> CameraAtlas::build(vsg::ref_ptr<vsg::Device> device_)
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            device = device_;
+            rebuild = false;
+            pendingReadBack = false;
+            commandGraph = 0;
+            readBackBuffer = 0;
+            renderPass = 0;
+            views.clear();
+            if(tiles.empty())
+            {
+                return commandGraph;
+            }
+
+            // shelf packing of the tiles into rows
+            uint32_t maxWidth = std::min(device->getPhysicalDevice()->getProperties().limits.maxImageDimension2D, 4096u);
+            uint32_t x = 0, y = 0, rowHeight = 0;
+            atlasWidth = 0;
+            for(auto &it: tiles)
+            {
+                Tile &tile = it.second;
+                if(x > 0 && x + tile.width > maxWidth)
+                {
+                    x = 0;
+                    y += rowHeight;
+                    rowHeight = 0;
+                }
+                tile.x = x;
+                tile.y = y;
+                tile.placed = true;
+                x += tile.width;
+                rowHeight = std::max(rowHeight, tile.height);
+                atlasWidth = std::max(atlasWidth, x);
+            }
+            atlasHeight = y + rowHeight;
+
+            VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM;
+            VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+
+            auto colorImage = vsg::Image::create();
+            colorImage->imageType = VK_IMAGE_TYPE_2D;
+            colorImage->format = colorFormat;
+            colorImage->extent = VkExtent3D{atlasWidth, atlasHeight, 1};
+            colorImage->mipLevels = 1;
+            colorImage->arrayLayers = 1;
+            colorImage->samples = VK_SAMPLE_COUNT_1_BIT;
+            colorImage->tiling = VK_IMAGE_TILING_OPTIMAL;
+            colorImage->usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            colorImage->initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            colorImage->sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            auto colorImageView = vsg::createImageView(device, colorImage, VK_IMAGE_ASPECT_COLOR_BIT);
+
+            auto depthImage = vsg::Image::create();
+            depthImage->imageType = VK_IMAGE_TYPE_2D;
+            depthImage->format = depthFormat;
+            depthImage->extent = VkExtent3D{atlasWidth, atlasHeight, 1};
+            depthImage->mipLevels = 1;
+            depthImage->arrayLayers = 1;
+            depthImage->samples = VK_SAMPLE_COUNT_1_BIT;
+            depthImage->tiling = VK_IMAGE_TILING_OPTIMAL;
+            depthImage->usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+            depthImage->initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            depthImage->sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            auto depthImageView = vsg::createImageView(device, depthImage, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+            // the color attachment ends up ready for the copy into the read back buffer
+            auto colorAttachment = vsg::defaultColorAttachment(colorFormat);
+            colorAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            auto depthAttachment = vsg::defaultDepthAttachment(depthFormat);
+            vsg::RenderPass::Attachments attachments{colorAttachment, depthAttachment};
+
+            vsg::AttachmentReference colorReference = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+            vsg::AttachmentReference depthReference = {1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+            vsg::RenderPass::Subpasses subpasses(1);
+            subpasses[0].colorAttachments.emplace_back(colorReference);
+            subpasses[0].depthStencilAttachments.emplace_back(depthReference);
+
+            vsg::RenderPass::Dependencies dependencies{
+                {VK_SUBPASS_EXTERNAL, 0,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                 0, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0},
+                {VK_SUBPASS_EXTERNAL, 0,
+                 VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                 VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, 0},
+                {0, VK_SUBPASS_EXTERNAL,
+                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, 0}};
+
+            renderPass = vsg::RenderPass::create(device, attachments, subpasses, dependencies);
+            auto framebuffer = vsg::Framebuffer::create(renderPass, vsg::ImageViews{colorImageView, depthImageView}, atlasWidth, atlasHeight, 1);
+
+            auto renderGraph = vsg::RenderGraph::create();
+            renderGraph->framebuffer = framebuffer;
+            renderGraph->renderArea.offset = {0, 0};
+            renderGraph->renderArea.extent = {atlasWidth, atlasHeight};
+            renderGraph->setClearValues({{0.0f, 0.0f, 0.0f, 1.0f}}, VkClearDepthStencilValue{0.0f, 0});
+
+            // one view per camera, each rendering into its own viewport of the atlas
+            for(auto &it: tiles)
+            {
+                Tile &tile = it.second;
+                auto camera = vsg::Camera::create(tile.perspective, tile.lookAt,
+                                                  vsg::ViewportState::create(tile.x, tile.y, tile.width, tile.height));
+                auto viewRoot = vsg::StateGroup::create();
+                viewRoot->add(MARSStateGroup::createWorldTransformBinding(tile.worldTransformUniform));
+                viewRoot->addChild(scene);
+                views.push_back(vsg::View::create(camera, viewRoot));
+                renderGraph->addChild(views.back());
+            }
+
+            // copy the whole atlas at once into host visible memory
+            VkDeviceSize bufferSize = static_cast<VkDeviceSize>(atlasWidth) * atlasHeight * 4;
+            readBackBuffer = vsg::createBufferAndMemory(device, bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                        VK_SHARING_MODE_EXCLUSIVE,
+                                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            VkBufferImageCopy region{};
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+            region.imageOffset = {0, 0, 0};
+            region.imageExtent = {atlasWidth, atlasHeight, 1};
+            auto copyImage = vsg::CopyImageToBuffer::create();
+            copyImage->srcImage = colorImage;
+            copyImage->srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            copyImage->dstBuffer = readBackBuffer;
+            copyImage->regions.push_back(region);
+
+            auto hostBarrier = vsg::BufferMemoryBarrier::create(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT,
+                                                                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                                readBackBuffer, 0, VK_WHOLE_SIZE);
+            auto pipelineBarrier = vsg::PipelineBarrier::create(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, hostBarrier);
+
+            int queueFamily = device->getPhysicalDevice()->getQueueFamily(VK_QUEUE_GRAPHICS_BIT);
+            commandGraph = vsg::CommandGraph::create(device, queueFamily);
+            commandGraph->addChild(renderGraph);
+            commandGraph->addChild(copyImage);
+            commandGraph->addChild(pipelineBarrier);
+            return commandGraph;
+        }
+
+        bool CameraAtlas::updateWorldTransforms()
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            bool changed = false;
+            for(auto &it: tiles)
+            {
+                Tile &tile = it.second;
+                vsg::mat4 projInverse(tile.perspective->inverse());
+                vsg::mat4 viewInverse(tile.lookAt->inverse());
+                WorldTransformUniform &worldTransform = tile.worldTransformUniform->value();
+                if(worldTransform.projInverse == projInverse &&
+                   worldTransform.viewInverse == viewInverse)
+                {
+                    continue;
+                }
+                worldTransform.projInverse = projInverse;
+                worldTransform.viewInverse = viewInverse;
+                tile.worldTransformUniform->dirty();
+                changed = true;
+            }
+            return changed;
+        }
+
+        void CameraAtlas::readBack(vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            if(!commandGraph)
+            {
+                return;
+            }
+            pendingReadBack = true;
+            finishReadBack(viewer, false);
+        }
+
+        void CameraAtlas::finishReadBack(vsg::ref_ptr<vsg::Viewer> viewer, bool wait)
+        {
+            if(!pendingReadBack || !commandGraph)
+            {
+                return;
+            }
+            for(auto &task: viewer->recordAndSubmitTasks)
+            {
+                if(std::find(task->commandGraphs.begin(), task->commandGraphs.end(), commandGraph) != task->commandGraphs.end())
+                {
+                    auto fence = task->fence();
+                    if(fence && fence->wait(wait ? std::numeric_limits<uint64_t>::max() : 0) != VK_SUCCESS)
+                    {
+                        // still rendering, try again before the next frame
+                        return;
+                    }
+                }
+            }
+            pendingReadBack = false;
+
+            auto deviceMemory = readBackBuffer->getDeviceMemory(device->deviceID);
+            VkDeviceSize offset = readBackBuffer->getMemoryOffset(device->deviceID);
+            VkDeviceSize size = static_cast<VkDeviceSize>(atlasWidth) * atlasHeight * 4;
+            void *data = nullptr;
+            if(deviceMemory->map(offset, size, 0, &data) != VK_SUCCESS)
+            {
+                LOG_ERROR("CameraAtlas::readBack: failed to map read back buffer");
+                return;
+            }
+            const uint8_t *atlas = static_cast<const uint8_t*>(data);
+            {
+                std::lock_guard<std::mutex> lock(imageMutex);
+                for(auto &it: tiles)
+                {
+                    Tile &tile = it.second;
+                    // cameras added since the last build are not in the atlas yet
+                    if(!tile.placed)
+                    {
+                        continue;
+                    }
+                    size_t rowSize = tile.width * 4;
+                    tile.image.resize(rowSize * tile.height);
+                    for(uint32_t row=0; row<tile.height; ++row)
+                    {
+                        memcpy(tile.image.data() + row*rowSize,
+                               atlas + ((tile.y+row)*atlasWidth + tile.x)*4, rowSize);
+                    }
+                }
+            }
+            deviceMemory->unmap();
+        }
+
+        bool CameraAtlas::getImage(unsigned long id, std::vector<uint8_t> &image,
+                                   int *width, int *height)
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            auto it = tiles.find(id);
+            if(it == tiles.end() || it->second.image.empty())
+            {
+                return false;
+            }
+            image = it->second.image;
+            *width = it->second.width;
+            *height = it->second.height;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "gui_helper_functions.hpp"
+
+#include <mars_utils/Vector.h>
+#include <mars_utils/Quaternion.h>
+
+#include <vsg/all.h>
+
+#include <mutex>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        /**
+         * Renders many small camera sensors as tiles of one shared offscreen
+         * render target. All tiles are recorded into one render pass and one
+         * command graph, the whole atlas is copied into a host visible buffer
+         * at once and split into one image per camera afterwards.
+         */
+        class CameraAtlas
+        {
+         public:
+            CameraAtlas(vsg::ref_ptr<vsg::Node> scene);
+            ~CameraAtlas();
+
+            void addCamera(unsigned long id, uint32_t width, uint32_t height);
+            void removeCamera(unsigned long id);
+            bool hasCamera(unsigned long id) const;
+            /** The camera looks along the local x-axis with the z-axis up. */
+            void setCameraPose(unsigned long id, const utils::Vector &pos,
+                               const utils::Quaternion &q);
+            void setCameraProjection(unsigned long id, double fovy,
+                                     double nearPlane, double farPlane);
+
+            inline bool needsRebuild() const
+                { return rebuild; }
+            inline vsg::ref_ptr<vsg::CommandGraph> getCommandGraph()
+                { return commandGraph; }
+            vsg::ref_ptr<vsg::CommandGraph> build(vsg::ref_ptr<vsg::Device> device);
+            /** Returns true if any camera changed since the last call. */
+            bool updateWorldTransforms();
+            /**
+             * Called after the atlas frame was submitted. Copies out all
+             * tiles if the frame is already finished, otherwise the images
+             * are delivered by finishReadBack() one frame late.
+             */
+            void readBack(vsg::ref_ptr<vsg::Viewer> viewer);
+            /**
+             * Copies out the tiles of a submitted frame once it is finished.
+             * With wait it blocks until then, this is needed before the
+             * next frame overwrites the read back buffer.
+             */
+            void finishReadBack(vsg::ref_ptr<vsg::Viewer> viewer, bool wait);
+            /** The views of the tiles and their render pass for compiling. */
+            inline const std::vector<vsg::ref_ptr<vsg::View>>& getViews() const
+                { return views; }
+            inline vsg::ref_ptr<vsg::RenderPass> getRenderPass()
+                { return renderPass; }
+            /** Returns the RGBA image of a camera, first row is the top row. */
+            bool getImage(unsigned long id, std::vector<uint8_t> &image,
+                          int *width, int *height);
+
+        private:
+            struct Tile
+            {
+                uint32_t x, y, width, height;
+                // false until the tile is packed into the atlas by build()
+                bool placed;
+                vsg::ref_ptr<vsg::LookAt> lookAt;
+                vsg::ref_ptr<vsg::Perspective> perspective;
+                vsg::ref_ptr<WorldTransformUniformValue> worldTransformUniform;
+                std::vector<uint8_t> image;
+            };
+
+            vsg::ref_ptr<vsg::Node> scene;
+            // the tiles are changed by the simulation and read back by
+            // the render thread
+            std::map<unsigned long, Tile> tiles;
+            mutable std::mutex imageMutex;
+            bool rebuild, pendingReadBack;
+            uint32_t atlasWidth, atlasHeight;
+            vsg::ref_ptr<vsg::Device> device;
+            vsg::ref_ptr<vsg::CommandGraph> commandGraph;
+            vsg::ref_ptr<vsg::Buffer> readBackBuffer;
+            vsg::ref_ptr<vsg::RenderPass> renderPass;
+            std::vector<vsg::ref_ptr<vsg::View>> views;
+        };
+    }
+}
@@ -0,0 +1,338 @@
+#include "ClipmapTerrain.hpp"
+#include "MARSStateGroup.hpp"
+#include "CompileScheduler.hpp"
+#include "PipelineCache.hpp"
+#include "shader/ShaderCache.hpp"
+#include "shader/ShaderNodeLibrary.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::vector<vsg::observer_ptr<ClipmapTerrain>> ClipmapTerrain::terrains;
+
+        // the levels morph to the next coarser grid in the outer 30%
+        static const float morphStart = 0.7f;
+        // fixed entries of the terrain data in front of the levels
+        static const uint32_t terrainDataHeader = 3;
+
+        // records the levels of the view being recorded, other visitors
+        // like the compile traversal see the levels of all views
+        class ClipmapTerrain::DrawNode : public vsg::Inherit<vsg::Node, DrawNode>
+        {
+         public:
+            vsg::ref_ptr<vsg::Node> defaultLevels;
+            std::map<uint32_t, vsg::ref_ptr<vsg::Node>> viewLevels;
+
+            void traverse(vsg::Visitor &visitor) override
+                {
+                    defaultLevels->accept(visitor);
+                    for(auto &it: viewLevels)
+                    {
+                        it.second->accept(visitor);
+                    }
+                }
+            void traverse(vsg::ConstVisitor &visitor) const override
+                {
+                    defaultLevels->accept(visitor);
+                    for(auto &it: viewLevels)
+                    {
+                        it.second->accept(visitor);
+                    }
+                }
+            void traverse(vsg::RecordTraversal &visitor) const override
+                {
+                    auto it = viewLevels.find(visitor.getCommandBuffer()->viewID);
+                    if(it != viewLevels.end())
+                    {
+                        it->second->accept(visitor);
+                    }
+                    else
+                    {
+                        defaultLevels->accept(visitor);
+                    }
+                }
+        };
+
+        ClipmapTerrain::ClipmapTerrain(vsg::ref_ptr<vsg::floatArray2D> heights_,
+                                       double sizeX_, double sizeY_, double scaleZ_,
+                                       const vsg::vec4 &color_) :
+            heights(heights_), sizeX(sizeX_), sizeY(sizeY_), scaleZ(scaleZ_),
+            color(color_), numLevels(1)
+        {
+            // the finest level resolves one texel per cell, the coarsest
+            // one covers the terrain from any point on it
+            cellSize = std::max(sizeX/std::max(1u, heights->width()-1),
+                                sizeY/std::max(1u, heights->height()-1));
+            double extent = 2.0*std::max(sizeX, sizeY);
+            while(numLevels < 16 && gridSize*cellSize*(1u << (numLevels-1)) < extent)
+            {
+                ++numLevels;
+            }
+            createGrid();
+            stateGroup = createPipelineState(terrainDataHeader + numLevels);
+            defaultLevels = createLevels();
+            drawNode = DrawNode::create();
+            drawNode->defaultLevels = defaultLevels.node;
+            terrains.push_back(vsg::observer_ptr<ClipmapTerrain>(this));
+        }
+
+        vsg::ref_ptr<vsg::Node> ClipmapTerrain::getDrawNode()
+        {
+            return drawNode;
+        }
+
+        void ClipmapTerrain::createGrid()
+        {
+            // vertices in cell coordinates of the grid
+            const uint32_t n = gridSize + 1;
+            vertices = vsg::vec2Array::create(n*n);
+            for(uint32_t y=0; y<n; ++y)
+            {
+                for(uint32_t x=0; x<n; ++x)
+                {
+                    vertices->at(y*n+x).set(x, y);
+                }
+            }
+            // the hole of a ring is one cell smaller than the next finer
+            // level, the snapping of the levels differs by up to one cell
+            // and the overlap is discarded in the fragment shader
+            const uint32_t holeMin = gridSize/4 + 1, holeMax = 3*gridSize/4 - 1;
+            std::vector<uint32_t> ring, center;
+            for(uint32_t y=0; y<gridSize; ++y)
+            {
+                for(uint32_t x=0; x<gridSize; ++x)
+                {
+                    bool hole = x >= holeMin && x < holeMax && y >= holeMin && y < holeMax;
+                    std::vector<uint32_t> &indices = hole ? center : ring;
+                    uint32_t i = y*n+x;
+                    indices.insert(indices.end(), {i, i+1, i+n+1, i, i+n+1, i+n});
+                }
+            }
+            auto createIndices = [](const std::vector<uint32_t> &indices)
+            {
+                auto indexArray = vsg::uintArray::create(indices.size());
+                std::copy(indices.begin(), indices.end(), indexArray->begin());
+                return indexArray;
+            };
+            ringIndices = createIndices(ring);
+            centerIndices = createIndices(center);
+        }
+
+        ClipmapTerrain::Levels ClipmapTerrain::createLevels()
+        {
+            Levels levels;
+            levels.terrainData = vsg::vec4Array::create(terrainDataHeader + numLevels);
+            levels.terrainData->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+            levels.terrainData->at(0).set(sizeX, sizeY, scaleZ, numLevels);
+            levels.terrainData->at(1).set(gridSize, morphStart, 0, 0);
+            levels.terrainData->at(2) = color;
+            for(uint32_t i=0; i<numLevels; ++i)
+            {
+                levels.terrainData->at(terrainDataHeader+i).set(0, 0, cellSize*(1u << i), 0);
+            }
+
+            auto createDraw = [&](vsg::ref_ptr<vsg::uintArray> indices)
+            {
+                auto draw = vsg::VertexIndexDraw::create();
+                draw->assignArrays(vsg::DataList{vertices});
+                draw->assignIndices(indices);
+                draw->indexCount = static_cast<uint32_t>(indices->size());
+                return draw;
+            };
+            levels.ringDraw = createDraw(ringIndices);
+            levels.ringDraw->instanceCount = numLevels;
+            // fills the hole of the finest drawn level
+            levels.centerDraw = createDraw(centerIndices);
+            levels.centerDraw->instanceCount = 1;
+            auto node = vsg::StateGroup::create();
+            node->add(bindTerrainData(levels.terrainData, heights));
+            node->addChild(levels.centerDraw);
+            node->addChild(levels.ringDraw);
+            levels.node = node;
+            return levels;
+        }
+
+        vsg::ref_ptr<vsg::StateGroup> ClipmapTerrain::createPipelineState(uint32_t dataSize)
+        {
+            auto layout = MARSStateGroup::getPipelineLayout();
+            std::set<std::string> defines;
+            if(MARSStateGroup::useMaterialTable())
+            {
+                // binding 1 is a storage buffer in material table mode
+                defines.insert("MARS_MATERIAL_TABLE");
+            }
+            vsg::ShaderStage::SpecializationConstants constants{
+                {0, vsg::intValue::create(static_cast<int>(dataSize))},
+                {3, vsg::intValue::create(static_cast<int>(1 + 4*MARSStateGroup::getLightCount()))}};
+            auto vertexShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_VERTEX_BIT,
+                                                               ShaderNodeLibrary::getSource("graph_shader/terrain_clipmap.vert"),
+                                                               defines);
+            auto fragmentShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_FRAGMENT_BIT,
+                                                                 ShaderNodeLibrary::getSource("graph_shader/terrain_clipmap.frag"),
+                                                                 defines);
+            vertexShader->specializationConstants = constants;
+            fragmentShader->specializationConstants = constants;
+
+            auto rasterState = vsg::RasterizationState::create();
+            rasterState->cullMode = VK_CULL_MODE_NONE;
+            auto depthState = vsg::DepthStencilState::create();
+            depthState->depthTestEnable = VK_TRUE;
+            depthState->depthWriteEnable = VK_TRUE;
+            depthState->depthCompareOp = VK_COMPARE_OP_GREATER;
+            vsg::GraphicsPipelineStates pipelineStates{
+                vsg::VertexInputState::create(vsg::VertexInputState::Bindings{VkVertexInputBindingDescription{0, sizeof(vsg::vec2), VK_VERTEX_INPUT_RATE_VERTEX}},
+                                              vsg::VertexInputState::Attributes{VkVertexInputAttributeDescription{0, 0, VK_FORMAT_R32G32_SFLOAT, 0}}),
+                vsg::InputAssemblyState::create(),
+                rasterState,
+                vsg::MultisampleState::create(),
+                vsg::ColorBlendState::create(),
+                depthState};
+            auto pipeline = CachedGraphicsPipeline::create(layout, vsg::ShaderStages{vertexShader, fragmentShader}, pipelineStates);
+            CompileScheduler::add(pipeline);
+
+            auto state = vsg::StateGroup::create();
+            state->add(CachedBindGraphicsPipeline::create(pipeline));
+            state->add(vsg::BindViewDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1));
+            return state;
+        }
+
+        vsg::ref_ptr<vsg::BindDescriptorSet> ClipmapTerrain::bindTerrainData(vsg::ref_ptr<vsg::vec4Array> data,
+                                                                              vsg::ref_ptr<vsg::floatArray2D> heightMap)
+        {
+            VkDescriptorType dataType = MARSStateGroup::useMaterialTable() ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            // texels are fetched and interpolated in the shader
+            auto sampler = vsg::Sampler::create();
+            sampler->magFilter = VK_FILTER_NEAREST;
+            sampler->minFilter = VK_FILTER_NEAREST;
+            sampler->addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+            sampler->addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+            auto heightDescriptor = vsg::DescriptorImage::create(sampler, heightMap, 2, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+            auto dataDescriptor = vsg::DescriptorBuffer::create(data, 1, 0, dataType);
+            auto descriptorSet = vsg::DescriptorSet::create(MARSStateGroup::getMaterialDescriptorSetLayout(),
+                                                            vsg::Descriptors{dataDescriptor, heightDescriptor});
+            return vsg::BindDescriptorSet::create(VK_PIPELINE_BIND_POINT_GRAPHICS, MARSStateGroup::getPipelineLayout(), 0, descriptorSet);
+        }
+
+        void ClipmapTerrain::setTransform(vsg::ref_ptr<vsg::MatrixTransform> transform_)
+        {
+            transform = transform_;
+        }
+
+        float ClipmapTerrain::getHeight(double x, double y) const
+        {
+            double u = std::clamp(x/sizeX + 0.5, 0.0, 1.0)*(heights->width()-1);
+            double v = std::clamp(y/sizeY + 0.5, 0.0, 1.0)*(heights->height()-1);
+            return heights->at(static_cast<uint32_t>(std::lround(u)),
+                               static_cast<uint32_t>(std::lround(v)))*scaleZ;
+        }
+
+        bool ClipmapTerrain::updateLevels(Levels &levels, const vsg::dvec3 &eye)
+        {
+            vsg::dvec3 localEye = transform ? vsg::inverse(transform->matrix)*eye : eye;
+            // levels much finer than the distance to the ground are not
+            // visible, the finest drawn level covers the eye altitude
+            double altitude = std::abs(localEye.z - getHeight(localEye.x, localEye.y));
+            uint32_t level = 0;
+            while(level+1 < numLevels && 0.25*gridSize*cellSize*(1u << level) < altitude)
+            {
+                ++level;
+            }
+            bool changed = level != levels.minLevel;
+            levels.minLevel = level;
+            for(uint32_t i=0; i<numLevels; ++i)
+            {
+                // snapped to the cells of the next coarser level
+                double snap = 2.0*cellSize*(1u << i);
+                vsg::vec4 &data = levels.terrainData->at(terrainDataHeader+i);
+                float x = static_cast<float>(std::floor(localEye.x/snap + 0.5)*snap);
+                float y = static_cast<float>(std::floor(localEye.y/snap + 0.5)*snap);
+                if(data.x != x || data.y != y)
+                {
+                    data.x = x;
+                    data.y = y;
+                    changed = true;
+                }
+            }
+            if(changed)
+            {
+                levels.terrainData->at(1).z = static_cast<float>(levels.minLevel);
+                levels.terrainData->dirty();
+                levels.ringDraw->firstInstance = levels.minLevel;
+                levels.ringDraw->instanceCount = numLevels - levels.minLevel;
+                levels.centerDraw->firstInstance = levels.minLevel;
+            }
+            return changed;
+        }
+
+        bool ClipmapTerrain::update(const std::vector<vsg::ref_ptr<vsg::View>> &views, vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            bool changed = false;
+            for(size_t i=0; i<views.size(); ++i)
+            {
+                auto &view = views[i];
+                if(!view->camera || !view->camera->viewMatrix)
+                {
+                    continue;
+                }
+                vsg::dvec3 eye = view->camera->viewMatrix->inverse()*vsg::dvec3(0.0, 0.0, 0.0);
+                if(i == 0)
+                {
+                    // also drawn by views without levels of their own
+                    changed |= updateLevels(defaultLevels, eye);
+                    continue;
+                }
+                auto it = viewLevels.find(view->viewID);
+                if(it == viewLevels.end())
+                {
+                    if(!viewer->compileManager)
+                    {
+                        continue;
+                    }
+                    Levels levels = createLevels();
+                    updateLevels(levels, eye);
+                    auto result = viewer->compileManager->compile(levels.node);
+                    if(!result)
+                    {
+                        LOG_ERROR("ClipmapTerrain: failed to compile the levels of view %u", view->viewID);
+                        continue;
+                    }
+                    vsg::updateViewer(*viewer, result);
+                    it = viewLevels.emplace(view->viewID, levels).first;
+                    drawNode->viewLevels[view->viewID] = levels.node;
+                    changed = true;
+                }
+                changed |= updateLevels(it->second, eye);
+            }
+            return changed;
+        }
+
+        bool ClipmapTerrain::updateAll(const std::vector<vsg::ref_ptr<vsg::View>> &views, vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            bool changed = false;
+            for(auto it = terrains.begin(); it != terrains.end();)
+            {
+                vsg::ref_ptr<ClipmapTerrain> terrain(*it);
+                if(!terrain)
+                {
+                    // the draw object of the terrain is gone
+                    it = terrains.erase(it);
+                    continue;
+                }
+                changed |= terrain->update(views, viewer);
+                ++it;
+            }
+            return changed;
+        }
+
+        void ClipmapTerrain::clear()
+        {
+            terrains.clear();
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        /**
+         * Heightmap terrain rendered as geometry clipmap. One grid of
+         * gridSize x gridSize cells is drawn as ring per level around the
+         * eye, each level doubling the cell size of the previous one, and
+         * displaced by the heightmap in the vertex shader. The vertex count
+         * only depends on the grid size and the number of levels, not on
+         * the resolution or extent of the heightmap.
+         *
+         * The terrain is centered at the origin of its transform and uses
+         * the pipeline layout of the materials. Its data is bound at set 0:
+         * level data at binding 1 and the heightmap at binding 2.
+         *
+         * Every view gets levels of its own around its eye, the draw node
+         * records the levels of the view being recorded. Views not yet
+         * updated use the levels of the first view.
+         */
+        class ClipmapTerrain : public vsg::Inherit<vsg::Object, ClipmapTerrain>
+        {
+         public:
+            static const uint32_t gridSize = 64;
+
+            /**
+             * \param heights heightmap in [0, 1], the first row is at -y
+             * \param sizeX, sizeY extent of the terrain in meters
+             * \param scaleZ height of the heightmap value 1
+             */
+            ClipmapTerrain(vsg::ref_ptr<vsg::floatArray2D> heights,
+                           double sizeX, double sizeY, double scaleZ,
+                           const vsg::vec4 &color);
+
+            /** State of the terrain, the transform of the terrain is its child. */
+            inline vsg::ref_ptr<vsg::StateGroup> getStateGroup()
+                { return stateGroup; }
+            /** Draw commands of all levels to be placed below the transform. */
+            vsg::ref_ptr<vsg::Node> getDrawNode();
+            void setTransform(vsg::ref_ptr<vsg::MatrixTransform> transform);
+
+            /**
+             * Moves the levels of every view to its eye, the levels of new
+             * views are created and compiled. Has to be called between two
+             * frames. Returns true if any level moved.
+             */
+            bool update(const std::vector<vsg::ref_ptr<vsg::View>> &views, vsg::ref_ptr<vsg::Viewer> viewer);
+            /** Updates all existing terrains, called once per frame. */
+            static bool updateAll(const std::vector<vsg::ref_ptr<vsg::View>> &views, vsg::ref_ptr<vsg::Viewer> viewer);
+            static void clear();
+
+            /**
+             * Pipeline and view state of the terrain shaders for terrain
+             * data of dataSize entries, shared with the paged terrains.
+             */
+            static vsg::ref_ptr<vsg::StateGroup> createPipelineState(uint32_t dataSize);
+            /** Binds the terrain data and the heightmap at set 0. */
+            static vsg::ref_ptr<vsg::BindDescriptorSet> bindTerrainData(vsg::ref_ptr<vsg::vec4Array> data,
+                                                                        vsg::ref_ptr<vsg::floatArray2D> heightMap);
+
+        private:
+            // the levels placed around the eye of one view
+            struct Levels
+            {
+                vsg::ref_ptr<vsg::vec4Array> terrainData;
+                vsg::ref_ptr<vsg::VertexIndexDraw> ringDraw, centerDraw;
+                vsg::ref_ptr<vsg::Node> node;
+                uint32_t minLevel = 0;
+            };
+            class DrawNode;
+
+            vsg::ref_ptr<vsg::floatArray2D> heights;
+            double sizeX, sizeY, scaleZ;
+            vsg::vec4 color;
+            uint32_t numLevels;
+            double cellSize;
+            vsg::ref_ptr<vsg::vec2Array> vertices;
+            vsg::ref_ptr<vsg::uintArray> ringIndices, centerIndices;
+            vsg::ref_ptr<vsg::StateGroup> stateGroup;
+            vsg::ref_ptr<DrawNode> drawNode;
+            Levels defaultLevels;
+            std::map<uint32_t, Levels> viewLevels;
+            vsg::ref_ptr<vsg::MatrixTransform> transform;
+
+            // the draw objects own the terrains
+            static std::vector<vsg::observer_ptr<ClipmapTerrain>> terrains;
+
+            void createGrid();
+            Levels createLevels();
+            bool updateLevels(Levels &levels, const vsg::dvec3 &eye);
+            float getHeight(double x, double y) const;
+        };
+    }
+}
@@ -0,0 +1,216 @@
+#include "CompileScheduler.hpp"
+#include "PipelineCache.hpp"
+#include "shader/ShaderCache.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <chrono>
+#include <future>
+#include <set>
+#include <thread>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> CompileScheduler::pending;
+        std::mutex CompileScheduler::mutex;
+
+        using Clock = std::chrono::steady_clock;
+
+        static double elapsedMs(Clock::time_point start)
+        {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+
+        // runs task(i) for i in [0, count) in chunks on numThreads threads,
+        // every chunk gets its own context created by createContexts()
+        template<typename CreateContexts, typename Task>
+        static double runParallel(size_t count, unsigned int numThreads,
+                                  CreateContexts createContexts, Task task)
+        {
+            size_t chunkSize = (count + numThreads - 1) / numThreads;
+            std::vector<std::future<double>> results;
+            for(size_t begin=0; begin<count; begin+=chunkSize)
+            {
+                size_t end = std::min(begin+chunkSize, count);
+                results.push_back(std::async(std::launch::async, [=]()
+                {
+                    Clock::time_point start = Clock::now();
+                    auto contexts = createContexts();
+                    for(size_t i=begin; i<end; ++i)
+                    {
+                        task(contexts, i);
+                    }
+                    return elapsedMs(start);
+                }));
+            }
+            double sequential = 0.0;
+            for(auto &result: results)
+            {
+                sequential += result.get();
+            }
+            return sequential;
+        }
+
+        void CompileScheduler::add(vsg::ref_ptr<vsg::GraphicsPipeline> pipeline)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(pipeline);
+        }
+
+        bool CompileScheduler::hasPending()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return !pending.empty();
+        }
+
+        void CompileScheduler::compile(vsg::ref_ptr<vsg::Device> device,
+                                       const std::vector<ViewTarget> &targets,
+                                       unsigned int numThreads)
+        {
+            std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> pipelines;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pipelines.swap(pending);
+            }
+            compile(device, targets, numThreads, pipelines);
+            PipelineCache::logTiming();
+        }
+
+        std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> CompileScheduler::compile(vsg::ref_ptr<vsg::Device> device,
+                                                                                   const std::vector<ViewTarget> &targets,
+                                                                                   unsigned int numThreads,
+                                                                                   const std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> &pipelines)
+        {
+            if(pipelines.empty() || targets.empty() || !device)
+            {
+                return {};
+            }
+            if(numThreads == 0)
+            {
+                numThreads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            Clock::time_point start = Clock::now();
+
+            // shader modules can be shared between pipelines, compile each
+            // one only once
+            std::vector<vsg::ref_ptr<vsg::ShaderStage>> stages;
+            std::set<vsg::ShaderModule*> modules;
+            for(auto &pipeline: pipelines)
+            {
+                for(auto &stage: pipeline->stages)
+                {
+                    if(stage->module && modules.insert(stage->module.get()).second)
+                    {
+                        stages.push_back(stage);
+                    }
+                }
+            }
+            auto createDeviceContext = [device]()
+            {
+                return vsg::Context::create(device);
+            };
+            // GLSL is compiled to SPIR-V here unless it was found in the
+            // shader cache, a stage without code is never handed to Vulkan
+            std::vector<char> stageFailed(stages.size(), 0);
+            double sequential = runParallel(stages.size(), numThreads, createDeviceContext,
+                                            [&stages, &stageFailed](vsg::ref_ptr<vsg::Context> &context, size_t i)
+                                            {
+                                                if(!ShaderCache::compile(stages[i]))
+                                                {
+                                                    stageFailed[i] = 1;
+                                                    return;
+                                                }
+                                                stages[i]->compile(*context);
+                                            });
+            std::set<vsg::ShaderModule*> failedModules;
+            for(size_t i=0; i<stages.size(); ++i)
+            {
+                if(stageFailed[i])
+                {
+                    failedModules.insert(stages[i]->module.get());
+                }
+            }
+            std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> validPipelines;
+            for(auto &pipeline: pipelines)
+            {
+                bool valid = true;
+                for(auto &stage: pipeline->stages)
+                {
+                    valid = valid && (!stage->module || !failedModules.count(stage->module.get()));
+                }
+                if(valid)
+                {
+                    validPipelines.push_back(pipeline);
+                }
+            }
+            if(validPipelines.size() < pipelines.size())
+            {
+                LOG_ERROR("CompileScheduler: %zu pipelines are skipped because their shaders do not compile",
+                          pipelines.size() - validPipelines.size());
+            }
+
+            // the contexts of the views as vsg sets them up in CompileManager
+            auto createViewContexts = [device, &targets]()
+            {
+                std::vector<vsg::ref_ptr<vsg::Context>> contexts;
+                for(auto &target: targets)
+                {
+                    auto context = vsg::Context::create(device);
+                    context->viewID = target.view->viewID;
+                    context->viewDependentState = target.view->viewDependentState;
+                    context->renderPass = target.renderPass;
+                    if(target.view->camera && target.view->camera->viewportState)
+                    {
+                        context->defaultPipelineStates.push_back(target.view->camera->viewportState);
+                    }
+                    if(target.renderPass->maxSamples != VK_SAMPLE_COUNT_1_BIT)
+                    {
+                        context->overridePipelineStates.push_back(vsg::MultisampleState::create(target.renderPass->maxSamples));
+                    }
+                    contexts.push_back(context);
+                }
+                return contexts;
+            };
+
+            // the pipeline layouts are shared between the pipelines and
+            // have to be compiled before the pipelines
+            Clock::time_point layoutStart = Clock::now();
+            std::set<vsg::PipelineLayout*> layouts;
+            auto mainContexts = createViewContexts();
+            for(auto &pipeline: validPipelines)
+            {
+                if(pipeline->layout && layouts.insert(pipeline->layout.get()).second)
+                {
+                    for(auto &context: mainContexts)
+                    {
+                        pipeline->layout->compile(*context);
+                    }
+                }
+            }
+            sequential += elapsedMs(layoutStart);
+
+            sequential += runParallel(validPipelines.size(), numThreads, createViewContexts,
+                                      [&validPipelines](std::vector<vsg::ref_ptr<vsg::Context>> &contexts, size_t i)
+                                      {
+                                          for(auto &context: contexts)
+                                          {
+                                              validPipelines[i]->compile(*context);
+                                          }
+                                      });
+
+            double wallClock = elapsedMs(start);
+            LOG_INFO("CompileScheduler: compiled %zu shader stages and %zu pipelines for %zu views on %u threads in %.1f ms (sequential %.1f ms, saved %.1f ms)",
+                     stages.size(), validPipelines.size(), targets.size(), numThreads,
+                     wallClock, sequential, sequential - wallClock);
+            return validPipelines;
+        }
+
+        void CompileScheduler::clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.clear();
+        }
+    }
+}
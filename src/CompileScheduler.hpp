@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <mutex>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Collects the graphics pipelines created for the materials and
+         * compiles them concurrently before vsg compiles the scene. First
+         * all shader stages are compiled from GLSL to SPIR-V, if they are not
+         * found in the ShaderCache, and to shader modules, then
+         * the pipelines are created for every view. Pipelines that are
+         * already compiled for a view are skipped by viewer->compile().
+         */
+        class CompileScheduler
+        {
+        public:
+            struct ViewTarget
+            {
+                vsg::ref_ptr<vsg::View> view;
+                vsg::ref_ptr<vsg::RenderPass> renderPass;
+            };
+
+            static void add(vsg::ref_ptr<vsg::GraphicsPipeline> pipeline);
+            static bool hasPending();
+            /**
+             * Compiles all pending pipelines for the given views on
+             * \c numThreads threads (0: one per core) and logs the wall
+             * clock time compared to the summed compile time of all tasks.
+             */
+            static void compile(vsg::ref_ptr<vsg::Device> device,
+                                const std::vector<ViewTarget> &targets,
+                                unsigned int numThreads);
+            /**
+             * Compiles the given pipelines instead of the pending ones.
+             * Returns the pipelines that were compiled, pipelines with
+             * shaders that do not compile to SPIR-V are left out.
+             */
+            static std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> compile(vsg::ref_ptr<vsg::Device> device,
+                                const std::vector<ViewTarget> &targets,
+                                unsigned int numThreads,
+                                const std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> &pipelines);
+            static void clear();
+
+        private:
+            static std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> pending;
+            static std::mutex mutex;
+        };
+    }
+}
@@ -1,6 +1,11 @@
 #include "DrawObject.hpp"
 #include "shader/GraphShader.hpp"
 #include "gui_helper_functions.hpp"
+#include "ClipmapTerrain.hpp"
+#include "HeightfieldMesh.hpp"
+#include "HeightmapLoader.hpp"
+#include "MARSStateGroup.hpp"
+#include "PagedTerrain.hpp"
 #include <mars_utils/misc.h>
 
 namespace mars
@@ -67,8 +72,15 @@ namespace mars
 
             //fprintf(stderr, "createObject spec:\n%s\n", spec.toYamlString().c_str());
 
+            if(spec.get("physicmode", std::string()) == "terrain")
+            {
+                createTerrain(spec);
+                return;
+            }
+
             // todo: prefix material names by worlds?
             auto stateGroup = GuiHelper::createStateGroup(spec["material"]);
+            materialName = spec["material"]["name"].getString();
 
             if(spec.hasKey("filename"))
             {
@@ -153,6 +165,7 @@ material->diffuseFactor = vsg::vec4{0.0,0.9,1.0,1.0};
                     // drawObject = stateGroup;
 
                     materialStateGroup = stateGroup;
+                    MARSStateGroup::conformVertexArrays(drawObject);
 
                     // if(parent)
                     // {
@@ -172,6 +185,80 @@ material->diffuseFactor = vsg::vec4{0.0,0.9,1.0,1.0};
             }
         }
 
+        void DrawObject::createTerrain(configmaps::ConfigMap &spec)
+        {
+            std::string filename = spec.get("t_srcname", spec.get("filename", std::string()));
+            if(spec.get("t_mesh", false))
+            {
+                // the triangles of the physics heightfield with the material
+                // of the terrain instead of the clipmap shaders
+                auto heights = HeightmapLoader::load(filename);
+                if(!heights)
+                {
+                    LOG_ERROR("DrawObject: can not read heightmap %s", filename.c_str());
+                    return;
+                }
+                configmaps::ConfigMap material = spec["material"];
+                auto stateGroup = GuiHelper::createStateGroup(material);
+                materialName = material.get("name", std::string());
+                drawObject = HeightfieldMesh::build(*heights,
+                                                    spec.get("t_width", 1.0),
+                                                    spec.get("t_height", 1.0),
+                                                    spec.get("t_scale", 1.0));
+                MARSStateGroup::conformVertexArrays(drawObject);
+                materialStateGroup = stateGroup;
+                poseTransform->addChild(drawObject);
+                stateGroup->addChild(poseTransform);
+                return;
+            }
+            // large heightmaps are split into tiles once and paged in
+            vsg::ref_ptr<vsg::floatArray2D> heights;
+            auto tileSet = PagedTerrain::openTileSet(filename, heights);
+            if(!tileSet && !heights)
+            {
+                LOG_ERROR("DrawObject: can not read heightmap %s", filename.c_str());
+                return;
+            }
+            configmaps::ConfigMap material = spec["material"];
+            vsg::vec4 color(0.6f, 0.6f, 0.6f, 1.0f);
+            if(material.hasKey("diffuseColor"))
+            {
+                color.set((double)material["diffuseColor"]["r"], (double)material["diffuseColor"]["g"],
+                          (double)material["diffuseColor"]["b"], 1.0);
+            }
+            if(tileSet)
+            {
+                auto terrain = PagedTerrain::create(tileSet,
+                                                    spec.get("t_width", 1.0),
+                                                    spec.get("t_height", 1.0),
+                                                    spec.get("t_scale", 1.0),
+                                                    color);
+                // the tiles are selected in the frame of the terrain
+                terrain->setTransform(poseTransform);
+                drawObject = terrain->getDrawNode();
+                materialStateGroup = terrain->getStateGroup();
+                this->terrain = terrain;
+            }
+            else
+            {
+                auto terrain = ClipmapTerrain::create(heights,
+                                                      spec.get("t_width", 1.0),
+                                                      spec.get("t_height", 1.0),
+                                                      spec.get("t_scale", 1.0),
+                                                      color);
+                // the levels follow the eye in the frame of the terrain
+                terrain->setTransform(poseTransform);
+                drawObject = terrain->getDrawNode();
+                materialStateGroup = terrain->getStateGroup();
+                this->terrain = terrain;
+            }
+            // the terrain is not registered by the name of its material,
+            // material edits and assignments do not apply to it
+            poseTransform->addChild(drawObject);
+            materialStateGroup->addChild(poseTransform);
+            GuiHelper::addStateGroup(materialStateGroup);
+        }
+
         void DrawObject::setParent(vsg::ref_ptr<vsg::Group> parent_)
         {
             this->parent = parent_;
@@ -200,6 +287,32 @@ material->diffuseFactor = vsg::vec4{0.0,0.9,1.0,1.0};
             poseTransform->matrix = vsg::translate(p) * vsg::rotate(q);
         }
 
+        void DrawObject::setMaterialStateGroup(const std::string &name,
+                                               vsg::ref_ptr<vsg::StateGroup> stateGroup)
+        {
+            if(terrain)
+            {
+                return;
+            }
+            materialName = name;
+            if(!drawObject || !stateGroup || stateGroup == materialStateGroup)
+            {
+                return;
+            }
+            if(visible)
+            {
+                auto it = std::find(materialStateGroup->children.begin(),
+                                    materialStateGroup->children.end(),
+                                    poseTransform);
+                if(it != materialStateGroup->children.end())
+                {
+                    materialStateGroup->children.erase(it);
+                }
+                stateGroup->addChild(poseTransform);
+            }
+            materialStateGroup = stateGroup;
+        }
+
         void DrawObject::setVisible(bool v)
         {
             if(v != visible)
@@ -8,6 +8,8 @@
 
 #include <vsg/all.h>
 
+#include <optional>
+
 namespace mars
 {
     namespace vsg_graphics
@@ -27,6 +29,25 @@ namespace mars
             inline const utils::Quaternion& getQuaternion()
                 { return quaternion; }
             void setVisible(bool v);
+            /**
+             * Moves the object below the state group of another material.
+             * Clipmap and paged terrains draw with their own shaders and
+             * keep their state group.
+             */
+            void setMaterialStateGroup(const std::string &name,
+                                       vsg::ref_ptr<vsg::StateGroup> stateGroup);
+            inline vsg::ref_ptr<vsg::StateGroup> getMaterialStateGroup()
+                { return materialStateGroup; }
+            inline const std::string& getMaterialName()
+                { return materialName; }
+            /**
+             * Blending forced by setBlending() regardless of the material,
+             * kept when the material is edited or replaced.
+             */
+            inline void setBlending(bool mode)
+                { blending = mode; }
+            inline const std::optional<bool>& getBlending()
+                { return blending; }
 
         private:
             vsg::ref_ptr<vsg::MatrixTransform> poseTransform;
@@ -34,11 +55,16 @@ namespace mars
             vsg::ref_ptr<vsg::Node> drawObject;
             vsg::ref_ptr<vsg::Group> parent;
             vsg::ref_ptr<vsg::StateGroup> materialStateGroup;
+            // clipmap or paged terrain drawn by this object
+            vsg::ref_ptr<vsg::Object> terrain;
+            std::string materialName;
+            std::optional<bool> blending;
             utils::Vector position;
             utils::Quaternion quaternion;
             bool visible;
 
             void applyTransform();
+            void createTerrain(configmaps::ConfigMap &spec);
         };
     }
 }
@@ -2,9 +2,23 @@
 
 #include "GraphicsManager.hpp"
 #include "DrawObject.hpp"
+#include "GraphicsWindow.hpp"
+#include "CameraAtlas.hpp"
+#include "ClipmapTerrain.hpp"
+#include "PagedTerrain.hpp"
+#include "CompileScheduler.hpp"
+#include "PipelineCache.hpp"
+#include "TextureManager.hpp"
+#include "TextureCache.hpp"
+#include "shader/ShaderCache.hpp"
+#include "shader/ShaderNodeLibrary.hpp"
+#include "shader/ShaderWatcher.hpp"
+#include "MARSStateGroup.hpp"
 #include "config.h"
 #include <vsgXchange/all.h>
 #include <mars_utils/misc.h>
+#include <algorithm>
+#include <thread>
 
 namespace mars
 {
@@ -14,27 +28,86 @@ namespace mars
     namespace vsg_graphics
     {
 
+        // runs the preGraphicsUpdate of an independent update interface
+        // on one of the update threads and signals the frame latch
+        struct PreGraphicsUpdateOperation : public vsg::Inherit<vsg::Operation, PreGraphicsUpdateOperation>
+        {
+            PreGraphicsUpdateOperation(GraphicsUpdateInterface *g, vsg::ref_ptr<vsg::Latch> l) :
+                graphicsUpdateObject(g), latch(l) {}
+
+            void run() override
+                {
+                    // the frame waits for the latch, it is counted down even
+                    // if the callback fails
+                    try
+                    {
+                        graphicsUpdateObject->preGraphicsUpdate();
+                    }
+                    catch(std::exception &e)
+                    {
+                        LOG_ERROR("GraphicsManager: preGraphicsUpdate failed: %s", e.what());
+                    }
+                    catch(...)
+                    {
+                        LOG_ERROR("GraphicsManager: preGraphicsUpdate failed");
+                    }
+                    latch->count_down();
+                }
+
+            GraphicsUpdateInterface *graphicsUpdateObject;
+            vsg::ref_ptr<vsg::Latch> latch;
+        };
+
         GraphicsManager::GraphicsManager(lib_manager::LibManager *theManager,
                                          void *QTWidget)
-            : GraphicsManagerInterface(theManager), window(nullptr), container(nullptr), guiHelper{new GuiHelper{this}}
+            : GraphicsManagerInterface(theManager), nextWindowID(1), mainWindowID(0), cameraAtlas(nullptr), shaderWatcher(nullptr), guiHelper{new GuiHelper{this}}
         {
             (void)QTWidget;
             dirty = true;
+            frameRequested = true;
+            numUpdateThreads.iValue = 0;
+            renderOnDemand.bValue = false;
+            numCompileThreads.iValue = 0;
+            numTextureThreads.iValue = 0;
+            compressTextures.bValue = false;
+            lightCount.iValue = 2;
+            materialTable.bValue = false;
+            materialTableSize.iValue = 4096;
+            texturePool.iValue = 0;
+            terrainPagingSize.iValue = 4096;
+            terrainMemoryBudget.iValue = 256;
+            terrainPhysicsSamples.iValue = 0;
+            shaderHotReload.bValue = false;
         }
 
         GraphicsManager::~GraphicsManager()
         {
+            if(updateThreads)
+            {
+                updateThreads->stop();
+            }
             if(cfg)
             {
                 libManager->releaseLibrary("cfg_manager");
             }
+            // keep the compiled pipelines for the next run
+            PipelineCache::save();
+            PipelineCache::clear();
             for(auto it: drawObjects)
             {
                 delete it.second;
             }
-            if(window)
+            for(auto it: graphicsWindows)
+            {
+                delete it.second;
+            }
+            if(cameraAtlas)
             {
-                delete window;
+                delete cameraAtlas;
+            }
+            if(shaderWatcher)
+            {
+                delete shaderWatcher;
             }
             delete guiHelper;
         }
@@ -51,16 +124,20 @@ namespace mars
                     return;
                 }
                 setupCFG();
+                // index all shader node functions once, shader generation
+                // then works from memory
+                ShaderNodeLibrary::load(resourcesPath.sValue);
+                if(shaderHotReload.bValue)
+                {
+                    shaderWatcher = new ShaderWatcher(pathJoin(resourcesPath.sValue, "resources/graph_shader"));
+                }
 
                 nextDrawID = 1;
 
-                auto traits = vsg::WindowTraits::create();
                 // auto options = vsg::Options::create();
                 // options->sharedObjects = vsg::SharedObjects::create();
                 // options->fileCache = vsg::getEnv("VSG_FILE_CACHE");
                 // options->paths = vsg::getEnvPaths("VSG_FILE_PATH");
-                traits->windowTitle = "mars view";
-
                 rootNode = vsg::Group::create();
 
                 if(showCoords_.bValue)
@@ -68,68 +145,88 @@ namespace mars
                     showCoords();
                 }
 
+                lightGroup = vsg::Group::create();
+                rootNode->addChild(lightGroup);
                 auto ambientLight = vsg::AmbientLight::create();
                 ambientLight->name = "ambient";
                 ambientLight->color.set(1.0f, 1.0f, 1.0f);
                 ambientLight->intensity = 0.02f;
-                rootNode->addChild(ambientLight);
+                lightGroup->addChild(ambientLight);
 
                 auto directionalLight = vsg::DirectionalLight::create();
                 directionalLight->name = "directional";
                 directionalLight->color.set(1.0f, 1.0f, 1.0f);
                 directionalLight->intensity = 0.7f;
                 directionalLight->direction.set(-1.0f, -1.0f, -1.0f);
-                rootNode->addChild(directionalLight);
+                lightGroup->addChild(directionalLight);
+                // size the light data of the material shaders for the scene
+                // lights, at least the ambient and the directional light
+                MARSStateGroup::setLightCount(std::max(2, lightCount.iValue));
+
+
+                // Split the materials into bins and record every bin into
+                // its own secondary command buffer. Each bin is rendered by
+                // its own view and needs the lights in its subgraph, the
+                // light group is shared thus later light changes reach
+                // all bins.
+                if(numRecordThreads.iValue > 0)
+                {
+                    for(int i=0; i<numRecordThreads.iValue; ++i)
+                    {
+                        auto bin = vsg::Group::create();
+                        GuiHelper::materialBins.push_back(bin);
+                        // the first bin also records the remaining scene nodes
+                        vsg::ref_ptr<vsg::Group> binScene = rootNode;
+                        if(i > 0)
+                        {
+                            binScene = vsg::Group::create();
+                            binScene->addChild(lightGroup);
+                        }
+                        binScene->addChild(bin);
+                        sceneRoots.push_back(binScene);
+                    }
+                    // blended over everything else by the last bin
+                    sceneRoots.back()->addChild(GuiHelper::transparencyBin);
+                }
+                else
+                {
+                    rootNode->addChild(GuiHelper::stateGroupNodes);
+                    rootNode->addChild(GuiHelper::transparencyBin);
+                    sceneRoots.push_back(rootNode);
+                }
 
+                // the camera atlas renders the whole scene in one view per tile
+                if(useCameraAtlas.bValue)
+                {
+                    vsg::ref_ptr<vsg::Group> atlasScene = rootNode;
+                    if(GuiHelper::materialBins.size() > 1)
+                    {
+                        atlasScene = vsg::Group::create();
+                        atlasScene->addChild(rootNode);
+                        for(size_t i=1; i<GuiHelper::materialBins.size(); ++i)
+                        {
+                            atlasScene->addChild(GuiHelper::materialBins[i]);
+                        }
+                        atlasScene->addChild(GuiHelper::transparencyBin);
+                    }
+                    cameraAtlas = new CameraAtlas(atlasScene);
+                }
 
                 viewer = vsgQt::Viewer::create();
-                window = new vsgQt::Window(viewer, traits, (QWindow*)nullptr);
-                window->setTitle("3D Window");
-                window->initializeWindow();
-
-                //auto window = vsg::Window::create(traits);
-                if (!window)
+                // the first window creates the device which is shared by all
+                // further windows via the traits
+                windowTraits = vsg::WindowTraits::create();
+                windowTraits->windowTitle = "mars view";
+                if(TextureManager::getPoolSize())
                 {
-                    std::cout << "Could not create window." << std::endl;
-                    return;
+                    // the pool is indexed by a push constant
+                    windowTraits->deviceFeatures = vsg::DeviceFeatures::create();
+                    windowTraits->deviceFeatures->get().shaderSampledImageArrayDynamicIndexing = VK_TRUE;
                 }
-
-                // if this is the first window to be created, use its device for future window creation.
-                if (!traits->device) traits->device = window->windowAdapter->getOrCreateDevice();
-
-                uint32_t width = window->traits->width;
-                uint32_t height = window->traits->height;
-                fprintf(stderr, "-------- with: %u\theight: %u\n", width, height);
-
-                //viewer->addWindow(window);
-                double radius = 1.0;
-                lookAt = vsg::LookAt::create(vsg::dvec3(radius * 2.0, 0.0, 0.0), vsg::dvec3(0.0, 0.0, 0.0), vsg::dvec3(0.0, 0.0, 1.0));
-                perspective = vsg::Perspective::create(30.0, static_cast<double>(width) / static_cast<double>(height), 0.001 * radius, radius * 100.5);
-                auto camera = vsg::Camera::create(perspective, lookAt, vsg::ViewportState::create(VkExtent2D{width, height}));
-            
-                auto trackball = vsg::Trackball::create(camera);
-                trackball->addWindow(*window);
-                viewer->addEventHandler(trackball);
-
-                auto clearColor = vsg::vec4(0.2f, 0.2f, 0.7f, 1.0f);
-
-                // todo: we have to search for a clean way to provide this uniform;
-                //       we may have to inherit from the camera and update the uniform
-                //       in the camera update method
-                GuiHelper::worldTransformUniform = WorldTransformUniformValue::create();
-                GuiHelper::worldTransformUniform->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
-                GuiHelper::worldTransformUniform->value().projInverse = perspective->inverse();
-                GuiHelper::worldTransformUniform->value().viewInverse = lookAt->inverse();
-                rootNode->addChild(GuiHelper::stateGroupNodes);
-
-                auto renderGraph = vsg::createRenderGraphForView(*window, camera, rootNode, VK_SUBPASS_CONTENTS_INLINE, false);
-                renderGraph->setClearValues(vsg::sRGB_to_linear(clearColor));
-
-                auto commandGraph = vsg::CommandGraph::create(*window, renderGraph);
-                //auto commandGraph = vsg::createCommandGraphForView(*window, camera, rootNode);
-
-                //viewer->addRecordAndSubmitTaskAndPresentation({commandGraph});
-                viewer->assignRecordAndSubmitTaskAndPresentation({commandGraph});
+                // todo: the window should only be created if createWindow is true
+                createGraphicsWindow("3D Window", 0, 0);
+                PipelineCache::load(windowTraits->device, pipelineCachePath.sValue);
+                TextureCache::setDevice(windowTraits->device, compressTextures.bValue);
 
                 // these are vsgQt::Viewer methods
                 // these functione would start a time in vsgViewer to render images
@@ -139,8 +236,6 @@ namespace mars
                 vsg::ref_ptr<vsg::ResourceHints> resourceHints;
                 //viewer->compile(resourceHints);
                 //viewer->start_point() = vsg::clock::now();
-                container = QWidget::createWindowContainer(window, nullptr);
-                container->setGeometry(window->traits->x, window->traits->y, window->traits->width, window->traits->height);
                 // add close handler to respond to the close window button and pressing escape
                 //viewer->addEventHandler(vsg::CloseHandler::create(viewer));
                 vsg::visit<SetGlobalPipelineStates>(rootNode);
@@ -150,6 +245,54 @@ namespace mars
             }
         }
 
+        GraphicsWindow* GraphicsManager::createGraphicsWindow(const std::string &name,
+                                                              int width, int height)
+        {
+            auto traits = vsg::WindowTraits::create(*windowTraits);
+            traits->windowTitle = name;
+            if(width > 0 && height > 0)
+            {
+                traits->width = width;
+                traits->height = height;
+            }
+            unsigned long id = nextWindowID++;
+            GraphicsWindow *graphicsWindow = new GraphicsWindow(id, name, viewer, traits, sceneRoots,
+                                                                numRecordThreads.iValue > 0);
+            // share the device of the first window with all further windows
+            if(!windowTraits->device) windowTraits->device = traits->device;
+            graphicsWindows[id] = graphicsWindow;
+            // the first window is the main window
+            if(!mainWindowID)
+            {
+                mainWindowID = id;
+            }
+            assignCommandGraphs();
+            return graphicsWindow;
+        }
+
+        void GraphicsManager::assignCommandGraphs()
+        {
+            // all windows are submitted together on the shared device
+            vsg::CommandGraphs commandGraphs;
+            for(auto &it: graphicsWindows)
+            {
+                auto &windowCommandGraphs = it.second->getCommandGraphs();
+                commandGraphs.insert(commandGraphs.end(), windowCommandGraphs.begin(), windowCommandGraphs.end());
+            }
+            if(cameraAtlas && cameraAtlas->getCommandGraph())
+            {
+                commandGraphs.push_back(cameraAtlas->getCommandGraph());
+            }
+            viewer->deviceWaitIdle();
+            viewer->assignRecordAndSubmitTaskAndPresentation(commandGraphs);
+            if(commandGraphs.size() > 1)
+            {
+                // record the command graphs in parallel
+                viewer->setupThreading();
+            }
+            dirty = true;
+        }
+
         void* GraphicsManager::getWindowManager(int id) {(void)id; return 0;}
 
         void GraphicsManager::addDrawItems(drawStruct *draw) {(void)draw;} 
@@ -160,7 +303,29 @@ namespace mars
 
         void GraphicsManager::addGraphicsUpdateInterface(GraphicsUpdateInterface *g)
         {
-            graphicsUpdateObjects.push_back(g);
+            addGraphicsUpdateInterface(g, false);
+        }
+
+        void GraphicsManager::addGraphicsUpdateInterface(GraphicsUpdateInterface *g,
+                                                         bool independent)
+        {
+            if(!independent)
+            {
+                graphicsUpdateObjects.push_back(g);
+                return;
+            }
+            if(!updateThreads)
+            {
+                uint32_t numThreads = std::max(numUpdateThreads.iValue, 0);
+                if(numThreads == 0)
+                {
+                    // keep one core for the calling thread which also
+                    // processes the sequential callbacks
+                    numThreads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+                }
+                updateThreads = vsg::OperationThreads::create(numThreads);
+            }
+            independentGraphicsUpdateObjects.push_back(g);
         }
 
         void GraphicsManager::removeGraphicsUpdateInterface(GraphicsUpdateInterface *g)
@@ -170,7 +335,35 @@ namespace mars
             {
                 graphicsUpdateObjects.erase(it);
             }
+            it = find(std::begin(independentGraphicsUpdateObjects), std::end(independentGraphicsUpdateObjects), g);
+            if(it!=std::end(independentGraphicsUpdateObjects))
+            {
+                independentGraphicsUpdateObjects.erase(it);
+            }
+        }
 
+        void GraphicsManager::callPreGraphicsUpdate()
+        {
+            vsg::ref_ptr<vsg::Latch> latch;
+            if(!independentGraphicsUpdateObjects.empty())
+            {
+                latch = vsg::Latch::create(static_cast<int>(independentGraphicsUpdateObjects.size()));
+                for(auto& graphicsUpdateObject: independentGraphicsUpdateObjects)
+                {
+                    updateThreads->add(PreGraphicsUpdateOperation::create(graphicsUpdateObject, latch));
+                }
+            }
+            // sequential callbacks keep their registration order
+            for(auto& graphicsUpdateObject: graphicsUpdateObjects)
+            {
+                graphicsUpdateObject->preGraphicsUpdate();
+            }
+            if(latch)
+            {
+                // help to empty the queue and wait for the barrier before rendering
+                updateThreads->run();
+                latch->wait();
+            }
         }
 
         unsigned long GraphicsManager::addDrawObject(const NodeData &snode,
@@ -206,6 +399,7 @@ namespace mars
             if(drawObjectIter != drawObjects.end())
             {
                 drawObjectIter->second->setPosition(pos);
+                frameRequested = true;
             }
         }
 
@@ -216,6 +410,7 @@ namespace mars
             if(drawObjectIter != drawObjects.end())
             {
                 drawObjectIter->second->setQuaternion(q);
+                frameRequested = true;
             }
         }
 
@@ -224,8 +419,146 @@ namespace mars
         void GraphicsManager::setDrawObjectScaledSize(unsigned long id,
                                                       const mars::utils::Vector &ext) {(void)id; (void)ext;}
         void GraphicsManager::setDrawObjectMaterial(unsigned long id,
-                                                    const MaterialData &material) {(void)id; (void)material;}
-        void GraphicsManager::addMaterial(const MaterialData &material) {(void)material;}
+                                                    const MaterialData &material)
+        {
+            auto drawObjectIter = drawObjects.find(id);
+            if(drawObjectIter == drawObjects.end())
+            {
+                return;
+            }
+            MaterialHandle *handle = setMaterial(material);
+            if(handle)
+            {
+                applyMaterial(drawObjectIter->second, material.name, handle);
+            }
+            frameRequested = true;
+        }
+
+        void GraphicsManager::addMaterial(const MaterialData &material)
+        {
+            setMaterial(material);
+            frameRequested = true;
+        }
+
+        // the parameters of materials with equal shader variants are
+        // updated in place
+        static bool sameShaderVariant(configmaps::ConfigMap &a, configmaps::ConfigMap &b)
+        {
+            return a.get("diffuseTexture", std::string()) == b.get("diffuseTexture", std::string()) &&
+                a.get("vertexColors", false) == b.get("vertexColors", false) &&
+                MARSStateGroup::isTransparent(a) == MARSStateGroup::isTransparent(b);
+        }
+
+        MaterialHandle* GraphicsManager::setMaterial(const MaterialData &material)
+        {
+            MaterialData materialData = material;
+            configmaps::ConfigMap spec;
+            materialData.toConfigMap(&spec);
+            return setMaterial(material.name, spec);
+        }
+
+        MaterialHandle* GraphicsManager::setMaterial(const std::string &name,
+                                                     configmaps::ConfigMap spec)
+        {
+            spec["name"] = name;
+            MaterialHandle *handle = MARSStateGroup::getMaterial(name);
+            if(handle && handle->names.size() == 1 && sameShaderVariant(spec, handle->spec))
+            {
+                // only the parameters changed, update them in place and in
+                // the blending copies of the objects
+                handle->spec = spec;
+                MARSStateGroup::updateMaterial(*handle);
+                for(auto &it: drawObjects)
+                {
+                    if(it.second->getMaterialName() == name && it.second->getBlending())
+                    {
+                        applyMaterial(it.second, name, handle);
+                    }
+                }
+                return handle;
+            }
+            // new materials and materials shared with other names get a
+            // state group of their own, as well as changed shader variants
+            bool sameVariant = handle && sameShaderVariant(spec, handle->spec);
+            GuiHelper::createStateGroup(spec, handle == nullptr);
+            MaterialHandle *newHandle = MARSStateGroup::getMaterial(name);
+            if(handle && newHandle != handle)
+            {
+                newHandle->originHash = handle->originHash;
+                releasedMaterials.insert(handle->stateGroup.get());
+                for(auto &it: drawObjects)
+                {
+                    if(it.second->getMaterialName() == name)
+                    {
+                        applyMaterial(it.second, name, newHandle);
+                    }
+                }
+            }
+            if(sameVariant && !dirty && viewer && viewer->compileManager)
+            {
+                // a name split off a shared material only needs its own
+                // state group compiled, the following edits are in place
+                auto result = viewer->compileManager->compile(newHandle->stateGroup);
+                if(result)
+                {
+                    vsg::updateViewer(*viewer, result);
+                    frameRequested = true;
+                    return newHandle;
+                }
+            }
+            dirty = true;
+            return newHandle;
+        }
+        void GraphicsManager::applyMaterial(DrawObject *drawObject, const std::string &name,
+                                            MaterialHandle *handle)
+        {
+            vsg::ref_ptr<vsg::StateGroup> stateGroup = handle->stateGroup;
+            const std::optional<bool> &blending = drawObject->getBlending();
+            if(blending && *blending != MARSStateGroup::isTransparent(handle->spec))
+            {
+                // the object uses a blended or opaque copy of the material,
+                // named by the material thus edits reach the copy
+                std::string copyName = name + (*blending ? "#blending" : "#opaque");
+                configmaps::ConfigMap spec = handle->spec;
+                spec["blending"] = *blending;
+                spec["name"] = copyName;
+                MaterialHandle *copy = MARSStateGroup::getMaterial(copyName);
+                if(copy && sameShaderVariant(spec, copy->spec))
+                {
+                    copy->spec = spec;
+                    MARSStateGroup::updateMaterial(*copy);
+                    stateGroup = copy->stateGroup;
+                }
+                else
+                {
+                    stateGroup = GuiHelper::createStateGroup(spec, false);
+                    dirty = true;
+                }
+            }
+            vsg::ref_ptr<vsg::StateGroup> previous = drawObject->getMaterialStateGroup();
+            drawObject->setMaterialStateGroup(name, stateGroup);
+            if(previous && previous != drawObject->getMaterialStateGroup())
+            {
+                releasedMaterials.insert(previous.get());
+            }
+        }
+
+        void GraphicsManager::releaseMaterials()
+        {
+            // materials replaced by edits are neither named nor used anymore,
+            // only the ones left by an object or a name since the last frame
+            // are checked
+            for(auto &it: drawObjects)
+            {
+                releasedMaterials.erase(it.second->getMaterialStateGroup().get());
+            }
+            for(auto &stateGroup: MARSStateGroup::releaseMaterials(releasedMaterials))
+            {
+                GuiHelper::removeStateGroup(stateGroup);
+            }
+            releasedMaterials.clear();
+        }
+
         void GraphicsManager::setDrawObjectNodeMask(unsigned long id, unsigned int bits) {(void)id; (void)bits;}
 
         void GraphicsManager::closeAxis() {}
@@ -248,6 +581,7 @@ namespace mars
             if(coords)
             {
                 rootNode->children.erase(std::find(rootNode->children.begin(), rootNode->children.end(), coords));
+                frameRequested = true;
             }
         }
 
@@ -333,12 +667,138 @@ namespace mars
 
         void GraphicsManager::setTexture(unsigned long id, const std::string &filename) {(void)id; (void)filename;}
         unsigned long GraphicsManager::new3DWindow(void *myQTWidget, bool rtt,
-                                                   int width, int height, const std::string &name) {(void)myQTWidget;(void)rtt;(void)width;(void)height;(void)name;return 0;}
+                                                   int width, int height, const std::string &name)
+        {
+            (void)myQTWidget;
+            if(!viewer)
+            {
+                return 0;
+            }
+            // offscreen cameras are packed into the atlas instead of
+            // creating a window and a render pass of their own
+            if(rtt && cameraAtlas)
+            {
+                unsigned long id = nextWindowID++;
+                cameraAtlas->addCamera(id, width > 0 ? width : 128, height > 0 ? height : 128);
+                return id;
+            }
+            std::string windowName = name;
+            if(windowName.empty())
+            {
+                windowName = "3D Window " + std::to_string(nextWindowID);
+            }
+            GraphicsWindow *graphicsWindow = createGraphicsWindow(windowName, width, height);
+            return graphicsWindow->getID();
+        }
+
         void GraphicsManager::setGrabFrames(bool value) {(void)value;}
-        GraphicsWindowInterface* GraphicsManager::get3DWindow(unsigned long id) const {(void)id; return 0;}
-        GraphicsWindowInterface* GraphicsManager::get3DWindow(const std::string &name) const {(void)name; return 0;}
-        void GraphicsManager::remove3DWindow(unsigned long id) {(void)id;}
-        void GraphicsManager::getList3DWindowIDs(std::vector<unsigned long> *ids) const {(void) ids;}
+
+        GraphicsWindowInterface* GraphicsManager::get3DWindow(unsigned long id) const
+        {
+            auto it = graphicsWindows.find(id);
+            if(it != graphicsWindows.end())
+            {
+                return it->second;
+            }
+            return nullptr;
+        }
+
+        GraphicsWindowInterface* GraphicsManager::get3DWindow(const std::string &name) const
+        {
+            for(auto &it: graphicsWindows)
+            {
+                if(it.second->getName() == name)
+                {
+                    return it.second;
+                }
+            }
+            return nullptr;
+        }
+
+        GraphicsWindow* GraphicsManager::getMainWindow(void) const
+        {
+            auto it = graphicsWindows.find(mainWindowID);
+            if(it != graphicsWindows.end())
+            {
+                return it->second;
+            }
+            return nullptr;
+        }
+
+        void GraphicsManager::remove3DWindow(unsigned long id)
+        {
+            if(cameraAtlas && cameraAtlas->hasCamera(id))
+            {
+                viewer->deviceWaitIdle();
+                cameraAtlas->removeCamera(id);
+                return;
+            }
+            auto it = graphicsWindows.find(id);
+            if(it == graphicsWindows.end())
+            {
+                return;
+            }
+            GraphicsWindow *graphicsWindow = it->second;
+            viewer->deviceWaitIdle();
+            auto &eventHandlers = viewer->getEventHandlers();
+            auto handlerIt = std::find(eventHandlers.begin(), eventHandlers.end(), graphicsWindow->getTrackball());
+            if(handlerIt != eventHandlers.end())
+            {
+                eventHandlers.erase(handlerIt);
+            }
+            viewer->removeWindow(*graphicsWindow->getWindow());
+            graphicsWindows.erase(it);
+            if(id == mainWindowID)
+            {
+                // the oldest remaining window takes over
+                mainWindowID = graphicsWindows.empty() ? 0 : graphicsWindows.begin()->first;
+            }
+            assignCommandGraphs();
+            delete graphicsWindow;
+        }
+
+        void GraphicsManager::setCameraAtlasPose(unsigned long id, const utils::Vector &pos,
+                                                 const utils::Quaternion &q)
+        {
+            if(cameraAtlas)
+            {
+                cameraAtlas->setCameraPose(id, pos, q);
+                frameRequested = true;
+            }
+        }
+
+        void GraphicsManager::setCameraAtlasProjection(unsigned long id, double fovy,
+                                                       double nearPlane, double farPlane)
+        {
+            if(cameraAtlas)
+            {
+                cameraAtlas->setCameraProjection(id, fovy, nearPlane, farPlane);
+                frameRequested = true;
+            }
+        }
+
+        void GraphicsManager::requestFrame(void)
+        {
+            frameRequested = true;
+        }
+
+        bool GraphicsManager::getCameraAtlasImage(unsigned long id, std::vector<uint8_t> &image,
+                                                  int *width, int *height)
+        {
+            if(cameraAtlas)
+            {
+                return cameraAtlas->getImage(id, image, width, height);
+            }
+            return false;
+        }
+
+        void GraphicsManager::getList3DWindowIDs(std::vector<unsigned long> *ids) const
+        {
+            for(auto &it: graphicsWindows)
+            {
+                ids->push_back(it.first);
+            }
+        }
         void GraphicsManager::removeLayerFromDrawObjects(unsigned long window_id) {(void)window_id;}
 
         // HUD Interface:
@@ -356,19 +816,66 @@ namespace mars
                                                  double text_color[4]) {(void)id; (void)text; (void)text_color;}
         void GraphicsManager::setHUDElementLines(unsigned long id, std::vector<double> *v,
                                                  double color[4]) {(void)id; (void)v;(void)color;}
-        void* GraphicsManager::getQTWidget(unsigned long id) const {(void)id;return container;}
+        void* GraphicsManager::getQTWidget(unsigned long id) const
+        {
+            auto it = graphicsWindows.find(id);
+            if(it != graphicsWindows.end())
+            {
+                return it->second->getContainer();
+            }
+            return nullptr;
+        }
         void GraphicsManager::showQTWidget(unsigned long id) {(void)id;}
         void GraphicsManager::addGuiEventHandler(GuiEventInterface *_guiEventHandler) {(void)_guiEventHandler;}
         void GraphicsManager::removeGuiEventHandler(GuiEventInterface *_guiEventHandler) {(void)_guiEventHandler;}
         void GraphicsManager::exportDrawObject(unsigned long id,
                                                const std::string &name) const {(void)id; (void)name;}
-        void GraphicsManager::setBlending(unsigned long id, bool mode) {(void)id; (void)mode;}
+        void GraphicsManager::setBlending(unsigned long id, bool mode)
+        {
+            auto drawObjectIter = drawObjects.find(id);
+            if(drawObjectIter == drawObjects.end())
+            {
+                return;
+            }
+            DrawObject *drawObject = drawObjectIter->second;
+            std::string name = drawObject->getMaterialName();
+            MaterialHandle *handle = MARSStateGroup::getMaterial(name);
+            if(!handle)
+            {
+                return;
+            }
+            // only this object gets a blended or opaque copy of its material,
+            // it keeps the name of the material to follow its edits; an
+            // object matching the mode already keeps the material itself
+            drawObject->setBlending(mode);
+            applyMaterial(drawObject, name, handle);
+            dirty = true;
+        }
         void GraphicsManager::setBumpMap(unsigned long id, const std::string &bumpMap) {(void)id;(void)bumpMap;}
         void GraphicsManager::setGraphicsWindowGeometry(unsigned long id, int top,
-                                                        int left, int width, int height) {(void)id;(void)top;(void)left;(void)width;(void)height;}
+                                                        int left, int width, int height)
+        {
+            auto it = graphicsWindows.find(id);
+            if(it != graphicsWindows.end() && it->second->getContainer())
+            {
+                it->second->getContainer()->setGeometry(left, top, width, height);
+            }
+        }
+
         void GraphicsManager::getGraphicsWindowGeometry(unsigned long id,
-                                               int *top, int *left,
-                                               int *width, int *height) const {(void)id;(void)top;(void)left;(void)width;(void)height;}
+                                                        int *top, int *left,
+                                                        int *width, int *height) const
+        {
+            auto it = graphicsWindows.find(id);
+            if(it != graphicsWindows.end() && it->second->getContainer())
+            {
+                QRect geometry = it->second->getContainer()->geometry();
+                *top = geometry.y();
+                *left = geometry.x();
+                *width = geometry.width();
+                *height = geometry.height();
+            }
+        }
         void GraphicsManager::setActiveWindow(unsigned long win_id) {(void)win_id;}
         void GraphicsManager::setDrawObjectSelected(unsigned long id, bool val) {(void)id; (void)val;}
         void GraphicsManager::setDrawObjectShow(unsigned long id, bool val)
@@ -386,7 +893,15 @@ namespace mars
         void GraphicsManager::removeEventClient(GraphicsEventClient* theClient) {(void)theClient;}
         void GraphicsManager::setSelectable(unsigned long id, bool val) {(void)id; (void)val;}
         void GraphicsManager::showNormals(bool val) {(void)val;}
-        void* GraphicsManager::getView(unsigned long id) {(void)id;return 0;}
+        void* GraphicsManager::getView(unsigned long id)
+        {
+            auto it = graphicsWindows.find(id);
+            if(it != graphicsWindows.end())
+            {
+                return it->second->getViews().front().get();
+            }
+            return 0;
+        }
         void GraphicsManager::collideSphere(unsigned long id, mars::utils::Vector pos,
                                             sReal radius) {(void)id;(void)pos;(void)radius;}
         const utils::Vector& GraphicsManager::getDrawObjectPosition(unsigned long id)
@@ -405,28 +920,210 @@ namespace mars
         void GraphicsManager::draw()
         {
             // todo: remove draw handling via nsview
-            for(auto& graphicsUpdateObject: graphicsUpdateObjects)
+            callPreGraphicsUpdate();
+            if(renderOnDemand.bValue)
             {
-                graphicsUpdateObject->preGraphicsUpdate();
+                // Poll the window events without starting a frame. The
+                // events are kept in the viewer until a frame is rendered.
+                if(viewer->pollEvents(false))
+                {
+                    frameRequested = true;
+                }
+                if(!viewer->active())
+                {
+                    return;
+                }
+            }
+            for(auto &it: graphicsWindows)
+            {
+                if(it.second->updateWorldTransform())
+                {
+                    frameRequested = true;
+                }
+            }
+            if(cameraAtlas)
+            {
+                // images of the last frame are delivered now, a rebuild
+                // has to wait because it replaces the read back buffer
+                cameraAtlas->finishReadBack(viewer, cameraAtlas->needsRebuild());
+                if(cameraAtlas->needsRebuild())
+                {
+                    cameraAtlas->build(windowTraits->device);
+                    assignCommandGraphs();
+                }
+                if(cameraAtlas->updateWorldTransforms())
+                {
+                    frameRequested = true;
+                }
+            }
+            // reloaded pipelines are swapped in before the compile below
+            if(shaderWatcher)
+            {
+                reloadShaders();
+            }
+            if(!releasedMaterials.empty())
+            {
+                releaseMaterials();
             }
-            GuiHelper::worldTransformUniform->value().projInverse = perspective->inverse();
-            GuiHelper::worldTransformUniform->value().viewInverse = lookAt->inverse();
-            GuiHelper::worldTransformUniform->dirty();
             // fprintf(stderr, ". ");
             // // pass any events into EventHandlers assigned to the Viewer
             if(dirty)
             {
+                // objects were added to or moved between materials
+                GuiHelper::balanceMaterialBins();
+                if(CompileScheduler::hasPending())
+                {
+                    // compile new material pipelines for all views in
+                    // parallel before vsg compiles the remaining scene
+                    CompileScheduler::compile(windowTraits->device, getCompileTargets(), numCompileThreads.iValue);
+                }
                 viewer->compile();
                 dirty = false;
+                frameRequested = true;
+            }
+            // swap in the textures decoded since the last frame
+            if(TextureManager::update(viewer))
+            {
+                frameRequested = true;
+            }
+            if(GraphicsWindow *mainWindow = getMainWindow())
+            {
+                // the transparent objects are sorted per view while
+                // recording, the terrains follow all views including the
+                // offscreen cameras, the main view first
+                GuiHelper::transparencyBin->update();
+                std::vector<vsg::ref_ptr<vsg::View>> views(mainWindow->getViews().begin(),
+                                                           mainWindow->getViews().end());
+                for(auto &it: graphicsWindows)
+                {
+                    if(it.second != mainWindow)
+                    {
+                        views.insert(views.end(), it.second->getViews().begin(), it.second->getViews().end());
+                    }
+                }
+                if(cameraAtlas)
+                {
+                    views.insert(views.end(), cameraAtlas->getViews().begin(), cameraAtlas->getViews().end());
+                }
+                if(ClipmapTerrain::updateAll(views, viewer))
+                {
+                    frameRequested = true;
+                }
+                // tiles are paged in around all cameras
+                std::vector<vsg::dvec3> eyes;
+                for(auto &view: views)
+                {
+                    if(view->camera && view->camera->viewMatrix)
+                    {
+                        eyes.push_back(view->camera->viewMatrix->inverse()*vsg::dvec3(0.0, 0.0, 0.0));
+                    }
+                }
+                if(PagedTerrain::updateAll(eyes, viewer))
+                {
+                    frameRequested = true;
+                }
+            }
+            if(renderOnDemand.bValue)
+            {
+                // nothing changed: skip render, present and readback
+                if(!frameRequested.exchange(false))
+                {
+                    return;
+                }
+                // advanceToNextFrame() discards previously polled events
+                vsg::UIEvents events;
+                events.swap(viewer->getEvents());
+                if(!viewer->advanceToNextFrame())
+                {
+                    return;
+                }
+                viewer->getEvents().insert(viewer->getEvents().begin(), events.begin(), events.end());
+                viewer->handleEvents();
+                // the trackball moves the camera in the frame event, also
+                // while it is thrown without any input; keep rendering
+                // until it comes to rest
+                for(auto &it: graphicsWindows)
+                {
+                    if(it.second->updateWorldTransform())
+                    {
+                        frameRequested = true;
+                    }
+                }
+                viewer->update();
+                if(cameraAtlas)
+                {
+                    // the new frame reuses the read back buffer
+                    cameraAtlas->finishReadBack(viewer, true);
+                }
+                viewer->recordAndSubmit();
+                viewer->present();
+            }
+            else
+            {
+                frameRequested = false;
+                if(cameraAtlas)
+                {
+                    // the new frame reuses the read back buffer
+                    cameraAtlas->finishReadBack(viewer, true);
+                }
+                // could also try
+                viewer->render();
+            }
+            if(cameraAtlas)
+            {
+                cameraAtlas->readBack(viewer);
             }
-            // could also try
-            viewer->render();
             // viewer->handleEvents();
             // viewer->update();
             // viewer->recordAndSubmit();
             // viewer->present();
         }
 
+        std::vector<CompileScheduler::ViewTarget> GraphicsManager::getCompileTargets(void)
+        {
+            std::vector<CompileScheduler::ViewTarget> targets;
+            for(auto &it: graphicsWindows)
+            {
+                auto renderPass = it.second->getWindow()->windowAdapter->getOrCreateRenderPass();
+                for(auto &view: it.second->getViews())
+                {
+                    targets.push_back(CompileScheduler::ViewTarget{view, renderPass});
+                }
+            }
+            // the offscreen cameras render with their own render pass
+            if(cameraAtlas && cameraAtlas->getRenderPass())
+            {
+                for(auto &view: cameraAtlas->getViews())
+                {
+                    targets.push_back(CompileScheduler::ViewTarget{view, cameraAtlas->getRenderPass()});
+                }
+            }
+            return targets;
+        }
+
+        void GraphicsManager::reloadShaders(void)
+        {
+            // the new pipelines are swapped in between two frames
+            if(MARSStateGroup::reloadReady())
+            {
+                viewer->deviceWaitIdle();
+                MARSStateGroup::swapReloadedShaders();
+                // the reload compiled the pipelines for the compile targets
+                // (windows and camera atlas), views created in the meantime
+                // are compiled by viewer->compile()
+                dirty = true;
+                frameRequested = true;
+            }
+            std::set<std::string> files = shaderWatcher->poll();
+            changedShaderFiles.insert(files.begin(), files.end());
+            if(!changedShaderFiles.empty() &&
+               MARSStateGroup::reloadShaders(changedShaderFiles, windowTraits->device,
+                                             getCompileTargets(), numCompileThreads.iValue))
+            {
+                changedShaderFiles.clear();
+            }
+        }
+
         void GraphicsManager::lock() {}
         void GraphicsManager::unlock() {}
 
@@ -437,7 +1134,10 @@ namespace mars
             return nullptr;
         }
 
-        LoadHeightmapInterface* GraphicsManager::getLoadHeightmapInterface(void) {return 0;}
+        LoadHeightmapInterface* GraphicsManager::getLoadHeightmapInterface(void)
+        {
+            return guiHelper;
+        }
 
         void GraphicsManager::makeChild(unsigned long parentId, unsigned long childId) {(void)parentId;(void)childId;}
         void GraphicsManager::attacheCamToNode(unsigned long winID, unsigned long drawID) {(void)winID;(void)drawID;}
@@ -453,11 +1153,63 @@ namespace mars
         bool GraphicsManager::isInitialized() const {return 0;}
         std::vector<interfaces::MaterialData> GraphicsManager::getMaterialList() const
         {
-            return std::vector<interfaces::MaterialData>{};
+            std::vector<interfaces::MaterialData> materialList;
+            for(auto &it: MARSStateGroup::getMaterialNames())
+            {
+                configmaps::ConfigMap spec = it.second->spec;
+                interfaces::MaterialData material;
+                material.fromConfigMap(&spec, "");
+                material.name = it.first;
+                materialList.push_back(material);
+            }
+            return materialList;
+        }
+
+        MaterialStats GraphicsManager::getMaterialStats() const
+        {
+            return MARSStateGroup::getMaterialStats();
         }
 
         void GraphicsManager::editMaterial(std::string materialName, std::string key,
-                                           std::string value) {(void)materialName;(void)key;(void)value;}
+                                           std::string value)
+        {
+            MaterialHandle *handle = MARSStateGroup::getMaterial(materialName);
+            if(!handle)
+            {
+                return;
+            }
+            // the key is a path like "material/diffuseColor/r" or "shininess"
+            std::vector<std::string> path = utils::explodeString('/', key);
+            size_t n = path.size();
+            configmaps::ConfigMap spec = handle->spec;
+            if(n >= 2 && path[n-2].find("Color") != std::string::npos)
+            {
+                spec[path[n-2]][path[n-1]] = atof(value.c_str());
+            }
+            else if(n >= 1 && (path[n-1] == "shininess" || path[n-1] == "transparency"))
+            {
+                spec[path[n-1]] = atof(value.c_str());
+            }
+            else if(n >= 1 && path[n-1] == "diffuseTexture")
+            {
+                spec[path[n-1]] = value;
+            }
+            else if(n >= 1 && (path[n-1] == "vertexColors" || path[n-1] == "blending"))
+            {
+                spec[path[n-1]] = value == "true" || atoi(value.c_str()) != 0;
+            }
+            else
+            {
+                // the remaining keys of the material data (normal maps,
+                // instancing, ...) have no counterpart in the shaders
+                LOG_WARN("editMaterial: %s is not supported", key.c_str());
+                return;
+            }
+            // setMaterial() rebuilds the state group if the shader variant
+            // changed, otherwise the parameters are updated in place
+            setMaterial(materialName, spec);
+            frameRequested = true;
+        }
         void GraphicsManager::setCameraDefaultView(int view) {(void)view;}
         void GraphicsManager::setDrawObjectBrightness(unsigned long id, double v) {(void)id;(void)v;}
         void GraphicsManager::editLight(unsigned long id, const std::string &key,
@@ -498,6 +1250,17 @@ namespace mars
                     viewer->compile();
                 }
             }            
+            if(_property.paramId == renderOnDemand.paramId)
+            {
+                // draw() reads the mode every frame
+                frameRequested = true;
+            }
+            else if(_property.paramId == terrainPagingSize.paramId ||
+                    _property.paramId == terrainMemoryBudget.paramId ||
+                    _property.paramId == terrainPhysicsSamples.paramId)
+            {
+                applyTerrainProperties();
+            }
         }
 
         void GraphicsManager::produceData(const data_broker::DataInfo &info,
@@ -529,6 +1292,105 @@ namespace mars
             GuiHelper::resourcePath = resourcesPath.sValue;
             showCoords_ = cfg->getOrCreateProperty("Graphics", "showCoords",
                                                    true, this);
+            // 0: use one thread less than the available cores
+            numUpdateThreads = cfg->getOrCreateProperty("Graphics", "numUpdateThreads",
+                                                        0, this);
+            // 0: record the whole scene inline in one command buffer
+            numRecordThreads = cfg->getOrCreateProperty("Graphics", "numRecordThreads",
+                                                        0, this);
+            // render to texture windows are rendered as tiles of one atlas
+            useCameraAtlas = cfg->getOrCreateProperty("Graphics", "cameraAtlas",
+                                                      false, this);
+            // 0: compile the material pipelines on one thread per core
+            numCompileThreads = cfg->getOrCreateProperty("Graphics", "numCompileThreads",
+                                                         0, this);
+            // SPIR-V of generated shaders is cached in this directory, an
+            // empty path disables the cache on disk
+            std::string cacheBase;
+            if(const char *xdgCache = getenv("XDG_CACHE_HOME"))
+            {
+                cacheBase = xdgCache;
+            }
+            else if(const char *home = getenv("HOME"))
+            {
+                cacheBase = pathJoin(home, ".cache");
+            }
+            shaderCachePath = cfg->getOrCreateProperty("Graphics", "shaderCachePath",
+                                                       cacheBase.empty() ? std::string("") : pathJoin(cacheBase, "mars_vsg_graphics/spirv"),
+                                                       this);
+            ShaderCache::setCacheDirectory(shaderCachePath.sValue);
+            // 0: decode textures on half of the cores
+            numTextureThreads = cfg->getOrCreateProperty("Graphics", "numTextureThreads",
+                                                         0, this);
+            TextureManager::setNumThreads(numTextureThreads.iValue);
+            // transcode textures once into BC1/BC3 with mipmaps (*.ktx2)
+            compressTextures = cfg->getOrCreateProperty("Graphics", "compressTextures",
+                                                        false, this);
+            textureCachePath = cfg->getOrCreateProperty("Graphics", "textureCachePath",
+                                                        cacheBase.empty() ? std::string("") : pathJoin(cacheBase, "mars_vsg_graphics/textures"),
+                                                        this);
+            TextureCache::setCacheDirectory(textureCachePath.sValue);
+            // the Vulkan pipeline cache of the device, an empty path
+            // disables loading and saving the cache
+            pipelineCachePath = cfg->getOrCreateProperty("Graphics", "pipelineCachePath",
+                                                         cacheBase.empty() ? std::string("") : pathJoin(cacheBase, "mars_vsg_graphics/pipeline_cache.bin"),
+                                                         this);
+            // shadow technique of the shader variants, only none is
+            // supported by the Vulkan shader nodes
+            shadowTechnique = cfg->getOrCreateProperty("Graphics", "shadowTechnique",
+                                                       std::string("none"), this);
+            MARSStateGroup::setShadowTechnique(shadowTechnique.sValue);
+            // lights the material shaders reserve light data for
+            lightCount = cfg->getOrCreateProperty("Graphics", "lightCount",
+                                                  2, this);
+            // pack all materials into one storage buffer indexed per draw
+            materialTable = cfg->getOrCreateProperty("Graphics", "materialTable",
+                                                     false, this);
+            // entries of the storage buffer, further materials get buffers
+            // of their own
+            materialTableSize = cfg->getOrCreateProperty("Graphics", "materialTableSize",
+                                                         4096, this);
+            MARSStateGroup::setMaterialTable(materialTable.bValue,
+                                             materialTableSize.iValue > 0 ? (uint32_t)materialTableSize.iValue : 1);
+            // size of the texture array of the material table, 0 binds one
+            // descriptor set per texture
+            texturePool = cfg->getOrCreateProperty("Graphics", "texturePool",
+                                                   0, this);
+            MARSStateGroup::setTexturePool(texturePool.iValue > 0 ? (uint32_t)texturePool.iValue : 0);
+            // heightmaps with more samples per side are split into tiles
+            // and paged in around the cameras
+            terrainPagingSize = cfg->getOrCreateProperty("Graphics", "terrainPagingSize",
+                                                         4096, this);
+            // memory of the resident terrain tiles in MB
+            terrainMemoryBudget = cfg->getOrCreateProperty("Graphics", "terrainMemoryBudget",
+                                                           256, this);
+            // maximum samples of a paged heightmap handed to the physics
+            // in millions, 0: as many as fit into terrainMemoryBudget; a
+            // coarser physics terrain does not match the rendered one
+            terrainPhysicsSamples = cfg->getOrCreateProperty("Graphics", "terrainPhysicsSamples",
+                                                             0, this);
+            applyTerrainProperties();
+            // only render a frame if poses, cameras or the scene changed
+            renderOnDemand = cfg->getOrCreateProperty("Graphics", "renderOnDemand",
+                                                      false, this);
+            // regenerate shaders when files in resources/graph_shader change
+            shaderHotReload = cfg->getOrCreateProperty("Graphics", "shaderHotReload",
+                                                       false, this);
+            // the threads, caches, shaders and material layout are set up
+            // once, these properties can also be changed while running
+            cfgProperties.push_back(&renderOnDemand);
+            cfgProperties.push_back(&terrainPagingSize);
+            cfgProperties.push_back(&terrainMemoryBudget);
+            cfgProperties.push_back(&terrainPhysicsSamples);
+        }
+
+        void GraphicsManager::applyTerrainProperties(void)
+        {
+            // the paging size and physics samples apply to terrains loaded
+            // afterwards, the budget to the next eviction
+            PagedTerrain::setPagingSize(terrainPagingSize.iValue > 0 ? (uint32_t)terrainPagingSize.iValue : 0);
+            PagedTerrain::setMemoryBudget((size_t)std::max(terrainMemoryBudget.iValue, 1)*1024*1024);
+            PagedTerrain::setPhysicsSamples((size_t)std::max(terrainPhysicsSamples.iValue, 0)*1024*1024);
         }
 
     } // end of namespace vsg_graphics
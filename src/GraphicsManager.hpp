@@ -1,6 +1,7 @@
 #pragma once
 
 #include "gui_helper_functions.hpp"
+#include "CompileScheduler.hpp"
 
 #include <mars_interfaces/graphics/GraphicsManagerInterface.hpp>
 #include <mars_interfaces/graphics/GraphicsEventInterface.h>
@@ -17,12 +18,19 @@
 #include <vsgXchange/all.h>
 #include <vsgQt/Window.h>
 
+#include <atomic>
+
 namespace mars
 {
     namespace vsg_graphics
     {
         class DrawObject;
         class GuiHelper;
+        class GraphicsWindow;
+        class CameraAtlas;
+        class ShaderWatcher;
+        struct MaterialHandle;
+        struct MaterialStats;
 
         class GraphicsManager : public interfaces::GraphicsManagerInterface,
                                 public interfaces::GraphicsEventInterface,
@@ -58,6 +66,14 @@ namespace mars
             virtual void addLight(interfaces::LightData &ls) override; ///< Adds a light to the scene.
 
             virtual void addGraphicsUpdateInterface(interfaces::GraphicsUpdateInterface *g) override;
+            /**
+             * Registers an update interface. If \c independent is true the
+             * interface declares that its preGraphicsUpdate() does not depend
+             * on any other update interface and may run concurrently on the
+             * update thread pool. All callbacks are finished before rendering.
+             */
+            void addGraphicsUpdateInterface(interfaces::GraphicsUpdateInterface *g,
+                                            bool independent);
             virtual void removeGraphicsUpdateInterface(interfaces::GraphicsUpdateInterface *g) override;
             virtual unsigned long addDrawObject(const interfaces::NodeData &snode,
                                                 bool activated = true) override;
@@ -140,6 +156,24 @@ namespace mars
             virtual interfaces::GraphicsWindowInterface* get3DWindow(unsigned long id) const override;
             virtual interfaces::GraphicsWindowInterface* get3DWindow(const std::string &name) const override;
             virtual void remove3DWindow(unsigned long id) override;
+            /**
+             * Pose and projection of a render to texture window that is
+             * rendered as a tile of the camera atlas. The camera looks along
+             * the local x-axis with the z-axis up.
+             */
+            void setCameraAtlasPose(unsigned long id, const utils::Vector &pos,
+                                    const utils::Quaternion &q);
+            void setCameraAtlasProjection(unsigned long id, double fovy,
+                                          double nearPlane, double farPlane);
+            /**
+             * Forces the next draw() call to render a frame. Used by camera
+             * sensor consumers in render on demand mode, when a new image is
+             * needed although nothing in the scene changed.
+             */
+            void requestFrame(void);
+            /** Returns the last RGBA image rendered for a camera atlas tile. */
+            bool getCameraAtlasImage(unsigned long id, std::vector<uint8_t> &image,
+                                     int *width, int *height);
             virtual void getList3DWindowIDs(std::vector<unsigned long> *ids) const override;
             virtual void removeLayerFromDrawObjects(unsigned long window_id) override;
 
@@ -206,6 +240,11 @@ namespace mars
             virtual unsigned long addHUDOSGNode(void* node) override;
             virtual bool isInitialized() const override;
             virtual std::vector<interfaces::MaterialData> getMaterialList() const override;
+            /**
+             * Number of requested and named materials compared to the
+             * materials and pipelines actually created on the GPU.
+             */
+            MaterialStats getMaterialStats() const;
             virtual void editMaterial(std::string materialName, std::string key,
                                       std::string value) override;
             /**
@@ -232,25 +271,65 @@ namespace mars
             interfaces::GraphicData graphicOptions;
             //vsg::ref_ptr<vsg::Viewer> viewer;
             vsg::ref_ptr<vsgQt::Viewer> viewer;
-            vsgQt::Window *window;
-            QWidget *container;
+            vsg::ref_ptr<vsg::WindowTraits> windowTraits;
+            std::map<unsigned long, GraphicsWindow*> graphicsWindows;
+            unsigned long nextWindowID;
+            // the window of the main camera
+            unsigned long mainWindowID;
+            // the scene graph roots rendered by each window
+            std::vector<vsg::ref_ptr<vsg::Group>> sceneRoots;
+            CameraAtlas *cameraAtlas;
+            ShaderWatcher *shaderWatcher;
+            // changed shader files waiting for the running reload
+            std::set<std::string> changedShaderFiles;
+            // state groups of materials left by objects or names, released
+            // once per frame if they are unused
+            std::set<const vsg::StateGroup*> releasedMaterials;
             vsg::ref_ptr<vsg::Group> rootNode;
+            // the scene lights, shared by the root node and all material bins
+            vsg::ref_ptr<vsg::Group> lightGroup;
             vsg::ref_ptr<vsg::Node> coords;
             unsigned long long nextDrawID;
             std::map<unsigned long long, DrawObject*> drawObjects;
             GuiHelper *guiHelper;
-            vsg::ref_ptr<vsg::LookAt> lookAt;
-            vsg::ref_ptr<vsg::ProjectionMatrix> perspective;
             bool dirty;
+            // set if anything visible changed since the last rendered frame
+            std::atomic<bool> frameRequested;
 
             // mars event handling
             std::list<interfaces::GraphicsUpdateInterface*> graphicsUpdateObjects;
+            std::list<interfaces::GraphicsUpdateInterface*> independentGraphicsUpdateObjects;
+            vsg::ref_ptr<vsg::OperationThreads> updateThreads;
+
+            /** Creates the material or updates its parameters in place. */
+            MaterialHandle* setMaterial(const interfaces::MaterialData &material);
+            MaterialHandle* setMaterial(const std::string &name, configmaps::ConfigMap spec);
+            /** Moves the object to the material or its blending copy. */
+            void applyMaterial(DrawObject *drawObject, const std::string &name,
+                               MaterialHandle *handle);
+            void releaseMaterials();
 
             // cfg_manager stuff
             cfg_manager::CFGManagerInterface *cfg;
             cfg_manager::cfgPropertyStruct resourcesPath, showCoords_;
+            cfg_manager::cfgPropertyStruct numUpdateThreads, numRecordThreads, numCompileThreads;
+            cfg_manager::cfgPropertyStruct numTextureThreads, compressTextures, textureCachePath;
+            cfg_manager::cfgPropertyStruct useCameraAtlas, renderOnDemand;
+            cfg_manager::cfgPropertyStruct shaderCachePath, pipelineCachePath, materialTable, materialTableSize, texturePool;
+            cfg_manager::cfgPropertyStruct terrainPagingSize, terrainMemoryBudget, terrainPhysicsSamples;
+            cfg_manager::cfgPropertyStruct shadowTechnique, lightCount, shaderHotReload;
+            // properties followed by cfgUpdateProperty, all others are only
+            // read on startup
             std::vector<cfg_manager::cfgPropertyStruct*> cfgProperties;
             void setupCFG(void);
+            void applyTerrainProperties(void);
+            void callPreGraphicsUpdate(void);
+            GraphicsWindow* createGraphicsWindow(const std::string &name,
+                                                 int width, int height);
+            void assignCommandGraphs(void);
+            std::vector<CompileScheduler::ViewTarget> getCompileTargets(void);
+            GraphicsWindow* getMainWindow(void) const;
+            void reloadShaders(void);
 
         }; // end of class GraphicsManagerInterface
 
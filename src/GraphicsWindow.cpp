@@ -0,0 +1,206 @@
+#include <QWidget>
+
+#include "GraphicsWindow.hpp"
+#include "MARSStateGroup.hpp"
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        GraphicsWindow::GraphicsWindow(unsigned long id_, const std::string &name_,
+                                       vsg::ref_ptr<vsgQt::Viewer> viewer,
+                                       vsg::ref_ptr<vsg::WindowTraits> traits,
+                                       const std::vector<vsg::ref_ptr<vsg::Group>> &sceneRoots,
+                                       bool secondaryCommandBuffers) :
+            id(id_), name(name_), window(nullptr), container(nullptr),
+            grabFrames(false), saveFrames(false)
+        {
+            window = new vsgQt::Window(viewer, traits, (QWindow*)nullptr);
+            window->setTitle(name.c_str());
+            window->initializeWindow();
+
+            // if this is the first window to be created, use its device for future window creation.
+            if (!traits->device) traits->device = window->windowAdapter->getOrCreateDevice();
+
+            uint32_t width = window->traits->width;
+            uint32_t height = window->traits->height;
+
+            double radius = 1.0;
+            lookAt = vsg::LookAt::create(vsg::dvec3(radius * 2.0, 0.0, 0.0), vsg::dvec3(0.0, 0.0, 0.0), vsg::dvec3(0.0, 0.0, 1.0));
+            perspective = vsg::Perspective::create(30.0, static_cast<double>(width) / static_cast<double>(height), 0.001 * radius, radius * 100.5);
+            camera = vsg::Camera::create(perspective, lookAt, vsg::ViewportState::create(VkExtent2D{width, height}));
+
+            trackball = vsg::Trackball::create(camera);
+            trackball->addWindow(*window);
+            viewer->addEventHandler(trackball);
+
+            // every view binds its own world transform uniform in front of
+            // the shared scene graph
+            worldTransformUniform = WorldTransformUniformValue::create();
+            worldTransformUniform->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+            updateWorldTransform();
+            auto worldTransformBinding = MARSStateGroup::createWorldTransformBinding(worldTransformUniform);
+            for(auto &sceneRoot: sceneRoots)
+            {
+                auto viewRoot = vsg::StateGroup::create();
+                viewRoot->add(worldTransformBinding);
+                viewRoot->addChild(sceneRoot);
+                views.push_back(vsg::View::create(camera, viewRoot));
+            }
+
+            renderGraph = vsg::RenderGraph::create(*window);
+            if(secondaryCommandBuffers)
+            {
+                // record each scene root into its own secondary command buffer
+                renderGraph->contents = VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS;
+                for(auto &view: views)
+                {
+                    auto secondaryCommandGraph = vsg::SecondaryCommandGraph::create(*window);
+                    secondaryCommandGraph->addChild(view);
+                    auto executeCommands = vsg::ExecuteCommands::create();
+                    executeCommands->connect(secondaryCommandGraph);
+                    renderGraph->addChild(executeCommands);
+                    commandGraphs.push_back(secondaryCommandGraph);
+                }
+            }
+            else
+            {
+                for(auto &view: views)
+                {
+                    renderGraph->addChild(view);
+                }
+            }
+            clearColor.r = 0.2;
+            clearColor.g = 0.2;
+            clearColor.b = 0.7;
+            clearColor.a = 1.0;
+            setClearColor(clearColor);
+            commandGraphs.push_back(vsg::CommandGraph::create(*window, renderGraph));
+
+            container = QWidget::createWindowContainer(window, nullptr);
+            container->setGeometry(window->traits->x, window->traits->y, window->traits->width, window->traits->height);
+        }
+
+        GraphicsWindow::~GraphicsWindow()
+        {
+            // the container takes ownership of the window
+            if(container)
+            {
+                delete container;
+            }
+            else if(window)
+            {
+                delete window;
+            }
+        }
+
+        void GraphicsWindow::setClearColor(const vsg::vec4 &color)
+        {
+            renderGraph->setClearValues(vsg::sRGB_to_linear(color));
+        }
+
+        void GraphicsWindow::setClearColor(utils::Color color)
+        {
+            clearColor = color;
+            setClearColor(vsg::vec4(color.r, color.g, color.b, color.a));
+        }
+
+        const utils::Color& GraphicsWindow::getClearColor(void) const
+        {
+            return clearColor;
+        }
+
+        interfaces::GraphicsCameraInterface* GraphicsWindow::getCameraInterface(void) const
+        {
+            return nullptr;
+        }
+
+        void GraphicsWindow::setGraphicsEventHandler(interfaces::GraphicsEventInterface *graphicsEventHandler)
+        {
+            graphicsEventHandlers.clear();
+            addGraphicsEventHandler(graphicsEventHandler);
+        }
+
+        void GraphicsWindow::addGraphicsEventHandler(interfaces::GraphicsEventInterface *graphicsEventHandler)
+        {
+            if(graphicsEventHandler)
+            {
+                graphicsEventHandlers.push_back(graphicsEventHandler);
+            }
+        }
+
+        void GraphicsWindow::setFullscreen(bool val, int display)
+        {
+            (void)display;
+            if(!container)
+            {
+                return;
+            }
+            if(val)
+            {
+                container->showFullScreen();
+            }
+            else
+            {
+                container->showNormal();
+            }
+        }
+
+        void GraphicsWindow::setName(const std::string &name_)
+        {
+            name = name_;
+            window->setTitle(name.c_str());
+        }
+
+        const std::string GraphicsWindow::getName() const
+        {
+            return name;
+        }
+
+        void GraphicsWindow::getImageData(char *buffer, int &width, int &height)
+        {
+            (void)buffer;
+            width = height = 0;
+        }
+
+        void GraphicsWindow::getImageData(void *data, int &width, int &height)
+        {
+            (void)data;
+            width = height = 0;
+        }
+
+        void GraphicsWindow::getRTTDepthData(float *buffer, int &width, int &height)
+        {
+            (void)buffer;
+            width = height = 0;
+        }
+
+        void GraphicsWindow::setGrabFrames(bool value)
+        {
+            grabFrames = value;
+        }
+
+        void GraphicsWindow::setSaveFrames(bool value)
+        {
+            saveFrames = value;
+        }
+
+        bool GraphicsWindow::updateWorldTransform()
+        {
+            // only upload the uniform if the camera actually moved
+            vsg::mat4 projInverse(perspective->inverse());
+            vsg::mat4 viewInverse(lookAt->inverse());
+            WorldTransformUniform &worldTransform = worldTransformUniform->value();
+            if(worldTransform.projInverse == projInverse &&
+               worldTransform.viewInverse == viewInverse)
+            {
+                return false;
+            }
+            worldTransform.projInverse = projInverse;
+            worldTransform.viewInverse = viewInverse;
+            worldTransformUniform->dirty();
+            return true;
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "gui_helper_functions.hpp"
+
+#include <mars_interfaces/graphics/GraphicsWindowInterface.h>
+#include <mars_utils/Color.h>
+
+#include <vsg/all.h>
+#include <vsgQt/Window.h>
+
+#include <vector>
+
+class QWidget;
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        /**
+         * A 3d window with its own camera, world transform uniform and
+         * command graphs. All windows share the device, the viewer and the
+         * scene graph of the GraphicsManager, thus compiled resources are
+         * shared between the views.
+         */
+        class GraphicsWindow : public interfaces::GraphicsWindowInterface
+        {
+         public:
+            GraphicsWindow(unsigned long id, const std::string &name,
+                           vsg::ref_ptr<vsgQt::Viewer> viewer,
+                           vsg::ref_ptr<vsg::WindowTraits> traits,
+                           const std::vector<vsg::ref_ptr<vsg::Group>> &sceneRoots,
+                           bool secondaryCommandBuffers);
+            ~GraphicsWindow();
+
+            void setClearColor(const vsg::vec4 &color);
+
+            // GraphicsWindowInterface
+            /** The vsg camera has no GraphicsCameraInterface adapter yet. */
+            virtual interfaces::GraphicsCameraInterface* getCameraInterface(void) const;
+            virtual void setGraphicsEventHandler(interfaces::GraphicsEventInterface *graphicsEventHandler);
+            virtual void addGraphicsEventHandler(interfaces::GraphicsEventInterface *graphicsEventHandler);
+            virtual void setClearColor(utils::Color color);
+            virtual const utils::Color& getClearColor(void) const;
+            virtual void setFullscreen(bool val, int display = 1);
+            virtual void setName(const std::string &name);
+            virtual const std::string getName() const;
+            /**
+             * Windows are not read back, offscreen cameras are rendered by
+             * the camera atlas. Returns an empty image.
+             */
+            virtual void getImageData(char *buffer, int &width, int &height);
+            virtual void getImageData(void *data, int &width, int &height);
+            virtual void getRTTDepthData(float *buffer, int &width, int &height);
+            virtual void setGrabFrames(bool value);
+            virtual void setSaveFrames(bool value);
+            /** Returns true if the camera changed since the last call. */
+            bool updateWorldTransform();
+
+            inline unsigned long getID() const
+                { return id; }
+            inline vsgQt::Window* getWindow()
+                { return window; }
+            inline QWidget* getContainer()
+                { return container; }
+            inline vsg::ref_ptr<vsg::Camera> getCamera()
+                { return camera; }
+            inline vsg::ref_ptr<vsg::LookAt> getLookAt()
+                { return lookAt; }
+            inline vsg::ref_ptr<vsg::ProjectionMatrix> getPerspective()
+                { return perspective; }
+            inline vsg::ref_ptr<vsg::Trackball> getTrackball()
+                { return trackball; }
+            inline const std::vector<vsg::ref_ptr<vsg::View>>& getViews()
+                { return views; }
+            inline const vsg::CommandGraphs& getCommandGraphs()
+                { return commandGraphs; }
+
+        private:
+            unsigned long id;
+            std::string name;
+            vsgQt::Window *window;
+            QWidget *container;
+            vsg::ref_ptr<vsg::LookAt> lookAt;
+            vsg::ref_ptr<vsg::ProjectionMatrix> perspective;
+            vsg::ref_ptr<vsg::Camera> camera;
+            vsg::ref_ptr<vsg::Trackball> trackball;
+            vsg::ref_ptr<WorldTransformUniformValue> worldTransformUniform;
+            vsg::ref_ptr<vsg::RenderGraph> renderGraph;
+            std::vector<vsg::ref_ptr<vsg::View>> views;
+            vsg::CommandGraphs commandGraphs;
+            utils::Color clearColor;
+            std::vector<interfaces::GraphicsEventInterface*> graphicsEventHandlers;
+            bool grabFrames, saveFrames;
+        };
+    }
+}
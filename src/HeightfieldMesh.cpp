@@ -0,0 +1,204 @@
+#include "HeightfieldMesh.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        using Clock = std::chrono::steady_clock;
+
+        static double elapsedMs(Clock::time_point start)
+        {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+
+        // height differences to normals: n = (-dx, -dy, 1)/|(-dx, -dy, 1)|
+        static inline void storeNormal(float dx, float dy, vsg::vec3 &normal)
+        {
+            float s = 1.0f/std::sqrt(dx*dx + dy*dy + 1.0f);
+            normal.set(-dx*s, -dy*s, s);
+        }
+
+        void HeightfieldMesh::computeNormals(const vsg::floatArray2D &heights,
+                                             double sizeX, double sizeY, double scaleZ,
+                                             uint32_t x0, uint32_t y0, uint32_t width, uint32_t height,
+                                             vsg::vec3 *normals, bool simd)
+        {
+            const uint32_t w = heights.width(), h = heights.height();
+            if(w < 2 || h < 2)
+            {
+                // no neighbours to take differences from
+                for(size_t i=0; i<static_cast<size_t>(width)*height; ++i)
+                {
+                    normals[i].set(0.0f, 0.0f, 1.0f);
+                }
+                return;
+            }
+            const float *data = heights.data();
+            const float cellX = static_cast<float>(sizeX/(w-1)), cellY = static_cast<float>(sizeY/(h-1));
+            // central differences inside, one sided ones at the border
+            const float kx = static_cast<float>(scaleZ)/(2.0f*cellX);
+            const float kxBorder = static_cast<float>(scaleZ)/cellX;
+            for(uint32_t y=y0; y<y0+height; ++y)
+            {
+                uint32_t down = y > 0 ? y-1 : y, up = y+1 < h ? y+1 : y;
+                const float ky = static_cast<float>(scaleZ)/((up-down)*cellY);
+                const float *row = data + static_cast<size_t>(y)*w;
+                const float *rowDown = data + static_cast<size_t>(down)*w;
+                const float *rowUp = data + static_cast<size_t>(up)*w;
+                vsg::vec3 *out = normals + static_cast<size_t>(y-y0)*width;
+
+                uint32_t x = x0, end = x0+width;
+                if(x == 0)
+                {
+                    storeNormal((row[1] - row[0])*kxBorder, (rowUp[0] - rowDown[0])*ky, out[0]);
+                    ++x;
+                }
+#ifdef __SSE2__
+                if(simd)
+                {
+                    const __m128 kx4 = _mm_set1_ps(kx), ky4 = _mm_set1_ps(ky);
+                    const __m128 one = _mm_set1_ps(1.0f), sign = _mm_set1_ps(-0.0f);
+                    alignas(16) float nx[4], ny[4], nz[4];
+                    // x+4 < w keeps the right neighbours inside the row
+                    for(; x+4 <= end && x+4 < w; x+=4)
+                    {
+                        __m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(row + x + 1), _mm_loadu_ps(row + x - 1)), kx4);
+                        __m128 dy = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(rowUp + x), _mm_loadu_ps(rowDown + x)), ky4);
+                        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), one));
+                        __m128 s = _mm_div_ps(one, length);
+                        _mm_store_ps(nx, _mm_xor_ps(_mm_mul_ps(dx, s), sign));
+                        _mm_store_ps(ny, _mm_xor_ps(_mm_mul_ps(dy, s), sign));
+                        _mm_store_ps(nz, s);
+                        vsg::vec3 *n = out + (x - x0);
+                        for(int i=0; i<4; ++i)
+                        {
+                            n[i].set(nx[i], ny[i], nz[i]);
+                        }
+                    }
+                }
+#else
+                (void)simd;
+#endif
+                for(; x<end; ++x)
+                {
+                    if(x+1 < w)
+                    {
+                        storeNormal((row[x+1] - row[x-1])*kx, (rowUp[x] - rowDown[x])*ky, out[x-x0]);
+                    }
+                    else
+                    {
+                        storeNormal((row[x] - row[x-1])*kxBorder, (rowUp[x] - rowDown[x])*ky, out[x-x0]);
+                    }
+                }
+            }
+        }
+
+        static vsg::ref_ptr<vsg::VertexIndexDraw> buildChunk(const vsg::floatArray2D &heights,
+                                                             double sizeX, double sizeY, double scaleZ,
+                                                             uint32_t x0, uint32_t y0,
+                                                             uint32_t width, uint32_t height)
+        {
+            const uint32_t w = heights.width(), h = heights.height();
+            const size_t count = static_cast<size_t>(width)*height;
+            auto vertices = vsg::vec3Array::create(count);
+            auto normals = vsg::vec3Array::create(count);
+            auto texcoords = vsg::vec2Array::create(count);
+            const float cellX = static_cast<float>(sizeX/(w-1)), cellY = static_cast<float>(sizeY/(h-1));
+            for(uint32_t y=0; y<height; ++y)
+            {
+                const float *row = &heights.at(x0, y0+y);
+                vsg::vec3 *vertex = &vertices->at(static_cast<size_t>(y)*width);
+                vsg::vec2 *texcoord = &texcoords->at(static_cast<size_t>(y)*width);
+                float py = (y0+y)*cellY - 0.5f*static_cast<float>(sizeY);
+                float v = static_cast<float>(y0+y)/(h-1);
+                for(uint32_t x=0; x<width; ++x)
+                {
+                    vertex[x].set((x0+x)*cellX - 0.5f*static_cast<float>(sizeX), py,
+                                  row[x]*static_cast<float>(scaleZ));
+                    texcoord[x].set(static_cast<float>(x0+x)/(w-1), v);
+                }
+            }
+            HeightfieldMesh::computeNormals(heights, sizeX, sizeY, scaleZ, x0, y0, width, height,
+                                            normals->data());
+
+            auto indices = vsg::uintArray::create(static_cast<size_t>(width-1)*(height-1)*6);
+            uint32_t *index = indices->data();
+            for(uint32_t y=0; y+1<height; ++y)
+            {
+                for(uint32_t x=0; x+1<width; ++x)
+                {
+                    uint32_t i = y*width+x;
+                    index[0] = i;
+                    index[1] = i+1;
+                    index[2] = i+width+1;
+                    index[3] = i;
+                    index[4] = i+width+1;
+                    index[5] = i+width;
+                    index += 6;
+                }
+            }
+
+            auto draw = vsg::VertexIndexDraw::create();
+            draw->assignArrays(vsg::DataList{vertices, normals, texcoords});
+            draw->assignIndices(indices);
+            draw->indexCount = static_cast<uint32_t>(indices->size());
+            draw->instanceCount = 1;
+            return draw;
+        }
+
+        vsg::ref_ptr<vsg::Group> HeightfieldMesh::build(const vsg::floatArray2D &heights,
+                                                        double sizeX, double sizeY, double scaleZ,
+                                                        uint32_t chunkSize)
+        {
+            auto group = vsg::Group::create();
+            if(heights.width() < 2 || heights.height() < 2 || chunkSize < 1)
+            {
+                return group;
+            }
+            auto start = Clock::now();
+            const uint32_t numX = (heights.width()-2)/chunkSize + 1;
+            const uint32_t numY = (heights.height()-2)/chunkSize + 1;
+            group->children.resize(static_cast<size_t>(numX)*numY);
+
+            // the chunks are independent, each thread builds a band of them
+            unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+            size_t count = group->children.size();
+            size_t bandSize = (count + numThreads - 1) / numThreads;
+            std::vector<std::future<void>> results;
+            for(size_t begin=0; begin<count; begin+=bandSize)
+            {
+                size_t end = std::min(begin+bandSize, count);
+                results.push_back(std::async(std::launch::async, [&, begin, end]()
+                {
+                    for(size_t i=begin; i<end; ++i)
+                    {
+                        uint32_t x0 = static_cast<uint32_t>(i % numX)*chunkSize;
+                        uint32_t y0 = static_cast<uint32_t>(i / numX)*chunkSize;
+                        // chunks share their border vertices
+                        uint32_t width = std::min(chunkSize, heights.width()-1-x0) + 1;
+                        uint32_t height = std::min(chunkSize, heights.height()-1-y0) + 1;
+                        group->children[i] = buildChunk(heights, sizeX, sizeY, scaleZ, x0, y0, width, height);
+                    }
+                }));
+            }
+            for(auto &result: results)
+            {
+                result.get();
+            }
+            LOG_INFO("HeightfieldMesh: built %zu chunks of %ux%u vertices on %zu threads in %.1f ms",
+                     count, heights.width(), heights.height(), results.size(), elapsedMs(start));
+            return group;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vsg/all.h>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Triangulates a heightmap into indexed meshes, e.g. for terrains
+         * that have to match the triangles of the physics. The heightmap is
+         * split into chunks of chunkSize cells, each chunk is one
+         * VertexIndexDraw with vertices, normals and texture coordinates
+         * and 32 bit indices. The chunks are built in parallel and share
+         * their border vertices. Normals are central differences of the
+         * whole heightmap, thus they are continuous across the chunks, and
+         * computed for four vertices at once with SSE2.
+         */
+        class HeightfieldMesh
+        {
+        public:
+            /**
+             * \param heights heightmap in [0, 1], the first row is at -y
+             * \param sizeX, sizeY extent of the mesh in meters, centered at
+             *        the origin
+             * \param scaleZ height of the heightmap value 1
+             */
+            static vsg::ref_ptr<vsg::Group> build(const vsg::floatArray2D &heights,
+                                                  double sizeX, double sizeY, double scaleZ,
+                                                  uint32_t chunkSize = 256);
+            /**
+             * Writes the normals of the vertices [x0, x0+width) x [y0, y0+height)
+             * row by row. \c simd false selects the scalar implementation.
+             */
+            static void computeNormals(const vsg::floatArray2D &heights,
+                                       double sizeX, double sizeY, double scaleZ,
+                                       uint32_t x0, uint32_t y0, uint32_t width, uint32_t height,
+                                       vsg::vec3 *normals, bool simd = true);
+        };
+    }
+}
@@ -0,0 +1,293 @@
+#include "HeightmapLoader.hpp"
+#include "TextureManager.hpp"
+#include "CacheFile.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+#include <mars_utils/misc.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        unsigned int HeightmapLoader::numThreads = 0;
+        std::map<std::string, HeightmapLoader::Mapping> HeightmapLoader::mappings;
+        std::mutex HeightmapLoader::mutex;
+
+        // the heights start at a cache line after the header
+        static const size_t dataOffset = 64;
+        static const uint32_t heightsMagic = 0x314d484d; // "MHM1"
+
+        struct HeightsHeader
+        {
+            uint32_t magic;
+            uint32_t width, height;
+            uint32_t reserved;
+        };
+
+        // runs task(begin, end) on row bands of numThreads threads
+        template<typename Task>
+        static void parallelRows(uint32_t rows, unsigned int numThreads, Task task)
+        {
+            uint32_t bandSize = (rows + numThreads - 1) / numThreads;
+            std::vector<std::future<void>> results;
+            for(uint32_t begin=0; begin<rows; begin+=bandSize)
+            {
+                uint32_t end = std::min(begin+bandSize, rows);
+                results.push_back(std::async(std::launch::async, task, begin, end));
+            }
+            for(auto &result: results)
+            {
+                result.get();
+            }
+        }
+
+        void HeightmapLoader::setNumThreads(unsigned int numThreads_)
+        {
+            numThreads = numThreads_;
+        }
+
+        unsigned int HeightmapLoader::getNumThreads()
+        {
+            return numThreads ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        static std::string getCacheFile(const std::string &path)
+        {
+            std::string cacheFile = path;
+            utils::removeFilenameSuffix(&cacheFile);
+            return cacheFile + ".heights";
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> HeightmapLoader::loadCached(const std::string &filename)
+        {
+            std::string path = TextureManager::resolvePath(filename);
+            std::string cacheFile = getCacheFile(path);
+            std::error_code ec;
+            auto sourceTime = std::filesystem::last_write_time(path, ec);
+            if(!ec)
+            {
+                auto cacheTime = std::filesystem::last_write_time(cacheFile, ec);
+                if(!ec && cacheTime >= sourceTime)
+                {
+                    return map(cacheFile);
+                }
+            }
+            return {};
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> HeightmapLoader::load(const std::string &filename,
+                                                              vsg::ref_ptr<vsg::Data> image)
+        {
+            std::string path = TextureManager::resolvePath(filename);
+            std::string cacheFile = getCacheFile(path);
+            if(!image)
+            {
+                if(auto heights = loadCached(filename))
+                {
+                    return heights;
+                }
+                image = TextureManager::readImage(path);
+            }
+
+            auto heights = convert(image);
+            if(!heights)
+            {
+                return {};
+            }
+            if(!writeHeights(cacheFile, *heights))
+            {
+                LOG_WARN("HeightmapLoader: can not write %s", cacheFile.c_str());
+                return heights;
+            }
+            // the mapped file is shared with the following loads
+            if(auto mapped = map(cacheFile))
+            {
+                return mapped;
+            }
+            return heights;
+        }
+
+        void HeightmapLoader::convertRow(const vsg::Data &image, uint32_t y, float *dst)
+        {
+            uint32_t width = image.width(), height = image.height();
+            size_t stride = image.properties.stride;
+            bool bottomLeft = image.properties.origin == vsg::BOTTOM_LEFT;
+            const uint8_t *row = static_cast<const uint8_t*>(image.dataPointer()) +
+                static_cast<size_t>(bottomLeft ? y : height-1-y)*width*stride;
+            switch(image.properties.format)
+            {
+            case VK_FORMAT_R16_UNORM:
+            case VK_FORMAT_R16G16_UNORM:
+            case VK_FORMAT_R16G16B16_UNORM:
+            case VK_FORMAT_R16G16B16A16_UNORM:
+                for(uint32_t x=0; x<width; ++x)
+                {
+                    uint16_t value;
+                    memcpy(&value, row + x*stride, sizeof(value));
+                    dst[x] = value*(1.0f/65535.0f);
+                }
+                break;
+            case VK_FORMAT_R32_SFLOAT:
+            case VK_FORMAT_R32G32_SFLOAT:
+            case VK_FORMAT_R32G32B32_SFLOAT:
+            case VK_FORMAT_R32G32B32A32_SFLOAT:
+                for(uint32_t x=0; x<width; ++x)
+                {
+                    memcpy(dst + x, row + x*stride, sizeof(float));
+                }
+                break;
+            default:
+                // 8 bit formats, the first channel is the height
+                for(uint32_t x=0; x<width; ++x)
+                {
+                    dst[x] = row[x*stride]*(1.0f/255.0f);
+                }
+                break;
+            }
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> HeightmapLoader::convert(vsg::ref_ptr<vsg::Data> image)
+        {
+            if(!image || image->width() < 2 || image->height() < 2)
+            {
+                return {};
+            }
+            uint32_t width = image->width(), height = image->height();
+            auto heights = vsg::floatArray2D::create(width, height, vsg::Data::Properties{VK_FORMAT_R32_SFLOAT});
+            parallelRows(height, getNumThreads(), [&](uint32_t begin, uint32_t end)
+            {
+                for(uint32_t y=begin; y<end; ++y)
+                {
+                    convertRow(*image, y, heights->data() + static_cast<size_t>(y)*width);
+                }
+            });
+            return heights;
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> HeightmapLoader::readHeights(const std::string &file)
+        {
+            std::ifstream in(file, std::ios::binary);
+            HeightsHeader header;
+            if(!in || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+               header.magic != heightsMagic || header.width < 2 || header.height < 2)
+            {
+                return {};
+            }
+            auto heights = vsg::floatArray2D::create(header.width, header.height, vsg::Data::Properties{VK_FORMAT_R32_SFLOAT});
+            in.seekg(dataOffset, std::ios::beg);
+            if(!in.read(reinterpret_cast<char*>(heights->data()), heights->dataSize()))
+            {
+                return {};
+            }
+            return heights;
+        }
+
+        bool HeightmapLoader::writeHeights(const std::string &file, const vsg::floatArray2D &heights)
+        {
+            // other processes may map the file at the same time, it is
+            // replaced once it is complete
+            char header[dataOffset] = {0};
+            HeightsHeader info{heightsMagic, heights.width(), heights.height(), 0};
+            memcpy(header, &info, sizeof(info));
+            return CacheFile::write(file, {{header, sizeof(header)},
+                                           {heights.data(), heights.dataSize()}});
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> HeightmapLoader::map(const std::string &cacheFile)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = mappings.find(cacheFile);
+            if(it != mappings.end())
+            {
+                return it->second.heights;
+            }
+
+            int fd = open(cacheFile.c_str(), O_RDONLY);
+            if(fd < 0)
+            {
+                return {};
+            }
+            struct stat st;
+            HeightsHeader header;
+            if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < dataOffset ||
+               pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+               header.magic != heightsMagic || header.width < 2 || header.height < 2 ||
+               static_cast<size_t>(st.st_size) != dataOffset + static_cast<size_t>(header.width)*header.height*sizeof(float))
+            {
+                close(fd);
+                return {};
+            }
+            void *address = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(address == MAP_FAILED)
+            {
+                return {};
+            }
+            // the array does not own the mapped memory, it is unmapped by clear()
+            vsg::Data::Properties properties{VK_FORMAT_R32_SFLOAT};
+            properties.allocatorType = vsg::ALLOCATOR_TYPE_NO_DELETE;
+            auto heights = vsg::floatArray2D::create(header.width, header.height,
+                                                     reinterpret_cast<float*>(static_cast<uint8_t*>(address) + dataOffset),
+                                                     properties);
+            mappings[cacheFile] = Mapping{address, static_cast<size_t>(st.st_size), heights};
+            return heights;
+        }
+
+        void HeightmapLoader::scale(const vsg::floatArray2D &heights, double scale, double *pixelData)
+        {
+            size_t count = heights.valueCount();
+            const float *src = heights.data();
+            size_t bandSize = (count + getNumThreads() - 1) / getNumThreads();
+            parallelRows(static_cast<uint32_t>((count + bandSize - 1) / bandSize), getNumThreads(), [&](uint32_t begin, uint32_t end)
+            {
+                size_t i = begin*bandSize, last = std::min(count, end*bandSize);
+#ifdef __SSE2__
+                // two floats are converted and scaled per instruction
+                __m128d s = _mm_set1_pd(scale);
+                for(; i+4<=last; i+=4)
+                {
+                    __m128 v = _mm_loadu_ps(src + i);
+                    _mm_storeu_pd(pixelData + i, _mm_mul_pd(_mm_cvtps_pd(v), s));
+                    _mm_storeu_pd(pixelData + i + 2, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), s));
+                }
+#endif
+                for(; i<last; ++i)
+                {
+                    pixelData[i] = src[i]*scale;
+                }
+            });
+        }
+
+        void HeightmapLoader::clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(auto it=mappings.begin(); it!=mappings.end();)
+            {
+                // still used by a terrain or an upload
+                if(it->second.heights->referenceCount() > 1)
+                {
+                    ++it;
+                    continue;
+                }
+                it->second.heights = nullptr;
+                munmap(it->second.address, it->second.size);
+                it = mappings.erase(it);
+            }
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Reads heightmaps for the physics and the terrain rendering.
+         *
+         * 8 and 16 bit as well as float images are converted on several
+         * threads into a grid of heights in [0, 1] (float sources are taken
+         * as they are). The first row of the grid is the bottom row of the
+         * image. The grid is stored as <image>.heights next to the image and
+         * memory mapped by later loads while the image is unchanged, thus
+         * the physics and all terrains of a heightmap share one copy.
+         */
+        class HeightmapLoader
+        {
+        public:
+            /**
+             * Loads the heightmap, the decoded image is used instead of
+             * reading the file if given.
+             */
+            static vsg::ref_ptr<vsg::floatArray2D> load(const std::string &filename,
+                                                        vsg::ref_ptr<vsg::Data> image = {});
+            /** Maps the cached grid if it is newer than the image, else null. */
+            static vsg::ref_ptr<vsg::floatArray2D> loadCached(const std::string &filename);
+            /**
+             * Converts row y of a decoded image into heights, the first row
+             * is the bottom row of the image.
+             */
+            static void convertRow(const vsg::Data &image, uint32_t y, float *dst);
+            /**
+             * Writes scale*height of all grid points into pixelData as
+             * needed by terrainStruct.
+             */
+            static void scale(const vsg::floatArray2D &heights, double scale, double *pixelData);
+            /** 0: one thread per core */
+            static void setNumThreads(unsigned int numThreads);
+            /**
+             * Reads or writes a height grid in the format of the cache,
+             * used for the tiles of paged terrains. The grid is read into
+             * memory instead of being mapped.
+             */
+            static vsg::ref_ptr<vsg::floatArray2D> readHeights(const std::string &file);
+            static bool writeHeights(const std::string &file, const vsg::floatArray2D &heights);
+            /** Releases all mapped heightmaps that are not used anymore. */
+            static void clear();
+
+        private:
+            struct Mapping
+            {
+                void *address;
+                size_t size;
+                vsg::ref_ptr<vsg::floatArray2D> heights;
+            };
+
+            static unsigned int numThreads;
+            static std::map<std::string, Mapping> mappings;
+            static std::mutex mutex;
+
+            static vsg::ref_ptr<vsg::floatArray2D> convert(vsg::ref_ptr<vsg::Data> image);
+            static vsg::ref_ptr<vsg::floatArray2D> map(const std::string &cacheFile);
+            static unsigned int getNumThreads();
+        };
+    }
+}
@@ -1,17 +1,484 @@
 #include "MARSStateGroup.hpp"
 #include "gui_helper_functions.hpp"
+#include "shader/ShaderCache.hpp"
+#include "shader/ShaderNodeLibrary.hpp"
+#include "PipelineCache.hpp"
+#include "CacheFile.hpp"
+#include "TextureManager.hpp"
 #include <vsg/all.h>
 #include <mars_interfaces/Logging.hpp>
 #include <configmaps/ConfigData.h>
 #include <mars_utils/misc.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <tuple>
+
 namespace mars
 {
     namespace vsg_graphics
     {
-        vsg::ref_ptr<vsg::StateGroup> MARSStateGroup::create(configmaps::ConfigMap materialSpec)
+        vsg::ref_ptr<vsg::DescriptorSetLayout> MARSStateGroup::materialDescriptorSetLayout;
+        vsg::ref_ptr<vsg::DescriptorSetLayout> MARSStateGroup::worldTransformDescriptorSetLayout;
+        vsg::ref_ptr<vsg::PipelineLayout> MARSStateGroup::pipelineLayout;
+        std::map<MARSStateGroup::PipelineKey, vsg::ref_ptr<vsg::BindGraphicsPipeline>> MARSStateGroup::pipelines;
+        bool MARSStateGroup::materialTable = false;
+        uint32_t MARSStateGroup::materialTableSize = 0;
+        uint32_t MARSStateGroup::materialCount = 0;
+        vsg::ref_ptr<vsg::PbrMaterialArray> MARSStateGroup::materialTableData;
+        vsg::ref_ptr<vsg::DescriptorBuffer> MARSStateGroup::materialTableDescriptor;
+        vsg::ref_ptr<vsg::BindDescriptorSets> MARSStateGroup::bindMaterialTable;
+        std::vector<uint32_t> MARSStateGroup::freeTableIndices;
+        ShaderVariant MARSStateGroup::sceneVariant;
+        std::list<MaterialHandle> MARSStateGroup::materials;
+        std::map<std::string, MaterialHandle*> MARSStateGroup::materialNames;
+        std::map<uint64_t, MaterialHandle*> MARSStateGroup::materialHashes;
+        size_t MARSStateGroup::materialRequests = 0;
+        std::vector<MARSStateGroup::PipelineSource> MARSStateGroup::pipelineSources;
+        std::future<std::vector<MARSStateGroup::ReloadedPipeline>> MARSStateGroup::reloadJob;
+
+        bool MARSStateGroup::PipelineKey::operator<(const PipelineKey &other) const
+        {
+            return std::tie(states, defines, vertexSource, fragmentSource) <
+                std::tie(other.states, other.defines, other.vertexSource, other.fragmentSource);
+        }
+
+        bool MARSStateGroup::PipelineKey::operator==(const PipelineKey &other) const
+        {
+            return std::tie(states, defines, vertexSource, fragmentSource) ==
+                std::tie(other.states, other.defines, other.vertexSource, other.fragmentSource);
+        }
+
+        template<typename T>
+        static void appendState(std::string &bytes, const T &value)
+        {
+            bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        std::string MARSStateGroup::stateKey(const vsg::GraphicsPipelineStates &states,
+                                             const ShaderVariant &variant)
+        {
+            // every field that ends up in the VkGraphicsPipelineCreateInfo
+            std::string bytes;
+            for(auto &state: states)
+            {
+                if(auto vertexInput = state.cast<vsg::VertexInputState>())
+                {
+                    appendState(bytes, 'v');
+                    for(auto &binding: vertexInput->vertexBindingDescriptions) appendState(bytes, binding);
+                    appendState(bytes, 'a');
+                    for(auto &attribute: vertexInput->vertexAttributeDescriptions) appendState(bytes, attribute);
+                }
+                else if(auto inputAssembly = state.cast<vsg::InputAssemblyState>())
+                {
+                    appendState(bytes, 'i');
+                    appendState(bytes, inputAssembly->topology);
+                    appendState(bytes, inputAssembly->primitiveRestartEnable);
+                }
+                else if(auto raster = state.cast<vsg::RasterizationState>())
+                {
+                    appendState(bytes, 'r');
+                    appendState(bytes, raster->depthClampEnable);
+                    appendState(bytes, raster->rasterizerDiscardEnable);
+                    appendState(bytes, raster->polygonMode);
+                    appendState(bytes, raster->cullMode);
+                    appendState(bytes, raster->frontFace);
+                    appendState(bytes, raster->depthBiasEnable);
+                    appendState(bytes, raster->depthBiasConstantFactor);
+                    appendState(bytes, raster->depthBiasClamp);
+                    appendState(bytes, raster->depthBiasSlopeFactor);
+                    appendState(bytes, raster->lineWidth);
+                }
+                else if(auto multisample = state.cast<vsg::MultisampleState>())
+                {
+                    appendState(bytes, 'm');
+                    appendState(bytes, multisample->rasterizationSamples);
+                    appendState(bytes, multisample->sampleShadingEnable);
+                    appendState(bytes, multisample->minSampleShading);
+                    for(auto &mask: multisample->sampleMasks) appendState(bytes, mask);
+                    appendState(bytes, multisample->alphaToCoverageEnable);
+                    appendState(bytes, multisample->alphaToOneEnable);
+                }
+                else if(auto colorBlend = state.cast<vsg::ColorBlendState>())
+                {
+                    appendState(bytes, 'c');
+                    appendState(bytes, colorBlend->logicOpEnable);
+                    appendState(bytes, colorBlend->logicOp);
+                    for(auto &attachment: colorBlend->attachments) appendState(bytes, attachment);
+                    appendState(bytes, colorBlend->blendConstants);
+                }
+                else if(auto depth = state.cast<vsg::DepthStencilState>())
+                {
+                    appendState(bytes, 'd');
+                    appendState(bytes, depth->depthTestEnable);
+                    appendState(bytes, depth->depthWriteEnable);
+                    appendState(bytes, depth->depthCompareOp);
+                    appendState(bytes, depth->depthBoundsTestEnable);
+                    appendState(bytes, depth->stencilTestEnable);
+                    appendState(bytes, depth->front);
+                    appendState(bytes, depth->back);
+                    appendState(bytes, depth->minDepthBounds);
+                    appendState(bytes, depth->maxDepthBounds);
+                }
+                else
+                {
+                    // unknown states are never shared
+                    appendState(bytes, state.get());
+                }
+            }
+            appendState(bytes, 's');
+            for(auto &constant: variant.getSpecializationConstants())
+            {
+                appendState(bytes, constant.first);
+                bytes.append(static_cast<const char*>(constant.second->dataPointer()), constant.second->dataSize());
+            }
+            return bytes;
+        }
+
+        vsg::ref_ptr<vsg::PipelineLayout> MARSStateGroup::getPipelineLayout()
+        {
+            if(!pipelineLayout)
+            {
+                VkDescriptorType materialType = materialTable ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                // the vertex stage is used by the terrain for its level data
+                // and heightmap
+                vsg::DescriptorSetLayoutBindings descriptorBindings{
+                    {1, materialType, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},            // { binding, descriptorType, descriptorCount, stageFlags, pImmutableSamplers}
+                    {2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, std::max(1u, sceneVariant.texturePoolSize), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr} // diffuse texture(s), only written for textured materials or the pool
+                };
+                materialDescriptorSetLayout = vsg::DescriptorSetLayout::create(descriptorBindings);
+
+                vsg::DescriptorSetLayoutBindings worldTransformBindings{
+                    {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},
+                };
+                worldTransformDescriptorSetLayout = vsg::DescriptorSetLayout::create(worldTransformBindings);
+
+                vsg::PushConstantRanges pushConstantRanges{
+                    {VK_SHADER_STAGE_VERTEX_BIT, 0, 128} // projection, view, and model matrices, actual push constant calls automatically provided by the VSG's RecordTraversal
+                };
+                if(materialTable)
+                {
+                    // index into the material table and the texture pool
+                    pushConstantRanges.push_back({VK_SHADER_STAGE_FRAGMENT_BIT, 128, sceneVariant.texturePoolSize ? 8u : 4u});
+                }
+
+                auto viewDescriptorSetLayout = vsg::ViewDescriptorSetLayout::create();
+                pipelineLayout = vsg::PipelineLayout::create(vsg::DescriptorSetLayouts{materialDescriptorSetLayout, viewDescriptorSetLayout, worldTransformDescriptorSetLayout}, pushConstantRanges);
+            }
+            return pipelineLayout;
+        }
+
+        // replaces the arrays of all draws by vertices, normals, texture
+        // coordinates and colors with one entry per vertex
+        class ConformVertexArrays : public vsg::Inherit<vsg::Visitor, ConformVertexArrays>
+        {
+        public:
+            void apply(vsg::Node &node) override
+            {
+                node.traverse(*this);
+            }
+            void apply(vsg::Geometry &geometry) override
+            {
+                conform(geometry.arrays, [&geometry](const vsg::DataList &arrays) { geometry.assignArrays(arrays); });
+            }
+            void apply(vsg::VertexDraw &draw) override
+            {
+                conform(draw.arrays, [&draw](const vsg::DataList &arrays) { draw.assignArrays(arrays); });
+            }
+            void apply(vsg::VertexIndexDraw &draw) override
+            {
+                conform(draw.arrays, [&draw](const vsg::DataList &arrays) { draw.assignArrays(arrays); });
+            }
+
+        private:
+            template<typename Assign>
+            void conform(const vsg::BufferInfoList &bufferInfos, Assign assign)
+            {
+                if(bufferInfos.empty() || !bufferInfos[0]->data)
+                {
+                    return;
+                }
+                auto vertices = bufferInfos[0]->data.cast<vsg::vec3Array>();
+                if(!vertices)
+                {
+                    return;
+                }
+                uint32_t count = vertices->size();
+                vsg::ref_ptr<vsg::vec3Array> normals;
+                vsg::ref_ptr<vsg::vec2Array> texcoords;
+                vsg::ref_ptr<vsg::vec4Array> colors;
+                for(size_t i=1; i<bufferInfos.size(); ++i)
+                {
+                    auto data = bufferInfos[i]->data;
+                    if(!normals && data.cast<vsg::vec3Array>()) normals = data.cast<vsg::vec3Array>();
+                    else if(!texcoords && data.cast<vsg::vec2Array>()) texcoords = data.cast<vsg::vec2Array>();
+                    else if(!colors && data.cast<vsg::vec4Array>()) colors = data.cast<vsg::vec4Array>();
+                }
+                if(bufferInfos.size() == 4 && normals && texcoords && colors &&
+                   bufferInfos[1]->data == normals && bufferInfos[2]->data == texcoords && bufferInfos[3]->data == colors &&
+                   normals->size() == count && texcoords->size() == count && colors->size() == count)
+                {
+                    return;
+                }
+                if(!normals || normals->size() != count)
+                {
+                    normals = vsg::vec3Array::create(count);
+                    std::fill(normals->begin(), normals->end(), vsg::vec3(0.0f, 0.0f, 1.0f));
+                }
+                if(!texcoords || texcoords->size() != count)
+                {
+                    texcoords = vsg::vec2Array::create(count);
+                    std::fill(texcoords->begin(), texcoords->end(), vsg::vec2(0.0f, 0.0f));
+                }
+                if(!colors || colors->size() != count)
+                {
+                    // a single color is given per instance by vsg::Builder
+                    vsg::vec4 color = (colors && colors->size() > 0) ? colors->at(0) : vsg::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+                    colors = vsg::vec4Array::create(count);
+                    std::fill(colors->begin(), colors->end(), color);
+                }
+                assign(vsg::DataList{vertices, normals, texcoords, colors});
+            }
+        };
+
+        void MARSStateGroup::conformVertexArrays(vsg::ref_ptr<vsg::Node> node)
+        {
+            if(node)
+            {
+                auto conform = ConformVertexArrays::create();
+                node->accept(*conform);
+            }
+        }
+
+        vsg::ref_ptr<vsg::StateCommand> MARSStateGroup::createWorldTransformBinding(vsg::ref_ptr<vsg::Data> worldTransformUniform)
+        {
+            auto layout = getPipelineLayout();
+            auto worldTransformUniformDescriptor = vsg::DescriptorBuffer::create(worldTransformUniform, 0, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+            auto descriptorSet = vsg::DescriptorSet::create(worldTransformDescriptorSetLayout, vsg::Descriptors{worldTransformUniformDescriptor});
+            return vsg::BindDescriptorSet::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 2, descriptorSet);
+        }
+
+        void MARSStateGroup::clear()
+        {
+            if(reloadJob.valid())
+            {
+                reloadJob.wait();
+                reloadJob = {};
+            }
+            pipelineSources.clear();
+            materials.clear();
+            materialNames.clear();
+            materialHashes.clear();
+            materialRequests = 0;
+            materialDescriptorSetLayout = 0;
+            worldTransformDescriptorSetLayout = 0;
+            pipelineLayout = 0;
+            pipelines.clear();
+            materialCount = 0;
+            freeTableIndices.clear();
+            materialTableData = 0;
+            materialTableDescriptor = 0;
+            bindMaterialTable = 0;
+        }
+
+        void MARSStateGroup::setMaterialTable(bool enable, uint32_t size)
+        {
+            if(pipelineLayout && enable != materialTable)
+            {
+                LOG_ERROR("MARSStateGroup: material table mode can not be changed after materials are created");
+                return;
+            }
+            materialTable = enable;
+            materialTableSize = size;
+        }
+
+        void MARSStateGroup::setMaterial(uint32_t index, const vsg::PbrMaterial &material)
+        {
+            if(!materialTableData || index >= materialCount || index >= materialTableData->size())
+            {
+                return;
+            }
+            materialTableData->at(index) = material;
+            materialTableData->dirty();
+        }
+
+        void MARSStateGroup::setTexturePool(uint32_t size)
+        {
+            if(pipelineLayout && size != sceneVariant.texturePoolSize)
+            {
+                LOG_ERROR("MARSStateGroup: the texture pool can not be changed after materials are created");
+                return;
+            }
+            if(size > 0 && !materialTable)
+            {
+                LOG_WARN("MARSStateGroup: the texture pool requires the material table mode");
+                size = 0;
+            }
+            sceneVariant.texturePoolSize = size;
+            TextureManager::setPoolSize(size);
+        }
+
+        void MARSStateGroup::setShadowTechnique(const std::string &technique)
+        {
+            // the sm and pssm shadow nodes are legacy GLSL using the fixed
+            // function state of OpenGL and do not compile for Vulkan
+            if(!technique.empty() && technique != "none")
+            {
+                LOG_ERROR("MARSStateGroup: shadow technique %s is not supported, using none", technique.c_str());
+            }
+            sceneVariant.shadowTechnique = "none";
+        }
+
+        void MARSStateGroup::setLightCount(uint32_t lightCount)
+        {
+            sceneVariant.lightCount = lightCount;
+        }
+
+        static void hashConfigMap(uint64_t &h, configmaps::ConfigMap &map);
+
+        static void hashConfigItem(uint64_t &h, configmaps::ConfigItem &item)
+        {
+            if(item.isMap())
+            {
+                configmaps::ConfigMap map = item;
+                CacheFile::hashValue(h, 'm');
+                hashConfigMap(h, map);
+            }
+            else if(item.isVector())
+            {
+                CacheFile::hashValue(h, 'v');
+                for(auto it = item.begin(); it != item.end(); ++it)
+                {
+                    hashConfigItem(h, *it);
+                }
+            }
+            else
+            {
+                CacheFile::hashValue(h, 'a');
+                CacheFile::hashString(h, item.toString());
+            }
+        }
+
+        static void hashConfigMap(uint64_t &h, configmaps::ConfigMap &map)
+        {
+            // the config map keeps the insertion order, equal contents
+            // have to give equal hashes
+            std::vector<std::string> keys;
+            for(auto &it: map)
+            {
+                keys.push_back(it.first);
+            }
+            std::sort(keys.begin(), keys.end());
+            for(auto &key: keys)
+            {
+                CacheFile::hashString(h, key);
+                hashConfigItem(h, map[key]);
+            }
+            CacheFile::hashValue(h, 'e');
+        }
+
+        uint64_t MARSStateGroup::contentHash(configmaps::ConfigMap materialSpec)
+        {
+            materialSpec.erase("name");
+            uint64_t h = CacheFile::hashSeed;
+            hashConfigMap(h, materialSpec);
+            return h;
+        }
+
+        MaterialHandle* MARSStateGroup::getMaterial(const std::string &name)
+        {
+            auto it = materialNames.find(name);
+            return it != materialNames.end() ? it->second : nullptr;
+        }
+
+        MaterialHandle* MARSStateGroup::findMaterial(const configmaps::ConfigMap &materialSpec)
+        {
+            auto it = materialHashes.find(contentHash(materialSpec));
+            return it != materialHashes.end() ? it->second : nullptr;
+        }
+
+        void MARSStateGroup::setMaterialName(const std::string &name, MaterialHandle *handle)
+        {
+            ++materialRequests;
+            auto it = materialNames.find(name);
+            if(it != materialNames.end())
+            {
+                if(it->second == handle)
+                {
+                    return;
+                }
+                // the name now refers to the latest material
+                it->second->names.erase(name);
+            }
+            materialNames[name] = handle;
+            handle->names.insert(name);
+        }
+
+        MaterialStats MARSStateGroup::getMaterialStats()
+        {
+            MaterialStats stats;
+            stats.requested = materialRequests;
+            stats.names = materialNames.size();
+            stats.unique = materials.size();
+            stats.pipelines = pipelines.size();
+            return stats;
+        }
+
+        void MARSStateGroup::updateMaterial(MaterialHandle &handle)
+        {
+            auto it = materialHashes.find(handle.hash);
+            if(it != materialHashes.end() && it->second == &handle)
+            {
+                materialHashes.erase(it);
+            }
+            vsg::PbrMaterial material = toPbrMaterial(handle.spec);
+            if(handle.value)
+            {
+                handle.value->value() = material;
+                handle.value->dirty();
+            }
+            else
+            {
+                setMaterial(handle.tableIndex, material);
+            }
+        }
+
+        std::vector<vsg::ref_ptr<vsg::StateGroup>> MARSStateGroup::releaseMaterials(const std::set<const vsg::StateGroup*> &unused)
         {
+            std::vector<vsg::ref_ptr<vsg::StateGroup>> released;
+            for(auto it = materials.begin(); it != materials.end() && released.size() < unused.size();)
+            {
+                if(!it->names.empty() || !unused.count(it->stateGroup.get()))
+                {
+                    ++it;
+                    continue;
+                }
+                auto hashIt = materialHashes.find(it->hash);
+                if(hashIt != materialHashes.end() && hashIt->second == &*it)
+                {
+                    materialHashes.erase(hashIt);
+                }
+                if(materialTable && !it->value)
+                {
+                    freeTableIndices.push_back(it->tableIndex);
+                }
+                released.push_back(it->stateGroup);
+                it = materials.erase(it);
+            }
+            return released;
+        }
 
+        bool MARSStateGroup::isTransparent(configmaps::ConfigMap &materialSpec)
+        {
+            if(materialSpec.hasKey("blending"))
+            {
+                return (bool)materialSpec["blending"];
+            }
+            return toPbrMaterial(materialSpec).diffuseFactor[3] < 1.0f;
+        }
+
+        vsg::PbrMaterial MARSStateGroup::toPbrMaterial(configmaps::ConfigMap &materialSpec)
+        {
             // create material info for shader
             vsg::PbrMaterial material;
             material.baseColorFactor[0] = (double)materialSpec["ambientColor"]["r"];
@@ -22,6 +489,10 @@ namespace mars
             material.diffuseFactor[1] = (double)materialSpec["diffuseColor"]["g"];
             material.diffuseFactor[2] = (double)materialSpec["diffuseColor"]["b"];
             material.diffuseFactor[3] = (double)materialSpec["diffuseColor"]["a"];
+            if(materialSpec.hasKey("transparency") && (double)materialSpec["transparency"] > 0.0)
+            {
+                material.diffuseFactor[3] *= 1.0 - (double)materialSpec["transparency"];
+            }
             material.specularFactor[0] = (double)materialSpec["specularColor"]["r"];
             material.specularFactor[1] = (double)materialSpec["specularColor"]["g"];
             material.specularFactor[2] = (double)materialSpec["specularColor"]["b"];
@@ -31,48 +502,122 @@ namespace mars
             if(material.roughnessFactor > 1.0) material.roughnessFactor = 1.0;
 
             material.metallicFactor = material.roughnessFactor;
+            return material;
+        }
+
+        vsg::ref_ptr<vsg::StateGroup> MARSStateGroup::create(configmaps::ConfigMap materialSpec,
+                                                             bool shared)
+        {
+            vsg::PbrMaterial material = toPbrMaterial(materialSpec);
+            MaterialHandle handle;
+            handle.spec = materialSpec;
 
             // load shaders
             std::string vertexShaderFile = utils::pathJoin(GuiHelper::resourcePath, "resources/graph_shader/default_vertex_shader.yml");
             std::string fragmentShaderFile = utils::pathJoin(GuiHelper::resourcePath, "resources/graph_shader/default_fragment_shader.yml");
-            GraphShader &vs = GuiHelper::readGraphShaderFromFile(vertexShaderFile);
-            GraphShader &fs = GuiHelper::readGraphShaderFromFile(fragmentShaderFile);
+            // select the shader variant by the material and scene properties
+            ShaderVariant variant = sceneVariant;
+            variant.texture = materialSpec.hasKey("diffuseTexture") && !materialSpec["diffuseTexture"].getString().empty();
+            variant.vertexColors = materialSpec.hasKey("vertexColors") && (bool)materialSpec["vertexColors"];
+            GraphShader vs = GuiHelper::readGraphShaderFromFile(vertexShaderFile, variant);
+            GraphShader fs = GuiHelper::readGraphShaderFromFile(fragmentShaderFile, variant);
             // copy varyings from vertex shader to fragment shader
             fs.varyings = vs.varyings;
 
-            // for testing we try to load shaders from working dir
-            auto vertexShader = vsg::ShaderStage::create(VK_SHADER_STAGE_VERTEX_BIT, "main", vs.generateVertexShaderSource());
-            auto fragmentShader = vsg::ShaderStage::create(VK_SHADER_STAGE_FRAGMENT_BIT, "main", fs.generateFragmentShaderSource());
-            if (!vertexShader || !fragmentShader)
+            std::string vertexSource = vs.generateVertexShaderSource();
+            std::string fragmentSource = fs.generateFragmentShaderSource();
+
+            auto layout = getPipelineLayout();
+            std::set<std::string> defines = variant.getDefines();
+            vsg::ref_ptr<vsg::BindDescriptorSets> bindDescriptorSets;
+            vsg::ref_ptr<vsg::Descriptor> materialDescriptor;
+            vsg::ref_ptr<vsg::PushConstants> selectMaterial;
+            if(materialTable)
             {
-                std::cout << "Could not create shaders." << std::endl;
+                if(!materialTableData)
+                {
+                    materialTableData = vsg::PbrMaterialArray::create(materialTableSize);
+                    materialTableData->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+                    materialTableDescriptor = vsg::DescriptorBuffer::create(materialTableData, 1, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+                    auto descriptorSet = vsg::DescriptorSet::create(materialDescriptorSetLayout, vsg::Descriptors{materialTableDescriptor});
+                    bindMaterialTable = vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, vsg::DescriptorSets{descriptorSet});
+                }
+                uint32_t index = 0;
+                if(!freeTableIndices.empty() || materialCount < materialTableSize)
+                {
+                    if(!freeTableIndices.empty())
+                    {
+                        index = freeTableIndices.back();
+                        freeTableIndices.pop_back();
+                    }
+                    else
+                    {
+                        index = materialCount++;
+                    }
+                    materialTableData->at(index) = material;
+                    materialTableData->dirty();
+                    // all materials share the descriptor set, only the index changes
+                    bindDescriptorSets = bindMaterialTable;
+                    materialDescriptor = materialTableDescriptor;
+                }
+                else
+                {
+                    // The table buffer is shared by all compiled descriptor
+                    // sets and can not grow. Further materials get a table
+                    // with a single entry of their own, they render
+                    // correctly but are not batched.
+                    if(materialCount++ == materialTableSize)
+                    {
+                        LOG_WARN("MARSStateGroup: material table is full (%u entries), increase Graphics/materialTableSize",
+                                 materialTableSize);
+                    }
+                    handle.value = vsg::PbrMaterialValue::create(material);
+                    handle.value->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+                    materialDescriptor = vsg::DescriptorBuffer::create(handle.value, 1, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+                    auto descriptorSet = vsg::DescriptorSet::create(materialDescriptorSetLayout, vsg::Descriptors{materialDescriptor});
+                    bindDescriptorSets = vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, vsg::DescriptorSets{descriptorSet});
+                }
+                handle.tableIndex = index;
+                defines.insert("MARS_MATERIAL_TABLE");
+                if(variant.texturePoolSize)
+                {
+                    uint32_t textureIndex = variant.texture ? TextureManager::addToPool(materialSpec["diffuseTexture"].getString()) : 0;
+                    selectMaterial = vsg::PushConstants::create(VK_SHADER_STAGE_FRAGMENT_BIT, 128, vsg::uivec2Value::create(index, textureIndex));
+                }
+                else
+                {
+                    selectMaterial = vsg::PushConstants::create(VK_SHADER_STAGE_FRAGMENT_BIT, 128, vsg::uintValue::create(index));
+                }
+            }
+            else
+            {
+                handle.value = vsg::PbrMaterialValue::create(material);
+                handle.value->properties.dataVariance = vsg::DataVariance::DYNAMIC_DATA;
+                materialDescriptor = vsg::DescriptorBuffer::create(handle.value, 1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+                auto descriptorSet = vsg::DescriptorSet::create(materialDescriptorSetLayout, vsg::Descriptors{materialDescriptor});
+                bindDescriptorSets = vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, vsg::DescriptorSets{descriptorSet});
             }
-            const vsg::ShaderStages shaders{vertexShader, fragmentShader};
-
-            vsg::DescriptorSetLayoutBindings descriptorBindings{
-                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr},
-                {1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr},            // { binding, descriptorType, descriptorCount, stageFlags, pImmutableSamplers}
-                //{2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr}
-            };
-            auto descriptorSetLayout = vsg::DescriptorSetLayout::create(descriptorBindings);
-
-            // todo: howto deal with global uniforms
-            auto worldTransformUniformDescriptor = vsg::DescriptorBuffer::create(GuiHelper::worldTransformUniform, 0, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-            auto materialUniformDescriptor = vsg::DescriptorBuffer::create(vsg::PbrMaterialValue::create(material), 1, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-            auto descriptorSet = vsg::DescriptorSet::create(descriptorSetLayout, vsg::Descriptors{worldTransformUniformDescriptor, materialUniformDescriptor});
-
-
-            vsg::PushConstantRanges pushConstantRanges{
-                {VK_SHADER_STAGE_VERTEX_BIT, 0, 128} // projection, view, and model matrices, actual push constant calls automatically provided by the VSG's RecordTraversal
-            };
 
+            // all meshes are conformed to the same arrays by
+            // conformVertexArrays(): vertices, normals, texture coordinates
+            // and colors; only the attributes depend on the variant
             vsg::VertexInputState::Bindings vertexBindingsDescriptions{
                 VkVertexInputBindingDescription{0, sizeof(vsg::vec3), VK_VERTEX_INPUT_RATE_VERTEX},
-                VkVertexInputBindingDescription{1, sizeof(vsg::vec3), VK_VERTEX_INPUT_RATE_VERTEX}};
+                VkVertexInputBindingDescription{1, sizeof(vsg::vec3), VK_VERTEX_INPUT_RATE_VERTEX},
+                VkVertexInputBindingDescription{2, sizeof(vsg::vec2), VK_VERTEX_INPUT_RATE_VERTEX},
+                VkVertexInputBindingDescription{3, sizeof(vsg::vec4), VK_VERTEX_INPUT_RATE_VERTEX}};
 
             vsg::VertexInputState::Attributes vertexAttributeDescriptions{
                 VkVertexInputAttributeDescription{0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0},
                 VkVertexInputAttributeDescription{1, 1, VK_FORMAT_R32G32B32_SFLOAT, 0}};
+            if(variant.texture)
+            {
+                vertexAttributeDescriptions.push_back(VkVertexInputAttributeDescription{3, 2, VK_FORMAT_R32G32_SFLOAT, 0});
+            }
+            if(variant.vertexColors)
+            {
+                vertexAttributeDescriptions.push_back(VkVertexInputAttributeDescription{2, 3, VK_FORMAT_R32G32B32A32_SFLOAT, 0});
+            }
 
             auto rasterState = vsg::RasterizationState::create();
             rasterState->cullMode = VK_CULL_MODE_NONE;//VK_CULL_MODE_BACK_BIT;
@@ -82,20 +627,57 @@ namespace mars
             depthState->depthWriteEnable = VK_TRUE;
             depthState->depthCompareOp = VK_COMPARE_OP_GREATER;
 
+            auto colorBlendState = vsg::ColorBlendState::create();
+            bool transparent = isTransparent(materialSpec);
+            if(transparent)
+            {
+                // blended over the opaque scene, sorted back to front by
+                // the transparency bin
+                VkPipelineColorBlendAttachmentState blending{};
+                blending.blendEnable = VK_TRUE;
+                blending.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+                blending.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+                blending.colorBlendOp = VK_BLEND_OP_ADD;
+                blending.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+                blending.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+                blending.alphaBlendOp = VK_BLEND_OP_ADD;
+                blending.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                    VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+                colorBlendState->attachments = {blending};
+                depthState->depthWriteEnable = VK_FALSE;
+            }
+
             vsg::GraphicsPipelineStates pipelineStates{
                 vsg::VertexInputState::create(vertexBindingsDescriptions, vertexAttributeDescriptions),
                 vsg::InputAssemblyState::create(),
                 rasterState,
                 vsg::MultisampleState::create(),
-                vsg::ColorBlendState::create(),
+                colorBlendState,
                 depthState};
+            PipelineKey key{vertexSource, fragmentSource, defines, stateKey(pipelineStates, variant)};
 
-            auto viewDescriptorSetLayout = vsg::ViewDescriptorSetLayout::create();
-            auto pipelineLayout = vsg::PipelineLayout::create(vsg::DescriptorSetLayouts{viewDescriptorSetLayout, descriptorSetLayout}, pushConstantRanges);
-            auto pipeline = vsg::GraphicsPipeline::create(pipelineLayout, shaders, pipelineStates);
-            auto bindDescriptorSets = vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, vsg::DescriptorSets{descriptorSet});
-            auto bindGraphicsPipeline = vsg::BindGraphicsPipeline::create(pipeline);
+            vsg::ref_ptr<vsg::BindGraphicsPipeline> bindGraphicsPipeline;
+            auto pipelineIt = pipelines.find(key);
+            if(pipelineIt != pipelines.end())
+            {
+                bindGraphicsPipeline = pipelineIt->second;
+            }
+            else
+            {
+                auto vertexShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_VERTEX_BIT, vertexSource, defines);
+                auto fragmentShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_FRAGMENT_BIT, fragmentSource, defines);
+                vertexShader->specializationConstants = variant.getSpecializationConstants();
+                fragmentShader->specializationConstants = variant.getSpecializationConstants();
+                const vsg::ShaderStages shaders{vertexShader, fragmentShader};
 
+                // created with the pipeline cache of the device
+                auto pipeline = CachedGraphicsPipeline::create(layout, shaders, pipelineStates);
+                bindGraphicsPipeline = CachedBindGraphicsPipeline::create(pipeline);
+                pipelines[key] = bindGraphicsPipeline;
+                CompileScheduler::add(pipeline);
+                pipelineSources.push_back(PipelineSource{key, vertexShaderFile, fragmentShaderFile,
+                                                         variant, defines, pipelineStates, bindGraphicsPipeline});
+            }
 
             // bind light data
             vsg::DescriptorSetLayoutBindings viewDescriptorBindings{
@@ -106,9 +688,195 @@ namespace mars
 
             auto root = vsg::StateGroup::create();
             root->add(bindGraphicsPipeline);
-            root->add(bindDescriptorSets); // descriptor set is used for textures and uniforms etc
-            root->add(vsg::BindViewDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, vds_set));
+            if(variant.texturePoolSize)
+            {
+                // the material table and all textures in one shared set
+                auto materialLayout = materialDescriptorSetLayout;
+                TextureManager::bindPool(root,
+                                         [layout, materialLayout, materialDescriptor](vsg::ref_ptr<vsg::DescriptorImage> textures)
+                                         {
+                                             auto descriptorSet = vsg::DescriptorSet::create(materialLayout, vsg::Descriptors{materialDescriptor, textures});
+                                             return vsg::ref_ptr<vsg::StateCommand>(vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, vsg::DescriptorSets{descriptorSet}));
+                                         });
+            }
+            else if(variant.texture)
+            {
+                // textured materials have a descriptor set of their own, it
+                // is replaced when the texture is streamed in
+                auto materialLayout = materialDescriptorSetLayout;
+                TextureManager::bindTexture(materialSpec["diffuseTexture"].getString(), root,
+                                            [layout, materialLayout, materialDescriptor](vsg::ref_ptr<vsg::DescriptorImage> texture)
+                                            {
+                                                auto descriptorSet = vsg::DescriptorSet::create(materialLayout, vsg::Descriptors{materialDescriptor, texture});
+                                                return vsg::ref_ptr<vsg::StateCommand>(vsg::BindDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, vsg::DescriptorSets{descriptorSet}));
+                                            });
+            }
+            else
+            {
+                root->add(bindDescriptorSets); // descriptor set is used for textures and uniforms etc
+            }
+            root->add(vsg::BindViewDescriptorSets::create(VK_PIPELINE_BIND_POINT_GRAPHICS, layout, vds_set));
+            if(selectMaterial)
+            {
+                // push constants are commands, they are recorded in front of
+                // the drawables of this material
+                root->addChild(selectMaterial);
+            }
+            handle.stateGroup = root;
+            handle.hash = contentHash(materialSpec);
+            handle.originHash = handle.hash;
+            materials.push_back(handle);
+            if(shared)
+            {
+                materialHashes[handle.hash] = &materials.back();
+            }
+            setMaterialName(materialSpec["name"].getString(), &materials.back());
             return root;
         }
+
+        bool MARSStateGroup::isReloading()
+        {
+            return reloadJob.valid();
+        }
+
+        bool MARSStateGroup::reloadReady()
+        {
+            return reloadJob.valid() &&
+                reloadJob.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        bool MARSStateGroup::reloadShaders(const std::set<std::string> &files,
+                                           vsg::ref_ptr<vsg::Device> device,
+                                           const std::vector<CompileScheduler::ViewTarget> &targets,
+                                           unsigned int numThreads)
+        {
+            if(isReloading())
+            {
+                return false;
+            }
+            // a changed node function may be used by every graph
+            bool all = false;
+            std::set<std::filesystem::path> graphFiles;
+            for(auto &file: files)
+            {
+                if(ShaderNodeLibrary::reload(file))
+                {
+                    all = true;
+                }
+                else
+                {
+                    graphFiles.insert(std::filesystem::path(file).lexically_normal());
+                    GuiHelper::clearGraphShaders(file);
+                }
+            }
+            if(all)
+            {
+                GuiHelper::clearGraphShaders();
+            }
+
+            std::vector<std::pair<size_t, PipelineSource>> sources;
+            for(size_t i=0; i<pipelineSources.size(); ++i)
+            {
+                const PipelineSource &source = pipelineSources[i];
+                if(all ||
+                   graphFiles.count(std::filesystem::path(source.vertexShaderFile).lexically_normal()) ||
+                   graphFiles.count(std::filesystem::path(source.fragmentShaderFile).lexically_normal()))
+                {
+                    sources.emplace_back(i, source);
+                }
+            }
+            if(sources.empty())
+            {
+                return true;
+            }
+            LOG_INFO("MARSStateGroup: reloading %zu pipelines", sources.size());
+            reloadJob = std::async(std::launch::async, rebuildPipelines, sources, device, targets, numThreads);
+            return true;
+        }
+
+        std::vector<MARSStateGroup::ReloadedPipeline> MARSStateGroup::rebuildPipelines(std::vector<std::pair<size_t, PipelineSource>> sources,
+                                                                                      vsg::ref_ptr<vsg::Device> device,
+                                                                                      std::vector<CompileScheduler::ViewTarget> targets,
+                                                                                      unsigned int numThreads)
+        {
+            std::vector<ReloadedPipeline> results;
+            std::vector<vsg::ref_ptr<vsg::GraphicsPipeline>> compilePipelines;
+            for(auto &it: sources)
+            {
+                const PipelineSource &source = it.second;
+                try
+                {
+                    GraphShader vs = GuiHelper::readGraphShaderFromFile(source.vertexShaderFile, source.variant);
+                    GraphShader fs = GuiHelper::readGraphShaderFromFile(source.fragmentShaderFile, source.variant);
+                    fs.varyings = vs.varyings;
+                    std::string vertexSource = vs.generateVertexShaderSource();
+                    std::string fragmentSource = fs.generateFragmentShaderSource();
+                    PipelineKey key{vertexSource, fragmentSource, source.defines, source.key.states};
+                    if(key == source.key)
+                    {
+                        continue;
+                    }
+                    auto vertexShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_VERTEX_BIT, vertexSource, source.defines);
+                    auto fragmentShader = ShaderCache::createShaderStage(VK_SHADER_STAGE_FRAGMENT_BIT, fragmentSource, source.defines);
+                    vertexShader->specializationConstants = source.variant.getSpecializationConstants();
+                    fragmentShader->specializationConstants = source.variant.getSpecializationConstants();
+                    auto pipeline = CachedGraphicsPipeline::create(source.bindGraphicsPipeline->pipeline->layout,
+                                                                   vsg::ShaderStages{vertexShader, fragmentShader},
+                                                                   source.states);
+                    results.push_back(ReloadedPipeline{it.first, key, pipeline});
+                    compilePipelines.push_back(pipeline);
+                }
+                catch(...)
+                {
+                    LOG_ERROR("MARSStateGroup: failed to reload %s or %s",
+                              source.vertexShaderFile.c_str(), source.fragmentShaderFile.c_str());
+                }
+            }
+            // the old pipelines are kept if the new ones do not compile
+            try
+            {
+                auto compiled = CompileScheduler::compile(device, targets, numThreads, compilePipelines);
+                std::set<vsg::GraphicsPipeline*> compiledSet;
+                for(auto &pipeline: compiled)
+                {
+                    compiledSet.insert(pipeline.get());
+                }
+                results.erase(std::remove_if(results.begin(), results.end(),
+                                             [&compiledSet](const ReloadedPipeline &result)
+                                             {
+                                                 return !compiledSet.count(result.pipeline.get());
+                                             }),
+                              results.end());
+            }
+            catch(const vsg::Exception &e)
+            {
+                LOG_ERROR("MARSStateGroup: failed to compile reloaded shaders: %s", e.message.c_str());
+                results.clear();
+            }
+            catch(...)
+            {
+                LOG_ERROR("MARSStateGroup: failed to compile reloaded shaders");
+                results.clear();
+            }
+            return results;
+        }
+
+        void MARSStateGroup::swapReloadedShaders()
+        {
+            if(!reloadJob.valid())
+            {
+                return;
+            }
+            std::vector<ReloadedPipeline> results = reloadJob.get();
+            for(auto &result: results)
+            {
+                PipelineSource &source = pipelineSources[result.index];
+                pipelines.erase(source.key);
+                source.key = result.key;
+                source.bindGraphicsPipeline->pipeline = result.pipeline;
+                pipelines[result.key] = source.bindGraphicsPipeline;
+            }
+            LOG_INFO("MARSStateGroup: swapped in %zu reloaded pipelines", results.size());
+        }
     }
 }
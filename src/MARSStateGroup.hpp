@@ -2,15 +2,230 @@
 #include <vsg/all.h>
 #include <mars_interfaces/Logging.hpp>
 #include <configmaps/ConfigData.h>
+#include "shader/GraphShader.hpp"
+#include "CompileScheduler.hpp"
+
+#include <future>
+#include <list>
+#include <map>
+#include <set>
 
 namespace mars
 {
     namespace vsg_graphics
     {
+        /**
+         * Direct reference to the parameters of a created material. The
+         * values are DYNAMIC_DATA, thus edits are uploaded by the transfer
+         * task of the viewer without traversing the scene graph or
+         * compiling anything.
+         */
+        struct MaterialHandle
+        {
+            configmaps::ConfigMap spec;
+            vsg::ref_ptr<vsg::StateGroup> stateGroup;
+            // uniform of the material, null in material table mode
+            vsg::ref_ptr<vsg::PbrMaterialValue> value;
+            uint32_t tableIndex = 0;
+            // hash of the spec without the name
+            uint64_t hash = 0;
+            // hash of the spec the name was first created with, edits and
+            // rebuilt state groups keep it, thus later objects requesting
+            // the original spec by this name get the edited material
+            uint64_t originHash = 0;
+            // all material names resolving to this material
+            std::set<std::string> names;
+        };
+
+        struct MaterialStats
+        {
+            // materials requested by the scene, one per name or object
+            size_t requested = 0;
+            // material names currently registered
+            size_t names = 0;
+            // materials with own descriptors or table entries on the GPU
+            size_t unique = 0;
+            size_t pipelines = 0;
+        };
+
         class MARSStateGroup
         {
         public:
-            static vsg::ref_ptr<vsg::StateGroup> create(configmaps::ConfigMap material);
+            /**
+             * Creates the state group of a new material and registers it by
+             * its name. A shared material is also registered by the hash of
+             * its contents to be found by findMaterial().
+             */
+            static vsg::ref_ptr<vsg::StateGroup> create(configmaps::ConfigMap material,
+                                                        bool shared = true);
+            static vsg::PbrMaterial toPbrMaterial(configmaps::ConfigMap &materialSpec);
+            /**
+             * Materials with a diffuse alpha below one, or with "blending"
+             * set, get a blended pipeline without depth writes.
+             */
+            static bool isTransparent(configmaps::ConfigMap &materialSpec);
+            /**
+             * Hash of the material spec ignoring the name and the order of
+             * the keys.
+             */
+            static uint64_t contentHash(configmaps::ConfigMap materialSpec);
+
+            /** Returns the handle of a material by its name or null. */
+            static MaterialHandle* getMaterial(const std::string &name);
+            /** Returns a shared material with equal contents or null. */
+            static MaterialHandle* findMaterial(const configmaps::ConfigMap &materialSpec);
+            /** Registers the name as alias of the material. */
+            static void setMaterialName(const std::string &name, MaterialHandle *handle);
+            static const std::map<std::string, MaterialHandle*>& getMaterialNames()
+                { return materialNames; }
+            static MaterialStats getMaterialStats();
+            /**
+             * Writes the parameters of the material spec into the material
+             * data. Changes of the shader variant, e.g. adding a texture,
+             * need a new state group and are ignored. An edited material is
+             * no longer shared with new materials of equal contents.
+             */
+            static void updateMaterial(MaterialHandle &handle);
+            /**
+             * Removes the materials without names among the given state
+             * groups, which are not used by any object anymore, e.g. replaced
+             * by an edit, and frees their table entries. Returns the removed
+             * state groups which have to be removed from the scene.
+             */
+            static std::vector<vsg::ref_ptr<vsg::StateGroup>> releaseMaterials(const std::set<const vsg::StateGroup*> &unused);
+
+            /**
+             * The pipeline layout shared by all materials and views:
+             *   set 0: material (binding 1) and diffuse texture (binding 2)
+             *   set 1: view dependent data (lights) provided by vsg
+             *   set 2: world transform uniform of the view
+             */
+            static vsg::ref_ptr<vsg::PipelineLayout> getPipelineLayout();
+            static vsg::ref_ptr<vsg::DescriptorSetLayout> getMaterialDescriptorSetLayout()
+                { getPipelineLayout(); return materialDescriptorSetLayout; }
+            static vsg::ref_ptr<vsg::StateCommand> createWorldTransformBinding(vsg::ref_ptr<vsg::Data> worldTransformUniform);
+            /**
+             * Brings the vertex arrays of all draws below the node into the
+             * layout of the material pipelines: vertices, normals, texture
+             * coordinates and colors, one entry per vertex each. Missing
+             * arrays are filled with defaults.
+             */
+            static void conformVertexArrays(vsg::ref_ptr<vsg::Node> node);
+            static void clear();
+
+            /**
+             * In material table mode all materials are packed into one
+             * storage buffer bound once at set 0, binding 1. Each material
+             * state group selects its entry by a fragment push constant at
+             * offset 128. Has to be set before the first material is created.
+             */
+            static void setMaterialTable(bool enable, uint32_t size = 4096);
+            static bool useMaterialTable()
+                { return materialTable; }
+            /** Updates one entry of the material table. */
+            static void setMaterial(uint32_t index, const vsg::PbrMaterial &material);
+            /**
+             * Texture pool for the material table mode: the textures of all
+             * materials are bound as one array at set 0, binding 2 and
+             * selected by a second fragment push constant at offset 132.
+             * Thus materials only differ in their push constants and objects
+             * with different textures are drawn without changing the
+             * pipeline or descriptor sets. 0 disables the pool.
+             */
+            static void setTexturePool(uint32_t size);
+
+            /**
+             * Scene properties of the shader variants. Materials created
+             * afterwards use shaders generated for these properties.
+             */
+            static void setShadowTechnique(const std::string &technique);
+            static void setLightCount(uint32_t lightCount);
+            static uint32_t getLightCount()
+                { return sceneVariant.lightCount; }
+
+            /**
+             * Regenerates the shaders of all pipelines using one of the
+             * changed shader graph or node function files and compiles the
+             * new pipelines for the given views in the background. The
+             * reload is skipped and false is returned while the previous
+             * one is still running.
+             */
+            static bool reloadShaders(const std::set<std::string> &files,
+                                      vsg::ref_ptr<vsg::Device> device,
+                                      const std::vector<CompileScheduler::ViewTarget> &targets,
+                                      unsigned int numThreads);
+            static bool isReloading();
+            /** Returns true if the reloaded pipelines can be swapped in. */
+            static bool reloadReady();
+            /**
+             * Replaces the pipelines of the materials by the reloaded ones.
+             * Has to be called at a frame boundary when the old pipelines
+             * are no longer used by the device.
+             */
+            static void swapReloadedShaders();
+
+        private:
+            // Full key of a pipeline, compared by value: the generated
+            // sources, the defines and the bytes of all pipeline states
+            // and specialization constants.
+            struct PipelineKey
+            {
+                std::string vertexSource, fragmentSource;
+                std::set<std::string> defines;
+                std::string states;
+
+                bool operator<(const PipelineKey &other) const;
+                bool operator==(const PipelineKey &other) const;
+            };
+            // everything needed to generate the pipeline of a material again
+            struct PipelineSource
+            {
+                PipelineKey key;
+                std::string vertexShaderFile, fragmentShaderFile;
+                ShaderVariant variant;
+                std::set<std::string> defines;
+                vsg::GraphicsPipelineStates states;
+                vsg::ref_ptr<vsg::BindGraphicsPipeline> bindGraphicsPipeline;
+            };
+            struct ReloadedPipeline
+            {
+                size_t index;
+                PipelineKey key;
+                vsg::ref_ptr<vsg::GraphicsPipeline> pipeline;
+            };
+
+            static std::string stateKey(const vsg::GraphicsPipelineStates &states,
+                                        const ShaderVariant &variant);
+            static std::vector<ReloadedPipeline> rebuildPipelines(std::vector<std::pair<size_t, PipelineSource>> sources,
+                                                                  vsg::ref_ptr<vsg::Device> device,
+                                                                  std::vector<CompileScheduler::ViewTarget> targets,
+                                                                  unsigned int numThreads);
+
+            static vsg::ref_ptr<vsg::DescriptorSetLayout> materialDescriptorSetLayout;
+            static vsg::ref_ptr<vsg::DescriptorSetLayout> worldTransformDescriptorSetLayout;
+            static vsg::ref_ptr<vsg::PipelineLayout> pipelineLayout;
+            // materials with equal shaders and states share one pipeline and
+            // only differ in their material descriptor set
+            static std::map<PipelineKey, vsg::ref_ptr<vsg::BindGraphicsPipeline>> pipelines;
+
+            static bool materialTable;
+            static uint32_t materialTableSize;
+            static uint32_t materialCount;
+            static vsg::ref_ptr<vsg::PbrMaterialArray> materialTableData;
+            static vsg::ref_ptr<vsg::DescriptorBuffer> materialTableDescriptor;
+            static vsg::ref_ptr<vsg::BindDescriptorSets> bindMaterialTable;
+            // entries of released materials, reused before the table grows
+            static std::vector<uint32_t> freeTableIndices;
+
+            static ShaderVariant sceneVariant;
+
+            // the list keeps the handles at fixed addresses
+            static std::list<MaterialHandle> materials;
+            static std::map<std::string, MaterialHandle*> materialNames;
+            static std::map<uint64_t, MaterialHandle*> materialHashes;
+            static size_t materialRequests;
+            static std::vector<PipelineSource> pipelineSources;
+            static std::future<std::vector<ReloadedPipeline>> reloadJob;
         };
     }
 }
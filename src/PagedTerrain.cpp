@@ -0,0 +1,449 @@
+#include "PagedTerrain.hpp"
+#include "ClipmapTerrain.hpp"
+#include "HeightmapLoader.hpp"
+#include "TextureManager.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <algorithm>
+#include <limits>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::vector<vsg::observer_ptr<PagedTerrain>> PagedTerrain::terrains;
+        vsg::ref_ptr<vsg::OperationThreads> PagedTerrain::pagingThread;
+        uint32_t PagedTerrain::pagingSize = 4096;
+        size_t PagedTerrain::memoryBudget = 256*1024*1024;
+        size_t PagedTerrain::physicsSamples = 0;
+        std::atomic<size_t> PagedTerrain::residentSize{0};
+        std::vector<PagedTerrain::Retired> PagedTerrain::retired;
+
+        // a tile is refined if an eye is closer than this times its extent
+        static const double splitDistance = 2.0;
+        // tile requests of a terrain handed to the paging thread at once,
+        // the closest tiles are requested first
+        static const uint32_t maxLoading = 16;
+
+        // reads one tile on the paging thread
+        struct TileLoadOperation : public vsg::Inherit<vsg::Operation, TileLoadOperation>
+        {
+            TileLoadOperation(vsg::ref_ptr<PagedTerrain> t, uint64_t k,
+                              uint32_t l, uint32_t tx, uint32_t ty) :
+                terrain(t), key(k), level(l), x(tx), y(ty) {}
+
+            void run() override
+                {
+                    if(terrain->referenceCount() == 1)
+                    {
+                        // the draw object of the terrain is gone
+                        return;
+                    }
+                    auto heights = terrain->tileSet->readTile(level, x, y);
+                    if(heights)
+                    {
+                        // the tiles are only kept on the device
+                        heights->properties.dataVariance = vsg::STATIC_DATA_UNREF_AFTER_TRANSFER;
+                    }
+                    std::lock_guard<std::mutex> lock(terrain->mutex);
+                    terrain->loaded.emplace_back(key, heights);
+                }
+
+            vsg::ref_ptr<PagedTerrain> terrain;
+            uint64_t key;
+            uint32_t level, x, y;
+        };
+
+        PagedTerrain::PagedTerrain(vsg::ref_ptr<TerrainTileSet> tileSet_,
+                                   double sizeX_, double sizeY_, double scaleZ_,
+                                   const vsg::vec4 &color_) :
+            tileSet(tileSet_), sizeX(sizeX_), sizeY(sizeY_), scaleZ(scaleZ_),
+            color(color_), numLoading(0)
+        {
+            // one level of the clipmap grid covers a tile with a vertex per
+            // sample, thus level 0 is drawn at full resolution
+            const uint32_t gridSize = tileSet->getTileSize();
+            const uint32_t n = gridSize + 1;
+            auto vertices = vsg::vec2Array::create(n*n);
+            for(uint32_t y=0; y<n; ++y)
+            {
+                for(uint32_t x=0; x<n; ++x)
+                {
+                    vertices->at(y*n+x).set(x, y);
+                }
+            }
+            auto indices = vsg::uintArray::create(gridSize*gridSize*6);
+            uint32_t *index = indices->data();
+            for(uint32_t y=0; y<gridSize; ++y)
+            {
+                for(uint32_t x=0; x<gridSize; ++x)
+                {
+                    uint32_t i = y*n+x;
+                    for(uint32_t v: {i, i+1, i+n+1, i, i+n+1, i+n})
+                    {
+                        *index++ = v;
+                    }
+                }
+            }
+            gridDraw = vsg::VertexIndexDraw::create();
+            gridDraw->assignArrays(vsg::DataList{vertices});
+            gridDraw->assignIndices(indices);
+            gridDraw->indexCount = static_cast<uint32_t>(indices->size());
+            gridDraw->instanceCount = 1;
+
+            // header, color and one level as in the clipmap terrain
+            stateGroup = ClipmapTerrain::createPipelineState(4);
+            drawNode = vsg::Group::create();
+            terrains.push_back(vsg::observer_ptr<PagedTerrain>(this));
+        }
+
+        PagedTerrain::~PagedTerrain()
+        {
+            size_t size = 0;
+            for(auto &it: tiles)
+            {
+                size += it.second.size;
+            }
+            // clear() may have reset the size already
+            size_t current = residentSize.load();
+            while(!residentSize.compare_exchange_weak(current, current - std::min(current, size)))
+            {
+            }
+        }
+
+        void PagedTerrain::setTransform(vsg::ref_ptr<vsg::MatrixTransform> transform_)
+        {
+            transform = transform_;
+        }
+
+        uint64_t PagedTerrain::getKey(uint32_t level, uint32_t x, uint32_t y)
+        {
+            return (static_cast<uint64_t>(level) << 48) | (static_cast<uint64_t>(y) << 24) | x;
+        }
+
+        PagedTerrain::Tile& PagedTerrain::getTile(uint32_t level, uint32_t x, uint32_t y)
+        {
+            auto it = tiles.find(getKey(level, x, y));
+            if(it == tiles.end())
+            {
+                it = tiles.emplace(getKey(level, x, y), Tile{level, x, y, false, false, {}, 0, 0}).first;
+            }
+            return it->second;
+        }
+
+        vsg::dvec4 PagedTerrain::getTileBounds(uint32_t level, uint32_t x, uint32_t y) const
+        {
+            // samples of the heightmap to meters, the first row is at -y
+            uint32_t width = tileSet->getWidth(), height = tileSet->getHeight();
+            uint32_t size = tileSet->getTileSize();
+            uint32_t x0 = std::min((x*size) << level, width-1);
+            uint32_t x1 = std::min((x*size + tileSet->getTileWidth(level, x) - 1) << level, width-1);
+            uint32_t y0 = std::min((y*size) << level, height-1);
+            uint32_t y1 = std::min((y*size + tileSet->getTileHeight(level, y) - 1) << level, height-1);
+            double cellX = sizeX/(width-1), cellY = sizeY/(height-1);
+            return vsg::dvec4(x0*cellX - 0.5*sizeX, y0*cellY - 0.5*sizeY,
+                              x1*cellX - 0.5*sizeX, y1*cellY - 0.5*sizeY);
+        }
+
+        vsg::ref_ptr<vsg::Node> PagedTerrain::createTileNode(const Tile &tile,
+                                                             vsg::ref_ptr<vsg::floatArray2D> heights)
+        {
+            vsg::dvec4 bounds = getTileBounds(tile.level, tile.x, tile.y);
+            float extentX = static_cast<float>(bounds.z - bounds.x);
+            float extentY = static_cast<float>(bounds.w - bounds.y);
+            // the square grid covers the tile, the fragment shader discards
+            // the rest of smaller tiles at the border of the map
+            auto data = vsg::vec4Array::create(4);
+            data->at(0).set(extentX, extentY, scaleZ, 1);
+            const float gridSize = static_cast<float>(tileSet->getTileSize());
+            data->at(1).set(gridSize, 0.7f, 0, 0);
+            data->at(2) = color;
+            data->at(3).set(0, 0, std::max(extentX, extentY)/gridSize, 0);
+
+            auto tileTransform = vsg::MatrixTransform::create(vsg::translate(0.5*(bounds.x + bounds.z),
+                                                                             0.5*(bounds.y + bounds.w), 0.0));
+            tileTransform->addChild(gridDraw);
+            auto node = vsg::StateGroup::create();
+            node->add(ClipmapTerrain::bindTerrainData(data, heights));
+            node->addChild(tileTransform);
+            return node;
+        }
+
+        void PagedTerrain::select(uint32_t level, uint32_t x, uint32_t y, uint64_t frameCount,
+                                  const std::vector<vsg::dvec3> &eyes,
+                                  vsg::Group::Children &drawn,
+                                  std::vector<std::pair<double, uint64_t>> &requests)
+        {
+            vsg::dvec4 bounds = getTileBounds(level, x, y);
+            double distance = std::numeric_limits<double>::max();
+            for(auto &eye: eyes)
+            {
+                vsg::dvec3 d(std::max({bounds.x - eye.x, 0.0, eye.x - bounds.z}),
+                             std::max({bounds.y - eye.y, 0.0, eye.y - bounds.w}),
+                             std::max({-eye.z, 0.0, eye.z - scaleZ}));
+                distance = std::min(distance, vsg::length(d));
+            }
+            Tile &tile = getTile(level, x, y);
+            tile.lastUsed = frameCount;
+            if(!tile.node)
+            {
+                if(!tile.loading && !tile.failed)
+                {
+                    requests.emplace_back(distance, getKey(level, x, y));
+                }
+                return;
+            }
+
+            double extent = std::max(bounds.z - bounds.x, bounds.w - bounds.y);
+            if(level > 0 && distance < splitDistance*extent)
+            {
+                // the children replace the tile once all of them are resident
+                std::vector<Tile*> children;
+                bool resident = true;
+                for(uint32_t cy=2*y; cy<std::min(2*y+2, tileSet->getNumTilesY(level-1)); ++cy)
+                {
+                    for(uint32_t cx=2*x; cx<std::min(2*x+2, tileSet->getNumTilesX(level-1)); ++cx)
+                    {
+                        Tile &child = getTile(level-1, cx, cy);
+                        child.lastUsed = frameCount;
+                        children.push_back(&child);
+                        if(!child.node)
+                        {
+                            resident = false;
+                            if(!child.loading && !child.failed)
+                            {
+                                requests.emplace_back(distance, getKey(level-1, cx, cy));
+                            }
+                        }
+                    }
+                }
+                if(resident)
+                {
+                    for(auto child: children)
+                    {
+                        select(child->level, child->x, child->y, frameCount, eyes, drawn, requests);
+                    }
+                    return;
+                }
+            }
+            drawn.push_back(tile.node);
+        }
+
+        bool PagedTerrain::update(const std::vector<vsg::dvec3> &eyes, vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            if(!viewer->compileManager)
+            {
+                return false;
+            }
+            uint64_t frameCount = viewer->getFrameStamp() ? viewer->getFrameStamp()->frameCount : 0;
+
+            std::vector<std::pair<uint64_t, vsg::ref_ptr<vsg::floatArray2D>>> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.swap(loaded);
+            }
+            for(auto &it: finished)
+            {
+                Tile &tile = tiles[it.first];
+                tile.loading = false;
+                --numLoading;
+                if(!it.second)
+                {
+                    LOG_ERROR("PagedTerrain: can not read tile %u/%u_%u", tile.level, tile.x, tile.y);
+                    tile.failed = true;
+                    continue;
+                }
+                // the data is released after the transfer
+                size_t size = it.second->dataSize();
+                auto node = createTileNode(tile, it.second);
+                auto result = viewer->compileManager->compile(node);
+                if(!result)
+                {
+                    LOG_ERROR("PagedTerrain: failed to compile tile %u/%u_%u", tile.level, tile.x, tile.y);
+                    tile.failed = true;
+                    continue;
+                }
+                vsg::updateViewer(*viewer, result);
+                tile.node = node;
+                tile.size = size;
+                residentSize += size;
+            }
+
+            std::vector<vsg::dvec3> localEyes;
+            for(auto &eye: eyes)
+            {
+                localEyes.push_back(transform ? vsg::inverse(transform->matrix)*eye : eye);
+            }
+            vsg::Group::Children drawn;
+            std::vector<std::pair<double, uint64_t>> requests;
+            uint32_t top = tileSet->getNumLevels() - 1;
+            for(uint32_t y=0; y<tileSet->getNumTilesY(top); ++y)
+            {
+                for(uint32_t x=0; x<tileSet->getNumTilesX(top); ++x)
+                {
+                    select(top, x, y, frameCount, localEyes, drawn, requests);
+                }
+            }
+
+            std::sort(requests.begin(), requests.end());
+            for(auto &request: requests)
+            {
+                if(numLoading >= maxLoading)
+                {
+                    break;
+                }
+                if(!pagingThread)
+                {
+                    pagingThread = vsg::OperationThreads::create(1);
+                }
+                Tile &tile = tiles[request.second];
+                tile.loading = true;
+                ++numLoading;
+                pagingThread->add(TileLoadOperation::create(vsg::ref_ptr<PagedTerrain>(this), request.second,
+                                                            tile.level, tile.x, tile.y));
+            }
+
+            if(drawn == drawNode->children)
+            {
+                return false;
+            }
+            drawNode->children.swap(drawn);
+            return true;
+        }
+
+        void PagedTerrain::evict(const std::vector<vsg::ref_ptr<PagedTerrain>> &terrains, uint64_t frameCount)
+        {
+            // the old tiles may still be used by frames in flight
+            retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                         [frameCount](const Retired &r) { return frameCount > r.frameCount + 3; }),
+                          retired.end());
+            if(residentSize <= memoryBudget)
+            {
+                return;
+            }
+            // tiles not selected by the last update, the coarsest tiles stay
+            std::vector<Tile*> candidates;
+            for(auto &terrain: terrains)
+            {
+                uint32_t top = terrain->tileSet->getNumLevels() - 1;
+                for(auto &it: terrain->tiles)
+                {
+                    Tile &tile = it.second;
+                    if(tile.node && tile.level < top && tile.lastUsed < frameCount)
+                    {
+                        candidates.push_back(&tile);
+                    }
+                }
+            }
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const Tile *a, const Tile *b) { return a->lastUsed < b->lastUsed; });
+            for(auto tile: candidates)
+            {
+                if(residentSize <= memoryBudget)
+                {
+                    break;
+                }
+                retired.push_back(Retired{frameCount, tile->node});
+                tile->node = 0;
+                residentSize -= tile->size;
+                tile->size = 0;
+            }
+        }
+
+        vsg::ref_ptr<TerrainTileSet> PagedTerrain::openTileSet(const std::string &filename,
+                                                               vsg::ref_ptr<vsg::floatArray2D> &heights)
+        {
+            // the physics and the draw object may open the same map, it is
+            // tiled only once
+            static std::mutex buildMutex;
+            std::lock_guard<std::mutex> lock(buildMutex);
+            std::string path = TextureManager::resolvePath(filename);
+            std::string tileDirectory = TerrainTileSet::getDirectory(path);
+            if(auto tileSet = TerrainTileSet::open(tileDirectory, path))
+            {
+                return tileSet;
+            }
+            // large maps are tiled row by row from the decoded image,
+            // without converting the whole map into a height grid
+            heights = HeightmapLoader::loadCached(filename);
+            vsg::ref_ptr<vsg::Data> image;
+            if(!heights)
+            {
+                image = TextureManager::readImage(path);
+            }
+            uint32_t width = heights ? heights->width() : (image ? image->width() : 0);
+            uint32_t height = heights ? heights->height() : (image ? image->height() : 0);
+            if(std::max(width, height) > pagingSize && width > 1 && height > 1)
+            {
+                bool built;
+                if(heights)
+                {
+                    built = TerrainTileSet::build(*heights, tileDirectory, tileSize);
+                }
+                else
+                {
+                    built = TerrainTileSet::build(width, height,
+                                                  [&image](uint32_t y, float *row)
+                                                  { HeightmapLoader::convertRow(*image, y, row); },
+                                                  tileDirectory, tileSize);
+                }
+                vsg::ref_ptr<TerrainTileSet> tileSet;
+                if(built && (tileSet = TerrainTileSet::open(tileDirectory)))
+                {
+                    heights = {};
+                    return tileSet;
+                }
+            }
+            if(!heights && image)
+            {
+                heights = HeightmapLoader::load(filename, image);
+            }
+            return {};
+        }
+
+        bool PagedTerrain::updateAll(const std::vector<vsg::dvec3> &eyes, vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            std::vector<vsg::ref_ptr<PagedTerrain>> existing;
+            for(auto it = terrains.begin(); it != terrains.end();)
+            {
+                vsg::ref_ptr<PagedTerrain> terrain(*it);
+                if(!terrain)
+                {
+                    // the draw object of the terrain is gone, its tiles
+                    // were released with it
+                    it = terrains.erase(it);
+                    continue;
+                }
+                existing.push_back(terrain);
+                ++it;
+            }
+            if(existing.empty())
+            {
+                return false;
+            }
+            bool changed = false;
+            for(auto &terrain: existing)
+            {
+                changed |= terrain->update(eyes, viewer);
+            }
+            evict(existing, viewer->getFrameStamp() ? viewer->getFrameStamp()->frameCount : 0);
+            return changed;
+        }
+
+        void PagedTerrain::clear()
+        {
+            if(pagingThread)
+            {
+                // the queued operations keep their terrains, they are
+                // cancelled and only a running one is finished
+                pagingThread->queue->take_all();
+                pagingThread->stop();
+                pagingThread = 0;
+            }
+            terrains.clear();
+            retired.clear();
+            residentSize = 0;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "TerrainTileSet.hpp"
+
+#include <vsg/all.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        /**
+         * Heightmap terrain streamed from a TerrainTileSet. Every update
+         * selects the quadtree tiles around the cameras, tiles close to a
+         * camera are refined into their four children once all of them are
+         * resident. Missing tiles are read by a background paging thread and
+         * compiled between two frames, tiles not used recently are released
+         * when the tiles of all terrains exceed the memory budget. Only the
+         * coarsest tile is kept resident all the time, thus a terrain starts
+         * without loading the whole map.
+         *
+         * Every tile is drawn with the clipmap terrain shaders as a single
+         * level grid of one cell per sample of a full tile.
+         */
+        class PagedTerrain : public vsg::Inherit<vsg::Object, PagedTerrain>
+        {
+         public:
+            /** Cells of a tile when splitting a heightmap into tiles. */
+            static const uint32_t tileSize = 128;
+
+            /**
+             * \param sizeX, sizeY extent of the terrain in meters
+             * \param scaleZ height of the heightmap value 1
+             */
+            PagedTerrain(vsg::ref_ptr<TerrainTileSet> tileSet,
+                         double sizeX, double sizeY, double scaleZ,
+                         const vsg::vec4 &color);
+            ~PagedTerrain();
+
+            /** State of the terrain, the transform of the terrain is its child. */
+            inline vsg::ref_ptr<vsg::StateGroup> getStateGroup()
+                { return stateGroup; }
+            /** The selected tiles to be placed below the transform. */
+            inline vsg::ref_ptr<vsg::Group> getDrawNode()
+                { return drawNode; }
+            void setTransform(vsg::ref_ptr<vsg::MatrixTransform> transform);
+
+            /**
+             * Swaps in the loaded tiles, selects the tiles for the eyes given
+             * in world coordinates and requests the missing ones. Has to be
+             * called between two frames. Returns true if the drawn tiles
+             * changed.
+             */
+            bool update(const std::vector<vsg::dvec3> &eyes, vsg::ref_ptr<vsg::Viewer> viewer);
+            /** Updates all existing terrains, called once per frame. */
+            static bool updateAll(const std::vector<vsg::dvec3> &eyes, vsg::ref_ptr<vsg::Viewer> viewer);
+
+            /** Heightmaps with more samples per side are split into tiles. */
+            static void setPagingSize(uint32_t size)
+                { pagingSize = size; }
+            static uint32_t getPagingSize()
+                { return pagingSize; }
+            /** Size of the resident tiles of all terrains in bytes. */
+            static void setMemoryBudget(size_t bytes)
+                { memoryBudget = bytes; }
+            /**
+             * Maximum samples of a paged heightmap handed to the physics, 0
+             * for as many as fit into the memory budget. Coarser levels save
+             * memory but the physics no longer matches the rendered terrain.
+             */
+            static void setPhysicsSamples(size_t samples)
+                { physicsSamples = samples; }
+            static size_t getPhysicsSamples()
+                { return physicsSamples ? physicsSamples : memoryBudget/sizeof(double); }
+            /**
+             * Returns the tile set of a heightmap, it is built from the rows
+             * of the image if the map is larger than the paging size.
+             * Otherwise returns nothing and the heights of the map if they
+             * can be read.
+             */
+            static vsg::ref_ptr<TerrainTileSet> openTileSet(const std::string &filename,
+                                                            vsg::ref_ptr<vsg::floatArray2D> &heights);
+            static void clear();
+
+        private:
+            struct Tile
+            {
+                uint32_t level, x, y;
+                bool loading, failed;
+                vsg::ref_ptr<vsg::Node> node;
+                size_t size;
+                uint64_t lastUsed;
+            };
+            struct Retired
+            {
+                uint64_t frameCount;
+                vsg::ref_ptr<vsg::Node> node;
+            };
+            friend struct TileLoadOperation;
+
+            vsg::ref_ptr<TerrainTileSet> tileSet;
+            double sizeX, sizeY, scaleZ;
+            vsg::vec4 color;
+            std::map<uint64_t, Tile> tiles;
+            // tiles read by the paging thread since the last update
+            std::vector<std::pair<uint64_t, vsg::ref_ptr<vsg::floatArray2D>>> loaded;
+            std::mutex mutex;
+            uint32_t numLoading;
+            vsg::ref_ptr<vsg::StateGroup> stateGroup;
+            vsg::ref_ptr<vsg::Group> drawNode;
+            vsg::ref_ptr<vsg::VertexIndexDraw> gridDraw;
+            vsg::ref_ptr<vsg::MatrixTransform> transform;
+
+            // the draw objects own the terrains
+            static std::vector<vsg::observer_ptr<PagedTerrain>> terrains;
+            static vsg::ref_ptr<vsg::OperationThreads> pagingThread;
+            static uint32_t pagingSize;
+            static size_t memoryBudget;
+            static size_t physicsSamples;
+            // a terrain may be released by the paging thread
+            static std::atomic<size_t> residentSize;
+            static std::vector<Retired> retired;
+
+            static uint64_t getKey(uint32_t level, uint32_t x, uint32_t y);
+            Tile& getTile(uint32_t level, uint32_t x, uint32_t y);
+            /** Bounds of a tile in the frame of the terrain: x0, y0, x1, y1. */
+            vsg::dvec4 getTileBounds(uint32_t level, uint32_t x, uint32_t y) const;
+            vsg::ref_ptr<vsg::Node> createTileNode(const Tile &tile, vsg::ref_ptr<vsg::floatArray2D> heights);
+            void select(uint32_t level, uint32_t x, uint32_t y, uint64_t frameCount,
+                        const std::vector<vsg::dvec3> &eyes,
+                        vsg::Group::Children &drawn,
+                        std::vector<std::pair<double, uint64_t>> &requests);
+            /** Releases the least recently used tiles above the memory budget. */
+            static void evict(const std::vector<vsg::ref_ptr<PagedTerrain>> &terrains, uint64_t frameCount);
+        };
+    }
+}
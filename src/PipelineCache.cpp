@@ -0,0 +1,278 @@
+#include "PipelineCache.hpp"
+#include "CacheFile.hpp"
+#include "shader/ShaderCache.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        vsg::ref_ptr<vsg::Device> PipelineCache::device;
+        VkPipelineCache PipelineCache::cache = VK_NULL_HANDLE;
+        std::string PipelineCache::file;
+        bool PipelineCache::loaded = false;
+        double PipelineCache::coldCreateTime = 0.0;
+        double PipelineCache::createTime = 0.0;
+        size_t PipelineCache::createCount = 0;
+        std::mutex PipelineCache::mutex;
+
+        static const char fileMagic[4] = {'M', 'P', 'C', '1'};
+
+        bool PipelineCache::validate(const std::vector<uint8_t> &data)
+        {
+            // VkPipelineCacheHeaderVersionOne
+            if(data.size() < 16 + VK_UUID_SIZE)
+            {
+                return false;
+            }
+            uint32_t header[4];
+            memcpy(header, data.data(), sizeof(header));
+            const VkPhysicalDeviceProperties &properties = device->getPhysicalDevice()->getProperties();
+            return header[0] >= 16 + VK_UUID_SIZE &&
+                header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+                header[2] == properties.vendorID &&
+                header[3] == properties.deviceID &&
+                memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        }
+
+        void PipelineCache::load(vsg::ref_ptr<vsg::Device> device_, const std::string &file_)
+        {
+            clear();
+            std::lock_guard<std::mutex> lock(mutex);
+            device = device_;
+            file = file_;
+            if(!device)
+            {
+                return;
+            }
+
+            std::vector<uint8_t> data;
+            if(!file.empty())
+            {
+                std::ifstream in(file, std::ios::binary);
+                FileHeader header;
+                if(in.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+                   memcmp(header.magic, fileMagic, sizeof(fileMagic)) == 0 && header.version == 1)
+                {
+                    data.resize(header.dataSize);
+                    if(!in.read(reinterpret_cast<char*>(data.data()), data.size()))
+                    {
+                        data.clear();
+                    }
+                    else if(!validate(data))
+                    {
+                        LOG_WARN("PipelineCache: %s was created by another driver or device, ignored", file.c_str());
+                        data.clear();
+                    }
+                    else
+                    {
+                        coldCreateTime = header.coldCreateTime;
+                    }
+                }
+            }
+
+            VkPipelineCacheCreateInfo createInfo = {};
+            createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            createInfo.initialDataSize = data.size();
+            createInfo.pInitialData = data.empty() ? nullptr : data.data();
+            if(vkCreatePipelineCache(*device, &createInfo, device->getAllocationCallbacks(), &cache) != VK_SUCCESS)
+            {
+                LOG_ERROR("PipelineCache: failed to create pipeline cache");
+                cache = VK_NULL_HANDLE;
+                return;
+            }
+            loaded = !data.empty();
+            if(loaded)
+            {
+                LOG_INFO("PipelineCache: loaded %zu bytes from %s", data.size(), file.c_str());
+            }
+        }
+
+        void PipelineCache::save()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(cache == VK_NULL_HANDLE || file.empty())
+            {
+                return;
+            }
+            size_t size = 0;
+            if(vkGetPipelineCacheData(*device, cache, &size, nullptr) != VK_SUCCESS || size == 0)
+            {
+                return;
+            }
+            std::vector<uint8_t> data(size);
+            if(vkGetPipelineCacheData(*device, cache, &size, data.data()) != VK_SUCCESS)
+            {
+                return;
+            }
+            data.resize(size);
+
+            FileHeader header;
+            memcpy(header.magic, fileMagic, sizeof(fileMagic));
+            header.version = 1;
+            // only a run without cache knows the cold creation time
+            header.coldCreateTime = (loaded || createCount == 0) ? coldCreateTime : createTime / createCount;
+            header.dataSize = data.size();
+
+            std::error_code ec;
+            std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+            CacheFile::write(file, {{&header, sizeof(header)}, {data.data(), data.size()}});
+        }
+
+        void PipelineCache::clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(cache != VK_NULL_HANDLE)
+            {
+                vkDestroyPipelineCache(*device, cache, device->getAllocationCallbacks());
+                cache = VK_NULL_HANDLE;
+            }
+            device = 0;
+            loaded = false;
+            coldCreateTime = 0.0;
+            createTime = 0.0;
+            createCount = 0;
+        }
+
+        VkPipelineCache PipelineCache::get(const vsg::Device *device_)
+        {
+            return (device && device.get() == device_) ? cache : VK_NULL_HANDLE;
+        }
+
+        void PipelineCache::addCreateTime(double ms)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            createTime += ms;
+            ++createCount;
+        }
+
+        void PipelineCache::logTiming()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(createCount == 0)
+            {
+                return;
+            }
+            if(loaded && coldCreateTime > 0.0)
+            {
+                double coldTime = coldCreateTime * createCount;
+                LOG_INFO("PipelineCache: created %zu pipelines in %.1f ms, %.1f ms without cache (saved %.1f ms)",
+                         createCount, createTime, coldTime, coldTime - createTime);
+            }
+            else
+            {
+                LOG_INFO("PipelineCache: created %zu pipelines in %.1f ms without cache from disk",
+                         createCount, createTime);
+            }
+        }
+
+        CachedGraphicsPipeline::CachedGraphicsPipeline(vsg::ref_ptr<vsg::PipelineLayout> pipelineLayout,
+                                                       const vsg::ShaderStages &shaderStages,
+                                                       const vsg::GraphicsPipelineStates &pipelineStates) :
+            Inherit(pipelineLayout, shaderStages, pipelineStates)
+        {
+        }
+
+        CachedGraphicsPipeline::~CachedGraphicsPipeline()
+        {
+            for(auto pipeline: pipelines)
+            {
+                if(pipeline != VK_NULL_HANDLE)
+                {
+                    vkDestroyPipeline(*device, pipeline, device->getAllocationCallbacks());
+                }
+            }
+        }
+
+        VkPipeline CachedGraphicsPipeline::vk(uint32_t viewID) const
+        {
+            if(viewID < pipelines.size() && pipelines[viewID] != VK_NULL_HANDLE)
+            {
+                return pipelines[viewID];
+            }
+            return GraphicsPipeline::vk(viewID);
+        }
+
+        void CachedGraphicsPipeline::compile(vsg::Context &context)
+        {
+            VkPipelineCache cache = PipelineCache::get(context.device);
+            if(cache == VK_NULL_HANDLE || !context.renderPass)
+            {
+                GraphicsPipeline::compile(context);
+                return;
+            }
+            if(context.viewID < pipelines.size() && pipelines[context.viewID] != VK_NULL_HANDLE)
+            {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+
+            // normally done by the CompileScheduler, pipelines compiled by
+            // vsg later on are compiled here
+            for(auto &stage: stages)
+            {
+                if(!ShaderCache::compile(stage))
+                {
+                    throw vsg::Exception{"CachedGraphicsPipeline: no SPIR-V code for shader stage"};
+                }
+            }
+            layout->compile(context);
+            for(auto &stage: stages)
+            {
+                stage->compile(context);
+            }
+
+            std::vector<VkPipelineShaderStageCreateInfo> stageInfos(stages.size());
+            for(size_t i=0; i<stages.size(); ++i)
+            {
+                stageInfos[i] = {};
+                stageInfos[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+                stages[i]->apply(context, stageInfos[i]);
+            }
+
+            VkGraphicsPipelineCreateInfo pipelineInfo = {};
+            pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+            pipelineInfo.layout = layout->vk(context.deviceID);
+            pipelineInfo.renderPass = *context.renderPass;
+            pipelineInfo.subpass = subpass;
+            pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+            pipelineInfo.basePipelineIndex = -1;
+            pipelineInfo.stageCount = static_cast<uint32_t>(stageInfos.size());
+            pipelineInfo.pStages = stageInfos.data();
+            // the same order of states as in GraphicsPipeline::compile()
+            for(auto &state: context.defaultPipelineStates) state->apply(context, pipelineInfo);
+            for(auto &state: pipelineStates) state->apply(context, pipelineInfo);
+            for(auto &state: context.overridePipelineStates) state->apply(context, pipelineInfo);
+
+            VkPipeline pipeline = VK_NULL_HANDLE;
+            VkResult result = vkCreateGraphicsPipelines(*context.device, cache, 1, &pipelineInfo,
+                                                        context.device->getAllocationCallbacks(), &pipeline);
+            context.scratchMemory->release();
+            if(result != VK_SUCCESS)
+            {
+                throw vsg::Exception{"Error: CachedGraphicsPipeline failed to create VkPipeline.", result};
+            }
+            device = context.device;
+            if(context.viewID >= pipelines.size())
+            {
+                pipelines.resize(context.viewID + 1, VK_NULL_HANDLE);
+            }
+            pipelines[context.viewID] = pipeline;
+            PipelineCache::addCreateTime(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        void CachedBindGraphicsPipeline::record(vsg::CommandBuffer &commandBuffer) const
+        {
+            auto cachedPipeline = pipeline->cast<CachedGraphicsPipeline>();
+            VkPipeline vkPipeline = cachedPipeline ? cachedPipeline->vk(commandBuffer.viewID) : pipeline->vk(commandBuffer.viewID);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vkPipeline);
+            commandBuffer.setCurrentPipelineLayout(pipeline->layout);
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Owns the VkPipelineCache of the device shared by all windows. The
+         * cache is loaded from disk at startup, used to create all material
+         * pipelines and written back at shutdown. A cache created by another
+         * driver or device is detected by the vendor/device id and the
+         * pipeline cache UUID of its header and ignored.
+         *
+         * Besides the Vulkan data the file stores the average time needed to
+         * create a pipeline without a cache, thus later runs can report the
+         * time saved.
+         */
+        class PipelineCache
+        {
+        public:
+            static void load(vsg::ref_ptr<vsg::Device> device, const std::string &file);
+            static void save();
+            static void clear();
+            /** Returns VK_NULL_HANDLE if no cache exists for the device. */
+            static VkPipelineCache get(const vsg::Device *device);
+
+            /** Adds the time needed to create one pipeline. */
+            static void addCreateTime(double ms);
+            /** Logs the pipeline creation time compared to a run without cache. */
+            static void logTiming();
+
+        private:
+            struct FileHeader
+            {
+                char magic[4];
+                uint32_t version;
+                double coldCreateTime;
+                uint64_t dataSize;
+            };
+
+            static vsg::ref_ptr<vsg::Device> device;
+            static VkPipelineCache cache;
+            static std::string file;
+            static bool loaded;
+            // average time to create a pipeline without a cache from disk
+            static double coldCreateTime;
+            static double createTime;
+            static size_t createCount;
+            static std::mutex mutex;
+
+            static bool validate(const std::vector<uint8_t> &data);
+        };
+
+        /**
+         * Graphics pipeline created with the PipelineCache. vsg 1.1 does not
+         * pass a pipeline cache to vkCreateGraphicsPipelines, thus the
+         * pipelines of the views are created here as GraphicsPipeline
+         * would. Falls back to GraphicsPipeline::compile() if no cache
+         * exists for the device.
+         */
+        class CachedGraphicsPipeline : public vsg::Inherit<vsg::GraphicsPipeline, CachedGraphicsPipeline>
+        {
+        public:
+            CachedGraphicsPipeline(vsg::ref_ptr<vsg::PipelineLayout> pipelineLayout,
+                                   const vsg::ShaderStages &shaderStages,
+                                   const vsg::GraphicsPipelineStates &pipelineStates);
+
+            void compile(vsg::Context &context) override;
+            VkPipeline vk(uint32_t viewID) const;
+
+        protected:
+            virtual ~CachedGraphicsPipeline();
+
+            vsg::ref_ptr<vsg::Device> device;
+            std::vector<VkPipeline> pipelines;
+        };
+
+        /** Binds the view specific pipeline of a CachedGraphicsPipeline. */
+        class CachedBindGraphicsPipeline : public vsg::Inherit<vsg::BindGraphicsPipeline, CachedBindGraphicsPipeline>
+        {
+        public:
+            CachedBindGraphicsPipeline(vsg::ref_ptr<vsg::GraphicsPipeline> pipeline) :
+                Inherit(pipeline) {}
+
+            void record(vsg::CommandBuffer &commandBuffer) const override;
+        };
+    }
+}
@@ -0,0 +1,308 @@
+#include "TerrainTileSet.hpp"
+#include "HeightmapLoader.hpp"
+
+#include <configmaps/ConfigData.h>
+#include <mars_interfaces/Logging.hpp>
+#include <mars_utils/misc.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <thread>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        static const char *indexFile = "tiles.yml";
+
+        TerrainTileSet::TerrainTileSet(const std::string &directory_, uint32_t width_,
+                                       uint32_t height_, uint32_t tileSize_) :
+            directory(directory_), width(width_), height(height_), tileSize(tileSize_),
+            numLevels(1)
+        {
+            while(getLevelSize(width, numLevels-1) - 1 > tileSize ||
+                  getLevelSize(height, numLevels-1) - 1 > tileSize)
+            {
+                ++numLevels;
+            }
+        }
+
+        std::string TerrainTileSet::getDirectory(const std::string &filename)
+        {
+            if(std::filesystem::is_directory(filename))
+            {
+                return filename;
+            }
+            std::string directory = filename;
+            utils::removeFilenameSuffix(&directory);
+            return directory + ".tiles";
+        }
+
+        uint32_t TerrainTileSet::getLevelSize(uint32_t size, uint32_t level)
+        {
+            // the last sample of a level is clamped to the border of the map
+            return ((size - 1 + (1u << level) - 1) >> level) + 1;
+        }
+
+        uint32_t TerrainTileSet::getNumTilesX(uint32_t level) const
+        {
+            return (getLevelSize(width, level) - 2)/tileSize + 1;
+        }
+
+        uint32_t TerrainTileSet::getNumTilesY(uint32_t level) const
+        {
+            return (getLevelSize(height, level) - 2)/tileSize + 1;
+        }
+
+        uint32_t TerrainTileSet::getTileWidth(uint32_t level, uint32_t x) const
+        {
+            return std::min(tileSize, getLevelSize(width, level) - 1 - x*tileSize) + 1;
+        }
+
+        uint32_t TerrainTileSet::getTileHeight(uint32_t level, uint32_t y) const
+        {
+            return std::min(tileSize, getLevelSize(height, level) - 1 - y*tileSize) + 1;
+        }
+
+        std::string TerrainTileSet::getTileFile(uint32_t level, uint32_t x, uint32_t y) const
+        {
+            return utils::pathJoin(utils::pathJoin(directory, std::to_string(level)),
+                                   std::to_string(x) + "_" + std::to_string(y) + ".heights");
+        }
+
+        vsg::ref_ptr<TerrainTileSet> TerrainTileSet::open(const std::string &directory,
+                                                          const std::string &source)
+        {
+            std::string index = utils::pathJoin(directory, indexFile);
+            std::error_code ec;
+            auto indexTime = std::filesystem::last_write_time(index, ec);
+            if(ec)
+            {
+                return {};
+            }
+            if(!source.empty() && !std::filesystem::is_directory(source))
+            {
+                auto sourceTime = std::filesystem::last_write_time(source, ec);
+                if(!ec && sourceTime > indexTime)
+                {
+                    return {};
+                }
+            }
+            configmaps::ConfigMap map = configmaps::ConfigMap::fromYamlFile(index);
+            uint32_t width = (int)map.get("width", 0);
+            uint32_t height = (int)map.get("height", 0);
+            uint32_t tileSize = (int)map.get("tileSize", 0);
+            if(width < 2 || height < 2 || tileSize < 1)
+            {
+                LOG_ERROR("TerrainTileSet: invalid tile index %s", index.c_str());
+                return {};
+            }
+            return TerrainTileSet::create(directory, width, height, tileSize);
+        }
+
+        bool TerrainTileSet::build(const vsg::floatArray2D &heights, const std::string &directory,
+                                   uint32_t tileSize)
+        {
+            return build(heights.width(), heights.height(),
+                         [&heights](uint32_t y, float *row)
+                         {
+                             std::copy(&heights.at(0, y), &heights.at(0, y) + heights.width(), row);
+                         },
+                         directory, tileSize);
+        }
+
+        bool TerrainTileSet::build(uint32_t width, uint32_t height, const RowReader &readRow,
+                                   const std::string &directory, uint32_t tileSize)
+        {
+            TerrainTileSet layout(directory, width, height, tileSize);
+            for(uint32_t level=0; level<layout.numLevels; ++level)
+            {
+                std::error_code ec;
+                std::filesystem::create_directories(utils::pathJoin(directory, std::to_string(level)), ec);
+                if(ec)
+                {
+                    LOG_ERROR("TerrainTileSet: can not create %s: %s", directory.c_str(), ec.message().c_str());
+                    return false;
+                }
+            }
+
+            // The source rows are read once from top to bottom. Every level
+            // collects its point sampled rows of one row of tiles, which is
+            // written as soon as it is complete; the last row is kept as
+            // the shared border of the next row of tiles.
+            struct Band
+            {
+                uint32_t levelWidth, levelHeight;
+                // next level row and the level row of the first band row
+                uint32_t nextRow, firstRow, tileY;
+                std::vector<float> rows;
+            };
+            std::vector<Band> bands(layout.numLevels);
+            for(uint32_t level=0; level<layout.numLevels; ++level)
+            {
+                Band &band = bands[level];
+                band.levelWidth = getLevelSize(width, level);
+                band.levelHeight = getLevelSize(height, level);
+                band.nextRow = band.firstRow = band.tileY = 0;
+                band.rows.resize(static_cast<size_t>(tileSize+1)*band.levelWidth);
+            }
+
+            unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+            auto writeTiles = [&](uint32_t level, Band &band)
+            {
+                uint32_t numTiles = layout.getNumTilesX(level);
+                uint32_t h = layout.getTileHeight(level, band.tileY);
+                std::vector<std::future<bool>> results;
+                uint32_t tilesPerThread = (numTiles + numThreads - 1) / numThreads;
+                for(uint32_t begin=0; begin<numTiles; begin+=tilesPerThread)
+                {
+                    uint32_t end = std::min(begin+tilesPerThread, numTiles);
+                    results.push_back(std::async(std::launch::async, [&, begin, end]()
+                    {
+                        for(uint32_t tx=begin; tx<end; ++tx)
+                        {
+                            uint32_t w = layout.getTileWidth(level, tx);
+                            auto tile = vsg::floatArray2D::create(w, h, vsg::Data::Properties{VK_FORMAT_R32_SFLOAT});
+                            for(uint32_t y=0; y<h; ++y)
+                            {
+                                const float *row = band.rows.data() + static_cast<size_t>(y)*band.levelWidth + tx*tileSize;
+                                std::copy(row, row + w, &tile->at(0, y));
+                            }
+                            if(!HeightmapLoader::writeHeights(layout.getTileFile(level, tx, band.tileY), *tile))
+                            {
+                                return false;
+                            }
+                        }
+                        return true;
+                    }));
+                }
+                bool success = true;
+                for(auto &result: results)
+                {
+                    success &= result.get();
+                }
+                return success;
+            };
+
+            std::vector<float> source(width);
+            size_t numTiles = 0;
+            for(uint32_t y=0; y<height; ++y)
+            {
+                readRow(y, source.data());
+                for(uint32_t level=0; level<layout.numLevels; ++level)
+                {
+                    Band &band = bands[level];
+                    // the last row of a level is clamped to the border
+                    while(band.nextRow < band.levelHeight &&
+                          std::min(band.nextRow << level, height-1) == y)
+                    {
+                        float *row = band.rows.data() + static_cast<size_t>(band.nextRow - band.firstRow)*band.levelWidth;
+                        for(uint32_t x=0; x<band.levelWidth; ++x)
+                        {
+                            row[x] = source[std::min(x << level, width-1)];
+                        }
+                        ++band.nextRow;
+                        if(band.nextRow - band.firstRow < layout.getTileHeight(level, band.tileY))
+                        {
+                            continue;
+                        }
+                        if(!writeTiles(level, band))
+                        {
+                            LOG_ERROR("TerrainTileSet: can not write the tiles of %s", directory.c_str());
+                            return false;
+                        }
+                        numTiles += layout.getNumTilesX(level);
+                        std::copy(row, row + band.levelWidth, band.rows.begin());
+                        band.firstRow = band.nextRow - 1;
+                        ++band.tileY;
+                    }
+                }
+            }
+
+            configmaps::ConfigMap map;
+            map["width"] = (int)layout.width;
+            map["height"] = (int)layout.height;
+            map["tileSize"] = (int)tileSize;
+            map["numLevels"] = (int)layout.numLevels;
+            std::ofstream out(utils::pathJoin(directory, indexFile));
+            out << map.toYamlString();
+            LOG_INFO("TerrainTileSet: wrote %zu tiles of %ux%u samples to %s",
+                     numTiles, layout.width, layout.height, directory.c_str());
+            return static_cast<bool>(out);
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> TerrainTileSet::readTile(uint32_t level, uint32_t x, uint32_t y) const
+        {
+            auto tile = HeightmapLoader::readHeights(getTileFile(level, x, y));
+            if(tile && (tile->width() != getTileWidth(level, x) || tile->height() != getTileHeight(level, y)))
+            {
+                LOG_ERROR("TerrainTileSet: tile %u/%u_%u of %s has a wrong size",
+                          level, x, y, directory.c_str());
+                return {};
+            }
+            return tile;
+        }
+
+        vsg::ref_ptr<vsg::floatArray2D> TerrainTileSet::readLevel(uint32_t level) const
+        {
+            auto grid = vsg::floatArray2D::create(getLevelSize(width, level), getLevelSize(height, level),
+                                                  vsg::Data::Properties{VK_FORMAT_R32_SFLOAT});
+            for(uint32_t ty=0; ty<getNumTilesY(level); ++ty)
+            {
+                for(uint32_t tx=0; tx<getNumTilesX(level); ++tx)
+                {
+                    auto tile = readTile(level, tx, ty);
+                    if(!tile)
+                    {
+                        return {};
+                    }
+                    for(uint32_t y=0; y<tile->height(); ++y)
+                    {
+                        std::copy(&tile->at(0, y), &tile->at(0, y) + tile->width(),
+                                  &grid->at(tx*tileSize, ty*tileSize + y));
+                    }
+                }
+            }
+            return grid;
+        }
+
+        bool TerrainTileSet::readLevel(uint32_t level, double scale, double *pixelData) const
+        {
+            // tile by tile, the level is never held as floats
+            uint32_t levelWidth = getLevelSize(width, level);
+            for(uint32_t ty=0; ty<getNumTilesY(level); ++ty)
+            {
+                for(uint32_t tx=0; tx<getNumTilesX(level); ++tx)
+                {
+                    auto tile = readTile(level, tx, ty);
+                    if(!tile)
+                    {
+                        return false;
+                    }
+                    for(uint32_t y=0; y<tile->height(); ++y)
+                    {
+                        double *dst = pixelData + static_cast<size_t>(ty*tileSize + y)*levelWidth + tx*tileSize;
+                        for(uint32_t x=0; x<tile->width(); ++x)
+                        {
+                            dst[x] = tile->at(x, y)*scale;
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+
+        uint32_t TerrainTileSet::getLevel(size_t maxSamples) const
+        {
+            uint32_t level = 0;
+            while(level+1 < numLevels &&
+                  static_cast<size_t>(getLevelSize(width, level))*getLevelSize(height, level) > maxSamples)
+            {
+                ++level;
+            }
+            return level;
+        }
+    }
+}
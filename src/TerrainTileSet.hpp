@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <functional>
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Quadtree of heightmap tiles stored in a directory. Level 0 holds
+         * the heightmap at full resolution, every further level halves the
+         * resolution until one tile covers the whole map. A tile has
+         * tileSize cells, tiles share their border samples and the tiles at
+         * the upper borders of the map are smaller. The tiles are stored as
+         * <level>/<x>_<y>.heights in the format of the HeightmapLoader cache
+         * and the layout in tiles.yml, which is written last.
+         */
+        class TerrainTileSet : public vsg::Inherit<vsg::Object, TerrainTileSet>
+        {
+         public:
+            TerrainTileSet(const std::string &directory, uint32_t width, uint32_t height,
+                           uint32_t tileSize);
+
+            /**
+             * Returns the tile directory of a heightmap image (<image>.tiles)
+             * or the directory itself if a tile directory is given.
+             */
+            static std::string getDirectory(const std::string &filename);
+            /**
+             * Reads the layout of a tile directory. Returns nothing if the
+             * directory is incomplete or older than the source image.
+             */
+            static vsg::ref_ptr<TerrainTileSet> open(const std::string &directory,
+                                                     const std::string &source = "");
+            /** Writes row y of the heightmap, the first row is at -y. */
+            using RowReader = std::function<void(uint32_t y, float *row)>;
+            /**
+             * Splits a heightmap into tiles. The rows are read once in
+             * order and the tiles of every level are written as soon as
+             * their rows are complete, in parallel, thus only a row of tiles
+             * per level is held in memory.
+             */
+            static bool build(uint32_t width, uint32_t height, const RowReader &readRow,
+                              const std::string &directory, uint32_t tileSize);
+            static bool build(const vsg::floatArray2D &heights, const std::string &directory,
+                              uint32_t tileSize);
+
+            /** Number of samples of the heightmap in x and y */
+            inline uint32_t getWidth() const
+                { return width; }
+            inline uint32_t getHeight() const
+                { return height; }
+            inline uint32_t getTileSize() const
+                { return tileSize; }
+            inline uint32_t getNumLevels() const
+                { return numLevels; }
+            uint32_t getNumTilesX(uint32_t level) const;
+            uint32_t getNumTilesY(uint32_t level) const;
+            /** Number of samples of the tile in x and y. */
+            uint32_t getTileWidth(uint32_t level, uint32_t x) const;
+            uint32_t getTileHeight(uint32_t level, uint32_t y) const;
+
+            vsg::ref_ptr<vsg::floatArray2D> readTile(uint32_t level, uint32_t x, uint32_t y) const;
+            /** Assembles all tiles of a level into one grid. */
+            vsg::ref_ptr<vsg::floatArray2D> readLevel(uint32_t level) const;
+            /** Writes scale*height of all samples of a level into pixelData. */
+            bool readLevel(uint32_t level, double scale, double *pixelData) const;
+            /** Returns the finest level with at most maxSamples samples. */
+            uint32_t getLevel(size_t maxSamples) const;
+            /** Number of samples of the heightmap in one direction at a level. */
+            static uint32_t getLevelSize(uint32_t size, uint32_t level);
+
+         private:
+            std::string directory;
+            uint32_t width, height, tileSize, numLevels;
+
+            std::string getTileFile(uint32_t level, uint32_t x, uint32_t y) const;
+        };
+    }
+}
@@ -0,0 +1,536 @@
+#include "TextureCache.hpp"
+#include "CacheFile.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+#include <vsgXchange/all.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        bool TextureCache::enabled = false;
+        std::string TextureCache::cacheDirectory;
+
+        static const uint8_t ktx2Identifier[12] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+
+        struct KTX2Header
+        {
+            uint32_t vkFormat, typeSize, pixelWidth, pixelHeight, pixelDepth;
+            uint32_t layerCount, faceCount, levelCount, supercompressionScheme;
+            uint32_t dfdByteOffset, dfdByteLength, kvdByteOffset, kvdByteLength;
+            uint64_t sgdByteOffset, sgdByteLength;
+        };
+
+        struct KTX2Level
+        {
+            uint64_t byteOffset, byteLength, uncompressedByteLength;
+        };
+
+        static bool isPowerOfTwo(uint32_t v)
+        {
+            return v && !(v & (v-1));
+        }
+
+        static bool isBC1(VkFormat format)
+        {
+            return format == VK_FORMAT_BC1_RGB_UNORM_BLOCK || format == VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+        }
+
+        static bool isBC3(VkFormat format)
+        {
+            return format == VK_FORMAT_BC3_UNORM_BLOCK || format == VK_FORMAT_BC3_SRGB_BLOCK;
+        }
+
+        static bool isSRGB(VkFormat format)
+        {
+            return format == VK_FORMAT_BC1_RGB_SRGB_BLOCK || format == VK_FORMAT_BC3_SRGB_BLOCK;
+        }
+
+        static uint32_t blockSize(VkFormat format)
+        {
+            return isBC1(format) ? 8 : 16;
+        }
+
+        void TextureCache::setDevice(vsg::ref_ptr<vsg::Device> device, bool enable)
+        {
+            enabled = false;
+            if(!enable || !device)
+            {
+                return;
+            }
+            for(VkFormat format: {VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC3_UNORM_BLOCK,
+                                  VK_FORMAT_BC1_RGB_SRGB_BLOCK, VK_FORMAT_BC3_SRGB_BLOCK})
+            {
+                VkFormatProperties properties;
+                vkGetPhysicalDeviceFormatProperties(*device->getPhysicalDevice(), format, &properties);
+                if(!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))
+                {
+                    LOG_INFO("TextureCache: BC formats are not supported, textures are not compressed");
+                    return;
+                }
+            }
+            enabled = true;
+        }
+
+        void TextureCache::setCacheDirectory(const std::string &path)
+        {
+            cacheDirectory = path;
+            if(cacheDirectory.empty())
+            {
+                return;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(cacheDirectory, ec);
+            if(ec)
+            {
+                LOG_ERROR("TextureCache: can not create cache directory %s: %s",
+                          cacheDirectory.c_str(), ec.message().c_str());
+                cacheDirectory.clear();
+            }
+        }
+
+        std::string TextureCache::cacheFile(const std::string &filename)
+        {
+            if(cacheDirectory.empty())
+            {
+                return {};
+            }
+            // the absolute path of the source identifies the cache file, its
+            // modification time decides whether the entry is still valid
+            std::error_code ec;
+            std::filesystem::path source = std::filesystem::absolute(filename, ec);
+            uint64_t h = CacheFile::hashSeed;
+            CacheFile::hashString(h, ec ? filename : source.lexically_normal().string());
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.ktx2", static_cast<unsigned long long>(h));
+            return (std::filesystem::path(cacheDirectory) / name).string();
+        }
+
+        vsg::ref_ptr<vsg::Data> TextureCache::read(const std::string &filename)
+        {
+            if(!enabled)
+            {
+                return {};
+            }
+            std::string cacheFile = TextureCache::cacheFile(filename);
+
+            std::error_code ec;
+            auto sourceTime = std::filesystem::last_write_time(filename, ec);
+            if(!ec && !cacheFile.empty())
+            {
+                auto cacheTime = std::filesystem::last_write_time(cacheFile, ec);
+                if(!ec && cacheTime >= sourceTime)
+                {
+                    if(auto data = readKTX2(cacheFile))
+                    {
+                        return data;
+                    }
+                }
+            }
+
+            static vsg::ref_ptr<vsg::Options> options = vsg::Options::create(vsgXchange::all::create());
+            auto image = vsg::read_cast<vsg::Data>(filename, options);
+            if(!image)
+            {
+                return {};
+            }
+            auto data = compress(image);
+            if(data && !cacheFile.empty() && !writeKTX2(cacheFile, data))
+            {
+                LOG_WARN("TextureCache: can not write %s", cacheFile.c_str());
+            }
+            return data;
+        }
+
+        // 2x2 box filter, the size of the levels is a power of two
+        static std::vector<uint8_t> downsample(const std::vector<uint8_t> &src, uint32_t width, uint32_t height)
+        {
+            uint32_t w = std::max(1u, width/2), h = std::max(1u, height/2);
+            std::vector<uint8_t> dst(w*h*4);
+            for(uint32_t y=0; y<h; ++y)
+            {
+                uint32_t y0 = std::min(2*y, height-1), y1 = std::min(2*y+1, height-1);
+                for(uint32_t x=0; x<w; ++x)
+                {
+                    uint32_t x0 = std::min(2*x, width-1), x1 = std::min(2*x+1, width-1);
+                    for(uint32_t c=0; c<4; ++c)
+                    {
+                        uint32_t sum = src[(y0*width+x0)*4+c] + src[(y0*width+x1)*4+c] +
+                            src[(y1*width+x0)*4+c] + src[(y1*width+x1)*4+c];
+                        dst[(y*w+x)*4+c] = static_cast<uint8_t>((sum + 2) / 4);
+                    }
+                }
+            }
+            return dst;
+        }
+
+        static uint16_t toRGB565(const uint8_t *c)
+        {
+            return static_cast<uint16_t>(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+        }
+
+        static void fromRGB565(uint16_t v, int *c)
+        {
+            c[0] = ((v >> 11) & 31) * 255 / 31;
+            c[1] = ((v >> 5) & 63) * 255 / 63;
+            c[2] = (v & 31) * 255 / 31;
+        }
+
+        // color endpoints from the diagonal of the bounding box of the
+        // block which follows the covariance of the channels
+        static void encodeBC1(const uint8_t block[16][4], uint8_t *out)
+        {
+            uint8_t minColor[3] = {255, 255, 255}, maxColor[3] = {0, 0, 0};
+            int mean[3] = {0, 0, 0};
+            for(int i=0; i<16; ++i)
+            {
+                for(int c=0; c<3; ++c)
+                {
+                    minColor[c] = std::min(minColor[c], block[i][c]);
+                    maxColor[c] = std::max(maxColor[c], block[i][c]);
+                    mean[c] += block[i][c];
+                }
+            }
+            int axis = 0;
+            for(int c=1; c<3; ++c)
+            {
+                if(maxColor[c] - minColor[c] > maxColor[axis] - minColor[axis])
+                {
+                    axis = c;
+                }
+            }
+            for(int c=0; c<3; ++c)
+            {
+                int covariance = 0;
+                for(int i=0; i<16; ++i)
+                {
+                    covariance += (16*block[i][axis] - mean[axis]) * (16*block[i][c] - mean[c]) / 256;
+                }
+                if(covariance < 0)
+                {
+                    std::swap(minColor[c], maxColor[c]);
+                }
+            }
+            uint16_t c0 = toRGB565(maxColor), c1 = toRGB565(minColor);
+            uint32_t indices = 0;
+            if(c0 < c1)
+            {
+                std::swap(c0, c1);
+            }
+            if(c0 != c1)
+            {
+                int palette[4][3];
+                fromRGB565(c0, palette[0]);
+                fromRGB565(c1, palette[1]);
+                for(int c=0; c<3; ++c)
+                {
+                    palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+                    palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+                }
+                for(int i=0; i<16; ++i)
+                {
+                    int best = 0, bestDistance = INT32_MAX;
+                    for(int p=0; p<4; ++p)
+                    {
+                        int distance = 0;
+                        for(int c=0; c<3; ++c)
+                        {
+                            int d = block[i][c] - palette[p][c];
+                            distance += d*d;
+                        }
+                        if(distance < bestDistance)
+                        {
+                            bestDistance = distance;
+                            best = p;
+                        }
+                    }
+                    indices |= static_cast<uint32_t>(best) << (2*i);
+                }
+            }
+            memcpy(out, &c0, 2);
+            memcpy(out+2, &c1, 2);
+            memcpy(out+4, &indices, 4);
+        }
+
+        static void encodeBC3Alpha(const uint8_t block[16][4], uint8_t *out)
+        {
+            uint8_t a0 = 0, a1 = 255;
+            for(int i=0; i<16; ++i)
+            {
+                a0 = std::max(a0, block[i][3]);
+                a1 = std::min(a1, block[i][3]);
+            }
+            uint64_t indices = 0;
+            if(a0 != a1)
+            {
+                // eight interpolated values for a0 > a1
+                int palette[8] = {a0, a1};
+                for(int p=2; p<8; ++p)
+                {
+                    palette[p] = ((8-p)*a0 + (p-1)*a1) / 7;
+                }
+                for(int i=0; i<16; ++i)
+                {
+                    int best = 0, bestDistance = INT32_MAX;
+                    for(int p=0; p<8; ++p)
+                    {
+                        int distance = std::abs(block[i][3] - palette[p]);
+                        if(distance < bestDistance)
+                        {
+                            bestDistance = distance;
+                            best = p;
+                        }
+                    }
+                    indices |= static_cast<uint64_t>(best) << (3*i);
+                }
+            }
+            out[0] = a0;
+            out[1] = a1;
+            for(int i=0; i<6; ++i)
+            {
+                out[2+i] = static_cast<uint8_t>(indices >> (8*i));
+            }
+        }
+
+        vsg::ref_ptr<vsg::Data> TextureCache::compress(vsg::ref_ptr<vsg::Data> image)
+        {
+            VkFormat format = image->properties.format;
+            uint32_t width = image->width(), height = image->height();
+            if((format != VK_FORMAT_R8G8B8A8_UNORM && format != VK_FORMAT_R8G8B8A8_SRGB) ||
+               image->dataSize() < size_t(width)*height*4)
+            {
+                return {};
+            }
+            // vsg derives the size of the mip levels of block compressed
+            // data from the block count, which matches for powers of two only
+            if(!isPowerOfTwo(width) || !isPowerOfTwo(height) || width < 4 || height < 4)
+            {
+                return {};
+            }
+
+            std::vector<uint8_t> level(static_cast<const uint8_t*>(image->dataPointer()),
+                                       static_cast<const uint8_t*>(image->dataPointer()) + size_t(width)*height*4);
+            bool alpha = false;
+            for(size_t i=3; i<level.size() && !alpha; i+=4)
+            {
+                alpha = level[i] < 255;
+            }
+            // sRGB images keep their encoding, the sampler decodes the blocks
+            VkFormat compressedFormat;
+            if(format == VK_FORMAT_R8G8B8A8_SRGB)
+            {
+                compressedFormat = alpha ? VK_FORMAT_BC3_SRGB_BLOCK : VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+            }
+            else
+            {
+                compressedFormat = alpha ? VK_FORMAT_BC3_UNORM_BLOCK : VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+            }
+            uint32_t numLevels = static_cast<uint32_t>(std::log2(std::max(width, height))) + 1;
+
+            std::vector<uint8_t> blocks;
+            uint32_t w = width, h = height;
+            for(uint32_t l=0; l<numLevels; ++l)
+            {
+                uint32_t bw = (w+3)/4, bh = (h+3)/4;
+                size_t offset = blocks.size();
+                blocks.resize(offset + size_t(bw)*bh*blockSize(compressedFormat));
+                uint8_t *out = blocks.data() + offset;
+                for(uint32_t by=0; by<bh; ++by)
+                {
+                    for(uint32_t bx=0; bx<bw; ++bx)
+                    {
+                        uint8_t block[16][4];
+                        for(uint32_t i=0; i<16; ++i)
+                        {
+                            uint32_t x = std::min(bx*4 + i%4, w-1), y = std::min(by*4 + i/4, h-1);
+                            memcpy(block[i], &level[(size_t(y)*w+x)*4], 4);
+                        }
+                        if(alpha)
+                        {
+                            encodeBC3Alpha(block, out);
+                            out += 8;
+                        }
+                        encodeBC1(block, out);
+                        out += 8;
+                    }
+                }
+                if(l+1 < numLevels)
+                {
+                    level = downsample(level, w, h);
+                    w = std::max(1u, w/2);
+                    h = std::max(1u, h/2);
+                }
+            }
+
+            vsg::Data::Properties properties(compressedFormat);
+            properties.blockWidth = 4;
+            properties.blockHeight = 4;
+            properties.maxNumMipmaps = static_cast<uint8_t>(numLevels);
+            properties.origin = image->properties.origin;
+            vsg::ref_ptr<vsg::Data> data;
+            if(alpha)
+            {
+                data = vsg::block128Array2D::create(width/4, height/4, properties);
+            }
+            else
+            {
+                data = vsg::block64Array2D::create(width/4, height/4, properties);
+            }
+            if(data->dataSize() != blocks.size())
+            {
+                LOG_ERROR("TextureCache: unexpected mipmap layout");
+                return {};
+            }
+            memcpy(data->dataPointer(), blocks.data(), blocks.size());
+            return data;
+        }
+
+        bool TextureCache::writeKTX2(const std::string &filename, vsg::ref_ptr<vsg::Data> data)
+        {
+            VkFormat format = data->properties.format;
+            uint32_t numLevels = std::max<uint32_t>(1, data->properties.maxNumMipmaps);
+            uint32_t width = data->width()*4, height = data->height()*4;
+            uint32_t size = blockSize(format);
+
+            // data format descriptor of the block compressed format
+            bool alpha = isBC3(format);
+            uint32_t numSamples = alpha ? 2 : 1;
+            std::vector<uint32_t> dfd;
+            dfd.push_back(4 + 24 + 16*numSamples);            // total size
+            dfd.push_back(0);                                 // vendor id and descriptor type: khronos basic
+            dfd.push_back(2 | ((24 + 16*numSamples) << 16));  // version and block size
+            dfd.push_back((alpha ? 130 : 128) | (1 << 8) | ((isSRGB(format) ? 2 : 1) << 16)); // BC3/BC1 model, BT709, linear/sRGB
+            dfd.push_back(3 | (3 << 8));                      // 4x4 texel blocks
+            dfd.push_back(size);                              // bytes of plane 0
+            dfd.push_back(0);
+            if(alpha)
+            {
+                dfd.insert(dfd.end(), {0 | (63u << 16) | (15u << 24), 0, 0, 0xFFFFFFFF}); // alpha block
+                dfd.insert(dfd.end(), {64 | (63u << 16), 0, 0, 0xFFFFFFFF});             // color block
+            }
+            else
+            {
+                dfd.insert(dfd.end(), {0 | (63u << 16), 0, 0, 0xFFFFFFFF});
+            }
+
+            // vsg stores the largest level first, KTX2 the smallest one
+            std::vector<size_t> levelOffsets, levelSizes;
+            size_t offset = 0;
+            for(uint32_t l=0; l<numLevels; ++l)
+            {
+                size_t levelSize = size_t(std::max(1u, (width >> l)/4)) * std::max(1u, (height >> l)/4) * size;
+                levelOffsets.push_back(offset);
+                levelSizes.push_back(levelSize);
+                offset += levelSize;
+            }
+            if(offset > data->dataSize())
+            {
+                return false;
+            }
+
+            KTX2Header header = {};
+            header.vkFormat = format;
+            header.typeSize = 1;
+            header.pixelWidth = width;
+            header.pixelHeight = height;
+            header.faceCount = 1;
+            header.levelCount = numLevels;
+            header.dfdByteOffset = static_cast<uint32_t>(sizeof(ktx2Identifier) + sizeof(KTX2Header) + numLevels*sizeof(KTX2Level));
+            header.dfdByteLength = static_cast<uint32_t>(dfd.size()*sizeof(uint32_t));
+
+            std::vector<KTX2Level> levels(numLevels);
+            size_t fileOffset = header.dfdByteOffset + header.dfdByteLength;
+            for(int l=numLevels-1; l>=0; --l)
+            {
+                fileOffset = (fileOffset + size - 1) / size * size;
+                levels[l].byteOffset = fileOffset;
+                levels[l].byteLength = levelSizes[l];
+                levels[l].uncompressedByteLength = levelSizes[l];
+                fileOffset += levelSizes[l];
+            }
+
+            const char *bytes = static_cast<const char*>(data->dataPointer());
+            std::vector<char> padding(size, 0);
+            std::vector<std::pair<const void*, size_t>> chunks = {
+                {ktx2Identifier, sizeof(ktx2Identifier)},
+                {&header, sizeof(header)},
+                {levels.data(), levels.size()*sizeof(KTX2Level)},
+                {dfd.data(), dfd.size()*sizeof(uint32_t)}};
+            size_t position = header.dfdByteOffset + header.dfdByteLength;
+            for(int l=numLevels-1; l>=0; --l)
+            {
+                // the alignment padding is smaller than a block
+                chunks.push_back({padding.data(), levels[l].byteOffset - position});
+                chunks.push_back({bytes + levelOffsets[l], levelSizes[l]});
+                position = levels[l].byteOffset + levelSizes[l];
+            }
+            return CacheFile::write(filename, chunks);
+        }
+
+        vsg::ref_ptr<vsg::Data> TextureCache::readKTX2(const std::string &filename)
+        {
+            std::ifstream in(filename, std::ios::binary);
+            uint8_t identifier[12];
+            KTX2Header header;
+            if(!in.read(reinterpret_cast<char*>(identifier), sizeof(identifier)) ||
+               memcmp(identifier, ktx2Identifier, sizeof(identifier)) != 0 ||
+               !in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            {
+                return {};
+            }
+            VkFormat format = static_cast<VkFormat>(header.vkFormat);
+            if((!isBC1(format) && !isBC3(format)) ||
+               header.supercompressionScheme != 0 || header.pixelDepth > 1 || header.layerCount > 1 ||
+               header.faceCount != 1 || header.levelCount == 0 || header.levelCount > 16 ||
+               !isPowerOfTwo(header.pixelWidth) || !isPowerOfTwo(header.pixelHeight) ||
+               header.pixelWidth < 4 || header.pixelHeight < 4)
+            {
+                return {};
+            }
+            std::vector<KTX2Level> levels(header.levelCount);
+            if(!in.read(reinterpret_cast<char*>(levels.data()), levels.size()*sizeof(KTX2Level)))
+            {
+                return {};
+            }
+
+            vsg::Data::Properties properties(format);
+            properties.blockWidth = 4;
+            properties.blockHeight = 4;
+            properties.maxNumMipmaps = static_cast<uint8_t>(header.levelCount);
+            vsg::ref_ptr<vsg::Data> data;
+            if(isBC3(format))
+            {
+                data = vsg::block128Array2D::create(header.pixelWidth/4, header.pixelHeight/4, properties);
+            }
+            else
+            {
+                data = vsg::block64Array2D::create(header.pixelWidth/4, header.pixelHeight/4, properties);
+            }
+            char *bytes = static_cast<char*>(data->dataPointer());
+            size_t offset = 0;
+            for(auto &level: levels)
+            {
+                if(offset + level.byteLength > data->dataSize())
+                {
+                    return {};
+                }
+                in.seekg(level.byteOffset);
+                if(!in.read(bytes + offset, level.byteLength))
+                {
+                    return {};
+                }
+                offset += level.byteLength;
+            }
+            return offset == data->dataSize() ? data : vsg::ref_ptr<vsg::Data>();
+        }
+    }
+}
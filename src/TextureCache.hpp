@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Offline cache of block compressed textures. A source image is
+         * transcoded once into BC1 (opaque) or BC3 (with alpha) including
+         * the full mip chain and stored as <hash>.ktx2 in the cache
+         * directory, the hash is built from the path of the source. Later runs
+         * load the KTX2 file directly as long as it is newer than the source.
+         * sRGB images are stored in the sRGB variants of the formats.
+         *
+         * BC1 needs 0.5 and BC3 1 byte per texel compared to 4 bytes of
+         * RGBA8. If the device does not support BC formats the cache is
+         * disabled and the textures are decoded as before.
+         */
+        class TextureCache
+        {
+        public:
+            /** Enables the cache if the device can sample BC1 and BC3 images. */
+            static void setDevice(vsg::ref_ptr<vsg::Device> device, bool enable);
+            static bool isEnabled()
+                { return enabled; }
+            /** An empty path compresses the textures without storing them. */
+            static void setCacheDirectory(const std::string &path);
+
+            /**
+             * Returns the compressed texture of an image file, transcodes
+             * and stores it if needed. Returns null if the image can not be
+             * compressed, then the raw image has to be used.
+             */
+            static vsg::ref_ptr<vsg::Data> read(const std::string &filename);
+
+            static vsg::ref_ptr<vsg::Data> readKTX2(const std::string &filename);
+            static bool writeKTX2(const std::string &filename, vsg::ref_ptr<vsg::Data> data);
+            /** Transcodes RGBA8 image data into BC1 or BC3 with mipmaps. */
+            static vsg::ref_ptr<vsg::Data> compress(vsg::ref_ptr<vsg::Data> image);
+
+        private:
+            static std::string cacheFile(const std::string &filename);
+            static bool enabled;
+            static std::string cacheDirectory;
+        };
+    }
+}
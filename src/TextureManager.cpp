@@ -0,0 +1,305 @@
+#include "TextureManager.hpp"
+#include "TextureCache.hpp"
+#include "gui_helper_functions.hpp"
+
+#include <mars_utils/misc.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <thread>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::map<std::string, TextureManager::Texture> TextureManager::textures;
+        std::vector<std::pair<std::string, vsg::ref_ptr<vsg::Data>>> TextureManager::decoded;
+        std::vector<TextureManager::Retired> TextureManager::retired;
+        vsg::ref_ptr<vsg::DescriptorImage> TextureManager::fallback;
+        vsg::ref_ptr<vsg::OperationThreads> TextureManager::threads;
+        unsigned int TextureManager::numThreads = 0;
+        std::mutex TextureManager::mutex;
+        uint32_t TextureManager::poolSize = 0;
+        std::map<std::string, uint32_t> TextureManager::poolIndices;
+        std::vector<std::string> TextureManager::pool;
+        std::vector<vsg::ref_ptr<vsg::StateGroup>> TextureManager::poolUsers;
+        vsg::ref_ptr<vsg::StateCommand> TextureManager::poolBinding;
+        TextureManager::CreateBinding TextureManager::createPoolBinding;
+        bool TextureManager::poolChanged = false;
+
+        // decodes one image file on a worker thread
+        struct DecodeOperation : public vsg::Inherit<vsg::Operation, DecodeOperation>
+        {
+            DecodeOperation(const std::string &p) : path(p) {}
+
+            void run() override
+                {
+                    // block compressed if the device supports it
+                    auto data = TextureCache::read(path);
+                    if(!data)
+                    {
+                        data = TextureManager::readImage(path);
+                    }
+                    std::lock_guard<std::mutex> lock(TextureManager::mutex);
+                    TextureManager::decoded.emplace_back(path, data);
+                }
+
+            std::string path;
+        };
+
+        std::string TextureManager::resolvePath(const std::string &filename)
+        {
+            if(std::filesystem::exists(filename))
+            {
+                return filename;
+            }
+            return utils::pathJoin(utils::pathJoin(GuiHelper::resourcePath, "resources"), filename);
+        }
+
+        vsg::ref_ptr<vsg::Data> TextureManager::readImage(const std::string &filename)
+        {
+            static vsg::ref_ptr<vsg::Options> options = vsg::Options::create(vsgXchange::all::create());
+            auto data = vsg::read_cast<vsg::Data>(resolvePath(filename), options);
+            if(!data)
+            {
+                LOG_ERROR("TextureManager: failed to read %s", filename.c_str());
+            }
+            return data;
+        }
+
+        vsg::ref_ptr<vsg::DescriptorImage> TextureManager::createDescriptor(vsg::ref_ptr<vsg::Data> data)
+        {
+            auto sampler = vsg::Sampler::create();
+            sampler->addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            sampler->addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            sampler->addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            sampler->mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+            if(data->properties.maxNumMipmaps > 1)
+            {
+                // compressed textures come with their mip chain
+                sampler->maxLod = static_cast<float>(data->properties.maxNumMipmaps);
+            }
+            else
+            {
+                // the full mip chain, vsg generates the levels on upload
+                uint32_t size = std::max(data->width(), data->height());
+                sampler->maxLod = std::floor(std::log2(static_cast<float>(std::max(size, 1u)))) + 1.0f;
+            }
+            return vsg::DescriptorImage::create(sampler, data, 2, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        }
+
+        vsg::ref_ptr<vsg::DescriptorImage> TextureManager::getFallback()
+        {
+            if(!fallback)
+            {
+                auto white = vsg::ubvec4Array2D::create(1, 1, vsg::Data::Properties{VK_FORMAT_R8G8B8A8_UNORM});
+                white->set(0, 0, vsg::ubvec4(255, 255, 255, 255));
+                fallback = vsg::DescriptorImage::create(vsg::Sampler::create(), white, 2, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+            }
+            return fallback;
+        }
+
+        TextureManager::Texture& TextureManager::requestTexture(const std::string &path)
+        {
+            auto it = textures.find(path);
+            if(it != textures.end())
+            {
+                return it->second;
+            }
+            if(!threads)
+            {
+                unsigned int count = numThreads;
+                if(count == 0)
+                {
+                    count = std::max(1u, std::thread::hardware_concurrency() / 2);
+                }
+                threads = vsg::OperationThreads::create(count);
+            }
+            Texture &texture = textures[path];
+            texture.resident = false;
+            texture.descriptor = getFallback();
+            threads->add(DecodeOperation::create(path));
+            return texture;
+        }
+
+        vsg::ref_ptr<vsg::DescriptorImage> TextureManager::getTexture(const std::string &filename)
+        {
+            return requestTexture(resolvePath(filename)).descriptor;
+        }
+
+        void TextureManager::bindTexture(const std::string &filename,
+                                         vsg::ref_ptr<vsg::StateGroup> stateGroup,
+                                         CreateBinding createBinding)
+        {
+            Texture &texture = requestTexture(resolvePath(filename));
+            auto binding = createBinding(texture.descriptor);
+            stateGroup->add(binding);
+            if(!texture.resident)
+            {
+                texture.users.push_back(User{stateGroup, binding, createBinding});
+            }
+        }
+
+        void TextureManager::setPoolSize(uint32_t size)
+        {
+            if(poolBinding)
+            {
+                LOG_ERROR("TextureManager: the pool size can not be changed after materials are created");
+                return;
+            }
+            poolSize = size;
+        }
+
+        uint32_t TextureManager::addToPool(const std::string &filename)
+        {
+            std::string path = resolvePath(filename);
+            auto it = poolIndices.find(path);
+            if(it != poolIndices.end())
+            {
+                return it->second;
+            }
+            if(pool.empty())
+            {
+                pool.push_back("");
+            }
+            if(pool.size() >= poolSize)
+            {
+                LOG_ERROR("TextureManager: texture pool is full (%u entries)", poolSize);
+                return 0;
+            }
+            requestTexture(path);
+            uint32_t index = static_cast<uint32_t>(pool.size());
+            pool.push_back(path);
+            poolIndices[path] = index;
+            poolChanged = true;
+            return index;
+        }
+
+        vsg::ref_ptr<vsg::DescriptorImage> TextureManager::createPoolDescriptor()
+        {
+            // unused entries are filled with the fallback, every element of
+            // the array has to be valid
+            vsg::ImageInfoList imageInfoList(poolSize, getFallback()->imageInfoList[0]);
+            for(size_t i=1; i<pool.size(); ++i)
+            {
+                imageInfoList[i] = textures[pool[i]].descriptor->imageInfoList[0];
+            }
+            return vsg::DescriptorImage::create(imageInfoList, 2, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        }
+
+        void TextureManager::bindPool(vsg::ref_ptr<vsg::StateGroup> stateGroup,
+                                      CreateBinding createBinding)
+        {
+            if(!poolBinding)
+            {
+                createPoolBinding = createBinding;
+                poolBinding = createPoolBinding(createPoolDescriptor());
+                poolChanged = false;
+            }
+            stateGroup->add(poolBinding);
+            poolUsers.push_back(stateGroup);
+        }
+
+        void TextureManager::setNumThreads(unsigned int numThreads_)
+        {
+            numThreads = numThreads_;
+        }
+
+        bool TextureManager::update(vsg::ref_ptr<vsg::Viewer> viewer)
+        {
+            uint64_t frameCount = viewer->getFrameStamp() ? viewer->getFrameStamp()->frameCount : 0;
+            // the old bindings may still be used by frames in flight
+            retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                         [frameCount](const Retired &r) { return frameCount > r.frameCount + 3; }),
+                          retired.end());
+            if(!viewer->compileManager)
+            {
+                return false;
+            }
+            std::vector<std::pair<std::string, vsg::ref_ptr<vsg::Data>>> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.swap(decoded);
+            }
+            bool changed = false;
+            for(auto &it: finished)
+            {
+                auto textureIt = textures.find(it.first);
+                if(textureIt == textures.end() || !it.second)
+                {
+                    // keep the fallback for files that could not be read
+                    continue;
+                }
+                Texture &texture = textureIt->second;
+                texture.descriptor = createDescriptor(it.second);
+                texture.resident = true;
+                if(poolIndices.count(it.first))
+                {
+                    poolChanged = true;
+                }
+                for(auto &user: texture.users)
+                {
+                    auto binding = user.createBinding(texture.descriptor);
+                    auto result = viewer->compileManager->compile(binding);
+                    if(!result)
+                    {
+                        LOG_ERROR("TextureManager: failed to compile %s", it.first.c_str());
+                        continue;
+                    }
+                    vsg::updateViewer(*viewer, result);
+                    auto &commands = user.stateGroup->stateCommands;
+                    std::replace(commands.begin(), commands.end(), user.binding, binding);
+                    retired.push_back(Retired{frameCount, user.binding});
+                    changed = true;
+                }
+                texture.users.clear();
+            }
+            if(poolChanged && poolBinding)
+            {
+                // one new binding for all materials of the pool
+                auto binding = createPoolBinding(createPoolDescriptor());
+                auto result = viewer->compileManager->compile(binding);
+                if(result)
+                {
+                    vsg::updateViewer(*viewer, result);
+                    for(auto &stateGroup: poolUsers)
+                    {
+                        auto &commands = stateGroup->stateCommands;
+                        std::replace(commands.begin(), commands.end(), poolBinding, binding);
+                    }
+                    retired.push_back(Retired{frameCount, poolBinding});
+                    poolBinding = binding;
+                    poolChanged = false;
+                    changed = true;
+                }
+                else
+                {
+                    LOG_ERROR("TextureManager: failed to compile the texture pool");
+                    poolChanged = false;
+                }
+            }
+            return changed;
+        }
+
+        void TextureManager::clear()
+        {
+            if(threads)
+            {
+                threads->stop();
+                threads = 0;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            textures.clear();
+            decoded.clear();
+            retired.clear();
+            fallback = 0;
+            poolIndices.clear();
+            pool.clear();
+            poolUsers.clear();
+            poolBinding = 0;
+            createPoolBinding = nullptr;
+            poolChanged = false;
+        }
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Streams the material textures. Image files are decoded on worker
+         * threads, each file only once. Until a texture is resident the
+         * materials bind a shared 1x1 white fallback texture. At a frame
+         * boundary update() compiles the decoded textures, the mip chain is
+         * generated by vsg on upload, and swaps them into the materials.
+         */
+        class TextureManager
+        {
+        public:
+            /** Creates the material binding for a texture. */
+            using CreateBinding = std::function<vsg::ref_ptr<vsg::StateCommand>(vsg::ref_ptr<vsg::DescriptorImage>)>;
+
+            /**
+             * Returns the texture of an image file. Relative paths are
+             * looked up in the resources folder. Returns the fallback texture
+             * and starts loading if the texture is not resident yet.
+             */
+            static vsg::ref_ptr<vsg::DescriptorImage> getTexture(const std::string &filename);
+            /**
+             * Adds the binding of the texture to the state group. The binding
+             * is created again and replaced when the texture gets resident.
+             */
+            static void bindTexture(const std::string &filename,
+                                    vsg::ref_ptr<vsg::StateGroup> stateGroup,
+                                    CreateBinding createBinding);
+            /**
+             * In pool mode the textures of all materials are bound at once as
+             * one array of the given size. Index 0 is the white fallback.
+             */
+            static void setPoolSize(uint32_t size);
+            static uint32_t getPoolSize()
+                { return poolSize; }
+            /** Returns the index of the texture in the pool, 0 if the pool is full. */
+            static uint32_t addToPool(const std::string &filename);
+            /**
+             * Adds the binding of the texture pool to the state group. All
+             * state groups share one binding which is replaced when a texture
+             * of the pool gets resident or is added.
+             */
+            static void bindPool(vsg::ref_ptr<vsg::StateGroup> stateGroup,
+                                 CreateBinding createBinding);
+
+            /** Looks up relative paths in the resources folder. */
+            static std::string resolvePath(const std::string &filename);
+            /** Decodes an image file on the calling thread. */
+            static vsg::ref_ptr<vsg::Data> readImage(const std::string &filename);
+
+            static void setNumThreads(unsigned int numThreads);
+            /**
+             * Swaps in the textures decoded since the last call. Has to be
+             * called between two frames. Returns true if a texture changed.
+             */
+            static bool update(vsg::ref_ptr<vsg::Viewer> viewer);
+            static void clear();
+
+        private:
+            struct User
+            {
+                vsg::ref_ptr<vsg::StateGroup> stateGroup;
+                vsg::ref_ptr<vsg::StateCommand> binding;
+                CreateBinding createBinding;
+            };
+            struct Texture
+            {
+                bool resident;
+                vsg::ref_ptr<vsg::DescriptorImage> descriptor;
+                // materials still bound to the fallback texture
+                std::vector<User> users;
+            };
+            struct Retired
+            {
+                uint64_t frameCount;
+                vsg::ref_ptr<vsg::StateCommand> binding;
+            };
+            friend struct DecodeOperation;
+
+            static std::map<std::string, Texture> textures;
+            static std::vector<std::pair<std::string, vsg::ref_ptr<vsg::Data>>> decoded;
+            static std::vector<Retired> retired;
+            static vsg::ref_ptr<vsg::DescriptorImage> fallback;
+            static vsg::ref_ptr<vsg::OperationThreads> threads;
+            static unsigned int numThreads;
+            static std::mutex mutex;
+
+            static uint32_t poolSize;
+            static std::map<std::string, uint32_t> poolIndices;
+            static std::vector<std::string> pool;
+            static std::vector<vsg::ref_ptr<vsg::StateGroup>> poolUsers;
+            static vsg::ref_ptr<vsg::StateCommand> poolBinding;
+            static CreateBinding createPoolBinding;
+            static bool poolChanged;
+
+            static Texture& requestTexture(const std::string &path);
+            static vsg::ref_ptr<vsg::DescriptorImage> createDescriptor(vsg::ref_ptr<vsg::Data> data);
+            static vsg::ref_ptr<vsg::DescriptorImage> createPoolDescriptor();
+            static vsg::ref_ptr<vsg::DescriptorImage> getFallback();
+        };
+    }
+}
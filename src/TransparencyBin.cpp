@@ -0,0 +1,168 @@
+#include "TransparencyBin.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        void TransparencyBin::addMaterial(vsg::ref_ptr<vsg::StateGroup> stateGroup)
+        {
+            materials.push_back(stateGroup);
+        }
+
+        void TransparencyBin::removeMaterial(vsg::ref_ptr<vsg::StateGroup> stateGroup)
+        {
+            materials.erase(std::remove(materials.begin(), materials.end(), stateGroup),
+                            materials.end());
+            entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                         [&stateGroup](const Entry &entry)
+                                         { return entry.material == stateGroup.get(); }),
+                          entries.end());
+            ++generation;
+        }
+
+        void TransparencyBin::updateEntries()
+        {
+            // objects of the materials, the commands of a material like the
+            // push constants of the material table are recorded per object
+            std::unordered_map<const vsg::Node*, vsg::StateGroup*> objects;
+            for(auto &material: materials)
+            {
+                for(auto &child: material->children)
+                {
+                    if(!child->cast<vsg::Command>())
+                    {
+                        objects[child.get()] = material.get();
+                    }
+                }
+            }
+
+            // keep the entries of the remaining objects
+            std::unordered_set<const vsg::Node*> known;
+            size_t n = 0;
+            for(auto &entry: entries)
+            {
+                auto it = objects.find(entry.object);
+                if(it != objects.end() && it->second == entry.material)
+                {
+                    known.insert(entry.object);
+                    entries[n++] = entry;
+                }
+            }
+            if(n != entries.size())
+            {
+                entries.resize(n);
+                ++generation;
+            }
+            for(auto &it: objects)
+            {
+                if(known.count(it.first))
+                {
+                    continue;
+                }
+                Entry entry;
+                entry.material = it.second;
+                entry.object = const_cast<vsg::Node*>(it.first);
+                entry.stateGroup = vsg::StateGroup::create();
+                for(auto &child: entry.material->children)
+                {
+                    if(child->cast<vsg::Command>())
+                    {
+                        entry.stateGroup->addChild(child);
+                    }
+                }
+                entry.stateGroup->addChild(vsg::ref_ptr<vsg::Node>(entry.object));
+                entries.push_back(entry);
+                ++generation;
+            }
+            for(auto &entry: entries)
+            {
+                // bindings of a material are replaced when its texture is
+                // streamed in
+                if(entry.stateGroup->stateCommands != entry.material->stateCommands)
+                {
+                    entry.stateGroup->stateCommands = entry.material->stateCommands;
+                }
+            }
+        }
+
+        void TransparencyBin::update()
+        {
+            updateEntries();
+        }
+
+        void TransparencyBin::traverse(vsg::Visitor &visitor)
+        {
+            for(auto &material: materials)
+            {
+                material->accept(visitor);
+            }
+        }
+
+        void TransparencyBin::traverse(vsg::ConstVisitor &visitor) const
+        {
+            for(auto &material: materials)
+            {
+                material->accept(visitor);
+            }
+        }
+
+        void TransparencyBin::traverse(vsg::RecordTraversal &visitor) const
+        {
+            ViewOrder *viewOrder;
+            {
+                std::lock_guard<std::mutex> lock(orderMutex);
+                viewOrder = &viewOrders[visitor.getCommandBuffer()->viewID];
+            }
+            std::vector<size_t> &order = viewOrder->order;
+            bool changed = viewOrder->generation != generation;
+            if(changed)
+            {
+                order.resize(entries.size());
+                for(size_t i=0; i<order.size(); ++i)
+                {
+                    order[i] = i;
+                }
+                viewOrder->generation = generation;
+            }
+            // distance to the eye of the view in view space
+            const vsg::dmat4 &viewMatrix = visitor.getState()->modelviewMatrixStack.top();
+            std::vector<double> &depths = viewOrder->depths;
+            depths.resize(entries.size());
+            for(size_t i=0; i<entries.size(); ++i)
+            {
+                vsg::dvec3 position;
+                if(auto transform = entries[i].object->cast<vsg::MatrixTransform>())
+                {
+                    position = vsg::dvec3(transform->matrix[3][0], transform->matrix[3][1], transform->matrix[3][2]);
+                }
+                depths[i] = vsg::length2(viewMatrix * position);
+            }
+            if(changed)
+            {
+                std::sort(order.begin(), order.end(),
+                          [&depths](size_t a, size_t b) { return depths[a] > depths[b]; });
+            }
+            // insertion sort, farthest object first
+            for(size_t i=1; i<order.size(); ++i)
+            {
+                size_t index = order[i];
+                size_t j = i;
+                while(j > 0 && depths[order[j-1]] < depths[index])
+                {
+                    order[j] = order[j-1];
+                    --j;
+                }
+                order[j] = index;
+            }
+            for(size_t index: order)
+            {
+                entries[index].stateGroup->accept(visitor);
+            }
+        }
+    }
+}
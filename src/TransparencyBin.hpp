@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <map>
+#include <mutex>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+
+        /**
+         * Render bin of the transparent materials. It is placed behind the
+         * opaque materials and records every object of its materials with
+         * the state of its material, sorted back to front to the eye of the
+         * view being recorded.
+         *
+         * Objects move little between two frames, thus every view keeps
+         * the order of its previous frame and only repairs it by an
+         * insertion sort. This is linear for an unchanged order instead of
+         * a full sort per frame.
+         */
+        class TransparencyBin : public vsg::Inherit<vsg::Node, TransparencyBin>
+        {
+         public:
+            void addMaterial(vsg::ref_ptr<vsg::StateGroup> stateGroup);
+            void removeMaterial(vsg::ref_ptr<vsg::StateGroup> stateGroup);
+            /**
+             * Updates the objects of the materials. Has to be called between
+             * two frames.
+             */
+            void update();
+            inline size_t getNumObjects() const
+                { return entries.size(); }
+
+            // compile and other visitors see the material state groups
+            void traverse(vsg::Visitor &visitor) override;
+            void traverse(vsg::ConstVisitor &visitor) const override;
+            // recording sorts the objects for the view being recorded
+            void traverse(vsg::RecordTraversal &visitor) const override;
+
+        private:
+            struct Entry
+            {
+                vsg::StateGroup *material;
+                vsg::Node *object;
+                // state of the material and the object as only child
+                vsg::ref_ptr<vsg::StateGroup> stateGroup;
+            };
+
+            struct ViewOrder
+            {
+                // entries of the generation, farthest first
+                std::vector<size_t> order;
+                std::vector<double> depths;
+                size_t generation = 0;
+            };
+
+            std::vector<vsg::ref_ptr<vsg::StateGroup>> materials;
+            std::vector<Entry> entries;
+            // incremented whenever the entries change
+            size_t generation = 1;
+            // views may be recorded by several threads
+            mutable std::mutex orderMutex;
+            mutable std::map<uint32_t, ViewOrder> viewOrders;
+
+            void updateEntries();
+        };
+    }
+}
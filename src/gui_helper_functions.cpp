@@ -1,8 +1,18 @@
 #include "gui_helper_functions.hpp"
 #include "Bobj.hpp"
 #include "MARSStateGroup.hpp"
+#include "ClipmapTerrain.hpp"
+#include "HeightmapLoader.hpp"
+#include "PagedTerrain.hpp"
+#include "CompileScheduler.hpp"
+#include "TextureManager.hpp"
+#include "shader/ShaderCache.hpp"
+#include "shader/ShaderNodeLibrary.hpp"
+#include <mars_interfaces/terrainStruct.h>
 #include <mars_utils/misc.h>
 
+#include <algorithm>
+
 using namespace std;
 
 namespace mars
@@ -13,12 +23,13 @@ namespace mars
     namespace vsg_graphics
     {
 
-        vsg::ref_ptr<WorldTransformUniformValue> GuiHelper::worldTransformUniform = 0;
         vsg::ref_ptr<vsg::Options> GuiHelper::loadOptions = nullptr;
         std::map<std::string, GraphShader> GuiHelper::graphShaderFiles;
+        std::mutex GuiHelper::graphShaderMutex;
         std::map<std::string, vsg::ref_ptr<vsg::Node>> GuiHelper::nodeFiles;
-        std::map<std::string, vsg::ref_ptr<vsg::StateGroup>> GuiHelper::stateGroups;
         vsg::ref_ptr<vsg::Group> GuiHelper::stateGroupNodes = vsg::StateGroup::create();
+        std::vector<vsg::ref_ptr<vsg::Group>> GuiHelper::materialBins;
+        vsg::ref_ptr<TransparencyBin> GuiHelper::transparencyBin = TransparencyBin::create();
         std::string GuiHelper::resourcePath = "";
 
         // Extract a pointer to the materialValue
@@ -78,12 +89,21 @@ namespace mars
 
         GuiHelper::~GuiHelper()
         {
-            GuiHelper::worldTransformUniform = 0;
             GuiHelper::stateGroupNodes = 0;
+            GuiHelper::materialBins.clear();
+            GuiHelper::transparencyBin = 0;
             GuiHelper::loadOptions = 0;
+            // waits for a running shader reload which reads the graphs
+            MARSStateGroup::clear();
             graphShaderFiles.clear();
-            stateGroups.clear();
             nodeFiles.clear();
+            ShaderCache::clear();
+            ShaderNodeLibrary::clear();
+            CompileScheduler::clear();
+            TextureManager::clear();
+            ClipmapTerrain::clear();
+            PagedTerrain::clear();
+            HeightmapLoader::clear();
         }
 
         /** \brief converts the mesh of an osgNode to the snmesh struct */
@@ -118,20 +138,98 @@ namespace mars
 
         void GuiHelper::readPixelData(mars::interfaces::terrainStruct *terrain)
         {
-            (void)terrain;
+            // the physics usually reads the map before the draw object is
+            // created, a large map is tiled here by streaming its rows
+            vsg::ref_ptr<vsg::floatArray2D> heights;
+            if(auto tileSet = PagedTerrain::openTileSet(terrain->srcname, heights))
+            {
+                // the finest level that fits into the memory budget unless
+                // Graphics/terrainPhysicsSamples asks for more samples
+                uint32_t level = tileSet->getLevel(PagedTerrain::getPhysicsSamples());
+                uint32_t width = TerrainTileSet::getLevelSize(tileSet->getWidth(), level);
+                uint32_t height = TerrainTileSet::getLevelSize(tileSet->getHeight(), level);
+                if(level > 0)
+                {
+                    LOG_WARN("GuiHelper: the physics of %s uses level %u with %ux%u samples, it does not match the rendered terrain",
+                             terrain->srcname.c_str(), level, width, height);
+                }
+                // the physics releases pixelData with free()
+                terrain->pixelData = (double*)calloc((size_t)width*height, sizeof(double));
+                if(!terrain->pixelData)
+                {
+                    LOG_ERROR("GuiHelper: can not allocate %ux%u samples for %s",
+                              width, height, terrain->srcname.c_str());
+                    return;
+                }
+                terrain->width = width;
+                terrain->height = height;
+                if(!tileSet->readLevel(level, terrain->scale, terrain->pixelData))
+                {
+                    LOG_ERROR("GuiHelper: can not read the tiles of %s", terrain->srcname.c_str());
+                }
+                return;
+            }
+            if(!heights)
+            {
+                LOG_ERROR("GuiHelper: can not read heightmap %s", terrain->srcname.c_str());
+                return;
+            }
+            // the physics releases pixelData with free()
+            terrain->pixelData = (double*)calloc(heights->valueCount(), sizeof(double));
+            if(!terrain->pixelData)
+            {
+                LOG_ERROR("GuiHelper: can not allocate %ux%u samples for %s",
+                          heights->width(), heights->height(), terrain->srcname.c_str());
+                return;
+            }
+            terrain->width = heights->width();
+            terrain->height = heights->height();
+            HeightmapLoader::scale(*heights, terrain->scale, terrain->pixelData);
         }
 
-        GraphShader& GuiHelper::readGraphShaderFromFile(std::string fileName)
+        GraphShader GuiHelper::readGraphShaderFromFile(std::string fileName,
+                                                       const ShaderVariant &variant)
         {
-            auto it = graphShaderFiles.find(fileName);
-            if(it != graphShaderFiles.end()) {
-                return it->second;
+            // variants are generated lazily, only the shadow technique
+            // changes the graph, all other properties are handled by defines
+            std::string key = fileName + ":" + variant.shadowTechnique;
+            {
+                std::lock_guard<std::mutex> lock(graphShaderMutex);
+                auto it = graphShaderFiles.find(key);
+                if(it != graphShaderFiles.end()) {
+                    return it->second;
+                }
             }
+            // shader graphs are built outside of the lock, thus independent
+            // graphs can be loaded concurrently
             GraphShader gs;
+            gs.options["shadowTechnique"] = variant.shadowTechnique;
             configmaps::ConfigMap graphShaderMap = configmaps::ConfigMap::fromYamlFile(fileName);
             gs.loadShader(graphShaderMap);
-            graphShaderFiles[fileName] = gs;
-            return graphShaderFiles[fileName];
+            std::lock_guard<std::mutex> lock(graphShaderMutex);
+            return graphShaderFiles.emplace(key, gs).first->second;
+        }
+
+        void GuiHelper::clearGraphShaders(const std::string &fileName)
+        {
+            std::lock_guard<std::mutex> lock(graphShaderMutex);
+            if(fileName.empty())
+            {
+                graphShaderFiles.clear();
+                return;
+            }
+            std::string prefix = fileName + ":";
+            for(auto it=graphShaderFiles.begin(); it!=graphShaderFiles.end();)
+            {
+                if(it->first.compare(0, prefix.size(), prefix) == 0)
+                {
+                    it = graphShaderFiles.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
         }
 
         vsg::ref_ptr<vsg::Node> GuiHelper::readNodeFromFile(std::string fileName)
@@ -174,14 +272,13 @@ namespace mars
 
         vsg::ref_ptr<vsg::Data> GuiHelper::loadTexture(std::string filename)
         {
-            (void)filename;
-            return vsg::ref_ptr<vsg::Data>();
+            return TextureManager::readImage(filename);
         }
 
         vsg::ref_ptr<vsg::DescriptorImage> GuiHelper::loadImage(std::string filename)
         {
-            (void)filename;
-            return vsg::ref_ptr<vsg::DescriptorImage>();
+            // the fallback texture is returned until the image is resident
+            return TextureManager::getTexture(filename);
         }
 
         void GuiHelper::getPhysicsFromNode(mars::interfaces::NodeData* node,
@@ -196,20 +293,98 @@ namespace mars
             return Bobj::checkBobj(filename);
         }
 
-        vsg::ref_ptr<vsg::StateGroup> GuiHelper::createStateGroup(configmaps::ConfigMap materialSpec)
+        vsg::ref_ptr<vsg::StateGroup> GuiHelper::createStateGroup(configmaps::ConfigMap materialSpec,
+                                                                  bool shared)
         {
             std::string materialName = materialSpec["name"];
-            { // check if we loaded the file already into memory
-                auto it = stateGroups.find(materialName);
-                if(it != stateGroups.end()) {
-                    return it->second;
+            if(shared)
+            {
+                // an edited material keeps its name for objects requesting
+                // the spec it was created with
+                MaterialHandle *named = MARSStateGroup::getMaterial(materialName);
+                if(named && named->originHash == MARSStateGroup::contentHash(materialSpec))
+                {
+                    MARSStateGroup::setMaterialName(materialName, named);
+                    return named->stateGroup;
+                }
+                // materials with equal contents share one state group, the
+                // name only becomes an alias
+                MaterialHandle *handle = MARSStateGroup::findMaterial(materialSpec);
+                if(handle)
+                {
+                    MARSStateGroup::setMaterialName(materialName, handle);
+                    return handle->stateGroup;
                 }
             }
-            auto stateGroup = MARSStateGroup::create(materialSpec);
-            stateGroupNodes->addChild(stateGroup);
-            stateGroups[materialName] = stateGroup;
+            auto stateGroup = MARSStateGroup::create(materialSpec, shared);
+            if(MARSStateGroup::isTransparent(materialSpec))
+            {
+                transparencyBin->addMaterial(stateGroup);
+                return stateGroup;
+            }
+            addStateGroup(stateGroup);
             return stateGroup;
         }
 
+        void GuiHelper::addStateGroup(vsg::ref_ptr<vsg::StateGroup> stateGroup)
+        {
+            stateGroupNodes->addChild(stateGroup);
+            if(!materialBins.empty())
+            {
+                // the objects are added later, the bins are balanced by
+                // balanceMaterialBins() before the next compile
+                auto bin = std::min_element(materialBins.begin(), materialBins.end(),
+                                            [](const vsg::ref_ptr<vsg::Group> &a, const vsg::ref_ptr<vsg::Group> &b)
+                                            { return a->children.size() < b->children.size(); });
+                (*bin)->addChild(stateGroup);
+            }
+        }
+
+        void GuiHelper::removeStateGroup(vsg::ref_ptr<vsg::StateGroup> stateGroup)
+        {
+            auto remove = [&stateGroup](vsg::Group::Children &children)
+            {
+                children.erase(std::remove(children.begin(), children.end(), stateGroup),
+                               children.end());
+            };
+            remove(stateGroupNodes->children);
+            for(auto &bin: materialBins)
+            {
+                remove(bin->children);
+            }
+            transparencyBin->removeMaterial(stateGroup);
+        }
+
+        void GuiHelper::balanceMaterialBins()
+        {
+            if(materialBins.size() < 2)
+            {
+                return;
+            }
+            // every child of a material is the transform of one object
+            std::vector<vsg::ref_ptr<vsg::Node>> materials(stateGroupNodes->children.begin(),
+                                                           stateGroupNodes->children.end());
+            auto drawCount = [](const vsg::ref_ptr<vsg::Node> &node)
+            {
+                auto group = node->cast<vsg::Group>();
+                return group ? group->children.size() : size_t(1);
+            };
+            std::stable_sort(materials.begin(), materials.end(),
+                             [&](const vsg::ref_ptr<vsg::Node> &a, const vsg::ref_ptr<vsg::Node> &b)
+                             { return drawCount(a) > drawCount(b); });
+            std::vector<size_t> binDraws(materialBins.size(), 0);
+            std::vector<vsg::Group::Children> binChildren(materialBins.size());
+            for(auto &material: materials)
+            {
+                size_t bin = std::min_element(binDraws.begin(), binDraws.end()) - binDraws.begin();
+                binDraws[bin] += drawCount(material);
+                binChildren[bin].push_back(material);
+            }
+            for(size_t i=0; i<materialBins.size(); ++i)
+            {
+                materialBins[i]->children.swap(binChildren[i]);
+            }
+        }
+
     } // end of namespace vsg_graphics
 } // end of namespace mars
@@ -1,5 +1,6 @@
 #pragma once
 #include "shader/GraphShader.hpp"
+#include "TransparencyBin.hpp"
 #include <vsg/all.h>
 #include <vsgXchange/all.h>
 
@@ -7,6 +8,8 @@
 #include <mars_interfaces/graphics/GraphicsManagerInterface.hpp>
 #include <mars_interfaces/Logging.hpp>
 
+#include <mutex>
+
 namespace mars
 {
     namespace vsg_graphics
@@ -115,17 +118,44 @@ namespace mars
             virtual void getPhysicsFromMesh(mars::interfaces::NodeData *node);
             virtual void readPixelData(mars::interfaces::terrainStruct *terrain);
 
-            static GraphShader& readGraphShaderFromFile(std::string fileName);
+            /**
+             * Returns a copy of the cached graph, thus the cache can be
+             * cleared or extended by other threads while it is used.
+             */
+            static GraphShader readGraphShaderFromFile(std::string fileName,
+                                                       const ShaderVariant &variant = ShaderVariant());
+            /** Removes all variants of a shader graph, or all graphs, from the cache. */
+            static void clearGraphShaders(const std::string &fileName = "");
             static vsg::ref_ptr<vsg::Node> readNodeFromFile(std::string fileName);
             static vsg::ref_ptr<vsg::Node> readBobjFromFile(const std::string &filename);
             static vsg::ref_ptr<vsg::Data> loadTexture(std::string filename);
             static vsg::ref_ptr<vsg::DescriptorImage> loadImage(std::string filename);
             static std::string resourcePath;
             static bool checkBobj(std::string &filename);
-            static vsg::ref_ptr<vsg::StateGroup> createStateGroup(configmaps::ConfigMap material);
+            /**
+             * Returns the state group of the material. A shared material is
+             * reused by all materials of equal contents regardless of their
+             * names, otherwise a new one is created.
+             */
+            static vsg::ref_ptr<vsg::StateGroup> createStateGroup(configmaps::ConfigMap material,
+                                                                  bool shared = true);
+            /** Adds a state group with own pipeline to the rendered scene. */
+            static void addStateGroup(vsg::ref_ptr<vsg::StateGroup> stateGroup);
+            /** Removes a released material from the scene and the bins. */
+            static void removeStateGroup(vsg::ref_ptr<vsg::StateGroup> stateGroup);
+            /**
+             * Distributes the material state groups over the recording bins
+             * by their number of objects, the largest materials first to the
+             * bin with the fewest objects. Has to be called between two frames.
+             */
+            static void balanceMaterialBins();
 
-            static vsg::ref_ptr<WorldTransformUniformValue> worldTransformUniform;
             static vsg::ref_ptr<vsg::Group> stateGroupNodes;
+            // if not empty the material state groups are distributed over
+            // these bins which are recorded into separate secondary command buffers
+            static std::vector<vsg::ref_ptr<vsg::Group>> materialBins;
+            // state groups of the transparent materials, recorded last
+            static vsg::ref_ptr<TransparencyBin> transparencyBin;
 
         private:
             interfaces::GraphicsManagerInterface *graphicsInterface;
@@ -133,7 +163,7 @@ namespace mars
 
             // map to prevent double load of shader files
             static std::map<std::string, GraphShader> graphShaderFiles;
-            static std::map<std::string, vsg::ref_ptr<vsg::StateGroup>> stateGroups;
+            static std::mutex graphShaderMutex;
 
             // map to prevent double load of mesh files
             static std::map<std::string, vsg::ref_ptr<vsg::Node>> nodeFiles;
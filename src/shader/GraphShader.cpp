@@ -1,4 +1,5 @@
 #include "GraphShader.hpp"
+#include "ShaderNodeLibrary.hpp"
 #include "tsort/tsort.h"
 #include "../gui_helper_functions.hpp"
 #include <mars_utils/misc.h>
@@ -22,13 +23,23 @@ layout(push_constant) uniform PushConstants {
     mat4 modelView;
 } pc;
 
-layout(set = 0, binding = 0) uniform WorldTransform{
+layout(set = 2, binding = 0) uniform WorldTransform{
     mat4 projectionInverse;
     mat4 viewInverse;
 } wt;
 
 layout(location = 0) in vec3 vsg_Vertex;
 layout(location = 1) in vec3 vsg_Normal;
+#ifdef MARS_VERTEX_COLORS
+layout(location = 2) in vec4 vsg_Color;
+// fixed location behind the varyings of the graph
+layout(location = 14) out vec4 marsColor;
+#endif
+#ifdef MARS_TEXTURE
+layout(location = 3) in vec2 vsg_TexCoord0;
+// fixed location behind the varyings of the graph
+layout(location = 15) out vec2 marsTexCoord;
+#endif
 
 out gl_PerVertex{ vec4 gl_Position; };
 )";
@@ -40,13 +51,39 @@ out gl_PerVertex{ vec4 gl_Position; };
 layout(push_constant) uniform PushConstants {
     mat4 projection;
     mat4 modelView;
+#ifdef MARS_MATERIAL_TABLE
+    uint materialIndex;
+#ifdef MARS_TEXTURE_POOL
+    uint textureIndex;
+#endif
+#endif
 } pc;
 
-layout(set = 0, binding = 0) uniform WorldTransform{
+layout(set = 2, binding = 0) uniform WorldTransform{
     mat4 projectionInverse;
     mat4 viewInverse;
 } wt;
 
+#ifdef MARS_MATERIAL_TABLE
+struct PbrMaterialData
+{
+    vec4 baseColorFactor;
+    vec4 emissiveFactor;
+    vec4 diffuseFactor;
+    vec4 specularFactor;
+    float metallicFactor;
+    float roughnessFactor;
+    float alphaMask;
+    float alphaMaskCutoff;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer PbrMaterialTable
+{
+    PbrMaterialData materials[];
+} pbrTable;
+
+#define pbr pbrTable.materials[pc.materialIndex]
+#else
 layout(set = 0, binding = 1) uniform PbrMaterial
 {
     vec4 baseColorFactor;
@@ -58,6 +95,22 @@ layout(set = 0, binding = 1) uniform PbrMaterial
     float alphaMask;
     float alphaMaskCutoff;
 } pbr;
+#endif
+
+#ifdef MARS_TEXTURE
+#ifdef MARS_TEXTURE_POOL
+// the textures of all materials, index 0 is a white texture
+layout(constant_id = 4) const int texturePoolSize = 1;
+layout(set = 0, binding = 2) uniform sampler2D materialTextures[texturePoolSize];
+#define diffuseTexture materialTextures[pc.textureIndex]
+#else
+layout(set = 0, binding = 2) uniform sampler2D diffuseTexture;
+#endif
+layout(location = 15) in vec2 marsTexCoord;
+#endif
+#ifdef MARS_VERTEX_COLORS
+layout(location = 14) in vec4 marsColor;
+#endif
 
 // ViewDependentState
 layout(constant_id = 3) const int lightDataSize = 256;
@@ -68,9 +121,237 @@ layout(set = 1, binding = 0) uniform LightData
 
 )";
 
+        std::set<std::string> ShaderVariant::getDefines() const
+        {
+            std::set<std::string> defines;
+            if(texture) defines.insert("MARS_TEXTURE");
+            if(vertexColors) defines.insert("MARS_VERTEX_COLORS");
+            if(texturePoolSize > 0) defines.insert("MARS_TEXTURE_POOL");
+            return defines;
+        }
+
+        vsg::ShaderStage::SpecializationConstants ShaderVariant::getSpecializationConstants() const
+        {
+            vsg::ShaderStage::SpecializationConstants constants;
+            if(lightCount > 0)
+            {
+                // one vec4 for the light counts and at most four per light
+                constants[3] = vsg::intValue::create(static_cast<int>(1 + 4*lightCount));
+            }
+            if(texturePoolSize > 0)
+            {
+                constants[4] = vsg::intValue::create(static_cast<int>(texturePoolSize));
+            }
+            return constants;
+        }
+
+        std::string ShaderVariant::getName() const
+        {
+            std::stringstream name;
+            name << "shadow_" << shadowTechnique << "_lights_" << lightCount;
+            if(texture) name << "_texture";
+            if(vertexColors) name << "_vertex_colors";
+            if(texturePoolSize > 0) name << "_pool_" << texturePoolSize;
+            return name.str();
+        }
+
         GraphShader::GraphShader() {}
         GraphShader::~GraphShader() {}
 
+        std::string GraphShader::resolveFunction(const std::string &function)
+        {
+            // the shadow nodes are replaced by the selected technique
+            if (options.hasKey("shadowTechnique") && (function == "shadow" || function == "shadow_vert"))
+            {
+                string technique = options["shadowTechnique"];
+                return (function == "shadow") ? "shadow_" + technique : "shadow_" + technique + "_vert";
+            }
+            return function;
+        }
+
+        std::set<std::string> GraphShader::optimizeGraph(ConfigItem &graph, ConfigMap &nodeConfig,
+                                                         ConfigMap &filterMap)
+        {
+            struct Edge
+            {
+                string from, fromInterface, to, toInterface;
+                ConfigMap data;
+            };
+            std::set<std::string> removed;
+            if (options.hasKey("optimize") && !(bool)options["optimize"])
+            {
+                return removed;
+            }
+
+            // collect nodes and edges with the names used in loadShader
+            std::vector<std::string> names;
+            std::map<std::string, std::string> functions;
+            std::set<std::string> roots, pure;
+            for (auto it = graph["nodes"].begin(); it != graph["nodes"].end(); ++it)
+            {
+                string name = (*it)["name"];
+                string function = (*it)["model"]["name"];
+                names.push_back(name);
+                functions[name] = function;
+                if (filterMap.hasKey(function))
+                {
+                    // variables are always kept, they define the interface
+                    roots.insert(name);
+                    continue;
+                }
+                try
+                {
+                    ConfigMap functionInfo = ShaderNodeLibrary::getFunctionInfo(resolveFunction(function));
+                    // functions writing varyings have side effects as well
+                    bool sideEffects = functionInfo.hasKey("varyings") ||
+                        (functionInfo.hasKey("sideEffects") && (bool)functionInfo["sideEffects"]);
+                    if (!functionInfo["params"].hasKey("out") || sideEffects)
+                    {
+                        roots.insert(name);
+                    }
+                    else
+                    {
+                        pure.insert(name);
+                    }
+                }
+                catch (...)
+                {
+                    // reported by the code generation
+                    roots.insert(name);
+                }
+            }
+            std::vector<Edge> edges;
+            TSort tsort;
+            std::map<std::string, unsigned long> ids;
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                ids[names[i]] = i+1;
+            }
+            for (auto it = graph["edges"].begin(); it != graph["edges"].end(); ++it)
+            {
+                Edge edge;
+                edge.from = replaceString((std::string)(*it)["from"]["name"], "::", "_");
+                edge.to = replaceString((std::string)(*it)["to"]["name"], "::", "_");
+                if (edge.from == "gl_Vertex") edge.from = "vsg_Vertex";
+                if (edge.to == "gl_Vertex") edge.to = "vsg_Vertex";
+                edge.fromInterface = (std::string)(*it)["from"]["interface"];
+                edge.toInterface = (std::string)(*it)["to"]["interface"];
+                edge.data = *it;
+                if (ids.count(edge.from) && ids.count(edge.to))
+                {
+                    tsort.addRelation(ids[edge.from], ids[edge.to]);
+                }
+                edges.push_back(edge);
+            }
+
+            // merge pure nodes with the same function, defaults and inputs,
+            // inputs are visited first thus merged sources are resolved
+            std::map<std::string, std::string> canonical;
+            std::map<std::string, std::string> signatures;
+            std::vector<std::string> order;
+            for (unsigned long id: tsort.sort())
+            {
+                order.push_back(names[id-1]);
+            }
+            for (auto &name: names)
+            {
+                if (find(order.begin(), order.end(), name) == order.end())
+                {
+                    order.push_back(name);
+                }
+            }
+            for (auto &name: order)
+            {
+                if (!pure.count(name))
+                {
+                    continue;
+                }
+                std::set<std::string> inputs;
+                for (auto &edge: edges)
+                {
+                    if (edge.to == name)
+                    {
+                        string from = canonical.count(edge.from) ? canonical[edge.from] : edge.from;
+                        inputs.insert(edge.toInterface + "=" + from + "." + edge.fromInterface);
+                    }
+                }
+                stringstream signature;
+                signature << functions[name] << "|";
+                for (auto &input: inputs)
+                {
+                    signature << input << "|";
+                }
+                if (nodeConfig.hasKey(name))
+                {
+                    signature << nodeConfig[name].toYamlString();
+                }
+                auto it = signatures.find(signature.str());
+                if (it != signatures.end())
+                {
+                    canonical[name] = it->second;
+                    removed.insert(name);
+                }
+                else
+                {
+                    signatures[signature.str()] = name;
+                }
+            }
+            for (auto &edge: edges)
+            {
+                if (canonical.count(edge.from))
+                {
+                    edge.from = canonical[edge.from];
+                }
+            }
+
+            // remove the nodes which do not contribute to an output
+            std::set<std::string> alive;
+            std::vector<std::string> stack;
+            for (auto &name: roots)
+            {
+                if (!removed.count(name))
+                {
+                    alive.insert(name);
+                    stack.push_back(name);
+                }
+            }
+            while (!stack.empty())
+            {
+                string name = stack.back();
+                stack.pop_back();
+                for (auto &edge: edges)
+                {
+                    if (edge.to == name && !alive.count(edge.from) && !removed.count(edge.from))
+                    {
+                        alive.insert(edge.from);
+                        stack.push_back(edge.from);
+                    }
+                }
+            }
+            for (auto &name: names)
+            {
+                if (!alive.count(name))
+                {
+                    removed.insert(name);
+                }
+            }
+
+            // write back the remaining edges
+            ConfigVector remainingEdges;
+            for (auto &edge: edges)
+            {
+                if (removed.count(edge.from) || removed.count(edge.to))
+                {
+                    continue;
+                }
+                edge.data["from"]["name"] = edge.from;
+                edge.data["to"]["name"] = edge.to;
+                remainingEdges.push_back(edge.data);
+            }
+            graph["edges"] = remainingEdges;
+            return removed;
+        }
+
         void GraphShader::loadShader(ConfigMap &shaderConfig)
         {
             stringstream code;
@@ -83,6 +364,7 @@ layout(set = 1, binding = 0) uniform LightData
             std::vector<ShaderAttributeT> vars; //definitions of main variables
             std::vector<ShaderVariableT> defaultVars;
             std::vector<std::string> function_calls;
+            TSort tsort;
             ConfigItem graph = shaderConfig["versions"][0]["components"];
             ConfigMap nodeConfig;
             ConfigMap iOuts; //Map containing already created edge variables for output interfaces
@@ -149,6 +431,13 @@ layout(set = 1, binding = 0) uniform LightData
                 }
             }
 
+            // prune dead nodes and merge duplicates before generating code
+            for (auto &name: optimizeGraph(graph, nodeConfig, filterMap))
+            {
+                nodeMap.erase(nodeNameId[name]);
+                nodeNameId.erase(name);
+            }
+
             for (it = graph["edges"].begin(); it != graph["edges"].end(); ++it)
             {
                 string fromNodeName = replaceString((std::string)(*it)["from"]["name"], "::", "_");
@@ -162,7 +451,7 @@ layout(set = 1, binding = 0) uniform LightData
                 // create relations for tsort
                 if(nodeNameId.count(fromNodeName) > 0 && nodeNameId.count(toNodeName) > 0)
                 {
-                    add_relation(nodeNameId[fromNodeName], nodeNameId[toNodeName]);
+                    tsort.addRelation(nodeNameId[fromNodeName], nodeNameId[toNodeName]);
                 }
                 ConfigMap fromNode = nodeMap[nodeNameId[fromNodeName]];
                 string name = fromNode["model"]["name"];
@@ -191,12 +480,9 @@ layout(set = 1, binding = 0) uniform LightData
                 }
             }
 
-            tsort();
-            unsigned long *ids = get_sorted_ids();
-            while (*ids != 0)
+            for (unsigned long sortedId: tsort.sort())
             {
-                sortedNodes.push_back(&(nodeMap[*ids]));
-                ids++;
+                sortedNodes.push_back(&(nodeMap[sortedId]));
             }
             for (nodeIt = nodeMap.begin(); nodeIt != nodeMap.end(); ++nodeIt)
             {
@@ -220,19 +506,19 @@ layout(set = 1, binding = 0) uniform LightData
                         nodeFunction << nodeConfig[nodeName]["loadName"];
                     }
                 }
+                nodeFunction = resolveFunction(nodeFunction);
                 if (!filterMap.hasKey(nodeFunction))
                 {
                     ConfigMap functionInfo;
                     try
                     {
-                        functionInfo = ConfigMap::fromYamlFile(GuiHelper::resourcePath + "/resources/graph_shader/" + nodeFunction + ".yaml");
+                        functionInfo = ShaderNodeLibrary::getFunctionInfo(nodeFunction);
                     }
                     catch (...)
                     {
                         fprintf(stderr, "ERROR: \n%s\n", node.toYamlString().c_str());
                         throw std::runtime_error("load shader error");
                     }
-                    // could handle shadow_map samples here
 
                     parseFunctionInfo(nodeFunction, functionInfo);
                     stringstream call;
@@ -258,9 +544,18 @@ layout(set = 1, binding = 0) uniform LightData
                                 varName = nodeConfig[nodeName]["toParams"][mit->first].getString();
                             } else if (nodeConfig[nodeName].hasKey("inputs") && nodeConfig[nodeName]["inputs"].hasKey(mit->first))
                             {
-                                varName = "default_" + mit->first + "_for_" + nodeName;
                                 string varType = (mit->second)["type"];
-                                defaultVars.push_back(ShaderVariableT {varType, varName, nodeConfig[nodeName]["inputs"][mit->first]});
+                                string value = nodeConfig[nodeName]["inputs"][mit->first].toString();
+                                if (!options.hasKey("optimize") || (bool)options["optimize"])
+                                {
+                                    // fold the constant default into the call
+                                    varName = varType + "(" + value + ")";
+                                }
+                                else
+                                {
+                                    varName = "default_" + mit->first + "_for_" + nodeName;
+                                    defaultVars.push_back(ShaderVariableT {varType, varName, value});
+                                }
                             }
                             else
                             {
@@ -273,7 +568,7 @@ layout(set = 1, binding = 0) uniform LightData
                                 }
                                 if(varType == "vec3")
                                 {
-                                    value = "vec2(0, 0, 0)";
+                                    value = "vec3(0, 0, 0)";
                                 }
                                 if(varType == "vec4")
                                 {
@@ -494,15 +789,9 @@ layout(set = 1, binding = 0) uniform LightData
         {
             stringstream code;
             map<string, string>::iterator mit;
-            string resPath = utils::pathJoin(GuiHelper::resourcePath, "resources");
             for (mit = source_files.begin(); mit != source_files.end(); ++mit)
             {
-                string path = utils::pathJoin(resPath, (string) mit->second);
-                //fprintf(stderr, "path: %s\n", path.c_str());
-                ifstream t(path);
-                stringstream buffer;
-                buffer << t.rdbuf();
-                code << endl << buffer.str() << endl;
+                code << endl << ShaderNodeLibrary::getSource(mit->second) << endl;
             }
             return code.str();
         }
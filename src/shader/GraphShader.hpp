@@ -13,6 +13,29 @@ namespace mars
 {
     namespace vsg_graphics
     {
+        /**
+         * Material and scene properties that select a variant of a shader
+         * graph. The shadow technique replaces the shadow nodes of the graph
+         * by shadow_<technique>. Textures and vertex colors are enabled by
+         * defines and the light count sizes the light data by the
+         * lightDataSize specialization constant.
+         */
+        struct ShaderVariant
+        {
+            bool texture = false;
+            bool vertexColors = false;
+            std::string shadowTechnique = "none";
+            // 0: use the default light data size of the shader
+            uint32_t lightCount = 0;
+            // 0: one texture per material, otherwise the size of the
+            // texture array indexed per material
+            uint32_t texturePoolSize = 0;
+
+            std::set<std::string> getDefines() const;
+            vsg::ShaderStage::SpecializationConstants getSpecializationConstants() const;
+            std::string getName() const;
+        };
+
         class GraphShader
         {
          public:
@@ -27,6 +50,21 @@ namespace mars
             std::string generateFragmentHeader();
             std::string generateVertexShaderSource();
             std::string generateFragmentShaderSource();
+            /** Applies the variant options to a node function name. */
+            std::string resolveFunction(const std::string &function);
+
+            /**
+             * Optimizes the graph before code generation. Function nodes
+             * whose results do not reach an output are removed and pure
+             * function nodes with identical inputs are merged. Nodes without
+             * outputs (e.g. vertexOut, fragOut), functions writing varyings
+             * and functions marked with "sideEffects: true" are kept.
+             * Returns the names of the removed nodes. Disabled by
+             * options["optimize"] = false.
+             */
+            std::set<std::string> optimizeGraph(configmaps::ConfigItem &graph,
+                                                configmaps::ConfigMap &nodeConfig,
+                                                configmaps::ConfigMap &filterMap);
 
             configmaps::ConfigMap options;
             std::string main_source;
@@ -0,0 +1,213 @@
+#include "ShaderCache.hpp"
+#include "../CacheFile.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#if defined(VSG_SUPPORTS_ShaderCompiler) && __has_include(<glslang/build_info.h>)
+#include <glslang/build_info.h>
+#endif
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::string ShaderCache::cacheDirectory;
+        std::map<uint64_t, vsg::ref_ptr<vsg::ShaderModule>> ShaderCache::modules;
+        std::map<const vsg::ShaderModule*, std::string> ShaderCache::cacheFiles;
+        std::mutex ShaderCache::mutex;
+
+        static const uint32_t spirvMagic = 0x07230203;
+
+        void ShaderCache::setCacheDirectory(const std::string &path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cacheDirectory = path;
+            if(cacheDirectory.empty())
+            {
+                return;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(cacheDirectory, ec);
+            if(ec)
+            {
+                LOG_ERROR("ShaderCache: can not create cache directory %s: %s",
+                          cacheDirectory.c_str(), ec.message().c_str());
+                cacheDirectory.clear();
+            }
+        }
+
+        uint64_t ShaderCache::hash(VkShaderStageFlagBits stage, const std::string &source,
+                                   const std::set<std::string> &defines)
+        {
+            uint64_t h = CacheFile::hashSeed;
+            CacheFile::hashString(h, compilerVersion());
+            CacheFile::hashValue(h, stage);
+            for(auto &define: defines)
+            {
+                CacheFile::hashString(h, define);
+            }
+            CacheFile::hashBytes(h, source.data(), source.size());
+            return h;
+        }
+
+        const std::string& ShaderCache::compilerVersion()
+        {
+            // the glslang version and the settings used by vsg to compile
+            // define the generated code
+            static const std::string version = []()
+            {
+                std::string version = std::string("vsg ") + VSG_VERSION_STRING;
+#if defined(GLSLANG_VERSION_MAJOR)
+                version += " glslang " + std::to_string(GLSLANG_VERSION_MAJOR) + "." +
+                    std::to_string(GLSLANG_VERSION_MINOR) + "." + std::to_string(GLSLANG_VERSION_PATCH);
+#endif
+                auto settings = vsg::ShaderCompileSettings::create();
+                version += " vulkan " + std::to_string(settings->vulkanVersion) +
+                    " client " + std::to_string(settings->clientInputVersion) +
+                    " target " + std::to_string(static_cast<int>(settings->target)) +
+                    " language " + std::to_string(static_cast<int>(settings->language)) +
+                    " default " + settings->defaultVersion;
+                return version;
+            }();
+            return version;
+        }
+
+        vsg::ref_ptr<vsg::ShaderStage> ShaderCache::createShaderStage(VkShaderStageFlagBits stage,
+                                                                      const std::string &source,
+                                                                      const std::set<std::string> &defines)
+        {
+            uint64_t key = hash(stage, source, defines);
+            std::string file;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = modules.find(key);
+                if(it != modules.end())
+                {
+                    return vsg::ShaderStage::create(stage, "main", it->second);
+                }
+                if(!cacheDirectory.empty())
+                {
+                    char name[32];
+                    snprintf(name, sizeof(name), "%016llx.spv", static_cast<unsigned long long>(key));
+                    file = (std::filesystem::path(cacheDirectory) / name).string();
+                }
+            }
+
+            auto module = vsg::ShaderModule::create(source);
+            if(!defines.empty())
+            {
+                module->hints = vsg::ShaderCompileSettings::create();
+                module->hints->defines = defines;
+            }
+            // modules not found on disk are compiled by compile() on the
+            // threads of the CompileScheduler
+            bool cached = !file.empty() && readSPIRV(file, module->code);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto inserted = modules.emplace(key, module);
+            if(inserted.second && !cached && !file.empty())
+            {
+                cacheFiles[module.get()] = file;
+            }
+            return vsg::ShaderStage::create(stage, "main", inserted.first->second);
+        }
+
+        bool ShaderCache::compile(vsg::ref_ptr<vsg::ShaderStage> shaderStage)
+        {
+            vsg::ref_ptr<vsg::ShaderModule> module = shaderStage->module;
+            if(!module)
+            {
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!module->code.empty())
+                {
+                    return true;
+                }
+            }
+            if(module->source.empty())
+            {
+                LOG_ERROR("ShaderCache: shader module has neither SPIR-V code nor source");
+                return false;
+            }
+#ifdef VSG_SUPPORTS_ShaderCompiler
+            // Compile a copy, another thread may compile the same module.
+            // The code of the shared module is only set once under the lock
+            // and read after it was found to be set.
+            auto copy = vsg::ShaderModule::create(module->source, module->hints);
+            auto copyStage = vsg::ShaderStage::create(shaderStage->stage, shaderStage->entryPointName, copy);
+            auto compiler = vsg::ShaderCompiler::create();
+            if(!compiler->compile(copyStage) || copy->code.empty())
+            {
+                LOG_ERROR("ShaderCache: failed to compile shader");
+                return false;
+            }
+            std::string file;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(module->code.empty())
+                {
+                    module->code = copy->code;
+                }
+                auto it = cacheFiles.find(module.get());
+                if(it != cacheFiles.end())
+                {
+                    file = it->second;
+                    cacheFiles.erase(it);
+                }
+            }
+            if(!file.empty())
+            {
+                writeSPIRV(file, copy->code);
+            }
+            return true;
+#else
+            LOG_ERROR("ShaderCache: shader is not in the cache and vsg was built without shader compiler");
+            return false;
+#endif
+        }
+
+        bool ShaderCache::readSPIRV(const std::string &file, vsg::ShaderModule::SPIRV &code)
+        {
+            std::ifstream in(file, std::ios::binary | std::ios::ate);
+            if(!in)
+            {
+                return false;
+            }
+            std::streamsize size = in.tellg();
+            // a truncated or foreign file is compiled again and replaced
+            if(size < 5 * static_cast<std::streamsize>(sizeof(uint32_t)) || size % sizeof(uint32_t) != 0)
+            {
+                LOG_WARN("ShaderCache: ignore invalid cache file %s", file.c_str());
+                return false;
+            }
+            in.seekg(0, std::ios::beg);
+            code.resize(size / sizeof(uint32_t));
+            if(!in.read(reinterpret_cast<char*>(code.data()), size) || code[0] != spirvMagic)
+            {
+                LOG_WARN("ShaderCache: ignore invalid cache file %s", file.c_str());
+                code.clear();
+                return false;
+            }
+            return true;
+        }
+
+        void ShaderCache::writeSPIRV(const std::string &file, const vsg::ShaderModule::SPIRV &code)
+        {
+            // other processes may read the cache at the same time
+            CacheFile::write(file, code.data(), code.size()*sizeof(uint32_t));
+        }
+
+        void ShaderCache::clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cacheFiles.clear();
+            modules.clear();
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vsg/all.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Content addressed cache for SPIR-V code of generated shaders.
+         *
+         * The key is a hash of the shader stage, the final GLSL source, the
+         * defines and the version and settings of the glsl compiler. Compiled
+         * modules are shared in memory within the process and stored as
+         * <hash>.spv files in the cache directory to be reused by later runs.
+         * createShaderStage() only looks up the caches, modules without code
+         * are compiled by compile(), called concurrently by the
+         * CompileScheduler.
+         */
+        class ShaderCache
+        {
+        public:
+            static void setCacheDirectory(const std::string &path);
+            static const std::string& getCacheDirectory()
+                { return cacheDirectory; }
+
+            static vsg::ref_ptr<vsg::ShaderStage> createShaderStage(VkShaderStageFlagBits stage,
+                                                                    const std::string &source,
+                                                                    const std::set<std::string> &defines = {});
+            /**
+             * Compiles the GLSL source of the stage to SPIR-V unless the
+             * module already has code and writes it to the cache directory.
+             * Thread safe. Returns false if no SPIR-V could be generated.
+             */
+            static bool compile(vsg::ref_ptr<vsg::ShaderStage> shaderStage);
+            static uint64_t hash(VkShaderStageFlagBits stage, const std::string &source,
+                                 const std::set<std::string> &defines);
+            static void clear();
+
+        private:
+            static const std::string& compilerVersion();
+            static std::string cacheDirectory;
+            static std::map<uint64_t, vsg::ref_ptr<vsg::ShaderModule>> modules;
+            // cache files still to be written once the module is compiled
+            static std::map<const vsg::ShaderModule*, std::string> cacheFiles;
+            static std::mutex mutex;
+
+            static bool readSPIRV(const std::string &file, vsg::ShaderModule::SPIRV &code);
+            static void writeSPIRV(const std::string &file, const vsg::ShaderModule::SPIRV &code);
+        };
+    }
+}
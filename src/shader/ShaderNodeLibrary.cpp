@@ -0,0 +1,148 @@
+#include "ShaderNodeLibrary.hpp"
+#include "../gui_helper_functions.hpp"
+
+#include <mars_utils/misc.h>
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <thread>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        std::map<std::string, configmaps::ConfigMap> ShaderNodeLibrary::functions;
+        std::map<std::string, std::string> ShaderNodeLibrary::sources;
+
+        static std::string readFile(const std::string &path)
+        {
+            std::ifstream t(path);
+            std::stringstream buffer;
+            buffer << t.rdbuf();
+            return buffer.str();
+        }
+
+        void ShaderNodeLibrary::load(const std::string &resourcePath)
+        {
+            std::filesystem::path libraryPath = std::filesystem::path(resourcePath) / "resources" / "graph_shader";
+            std::vector<std::filesystem::path> files;
+            std::error_code ec;
+            for(auto &entry: std::filesystem::directory_iterator(libraryPath, ec))
+            {
+                if(entry.is_regular_file())
+                {
+                    files.push_back(entry.path());
+                }
+            }
+            if(ec)
+            {
+                LOG_ERROR("ShaderNodeLibrary: can not read %s: %s",
+                          libraryPath.string().c_str(), ec.message().c_str());
+                return;
+            }
+
+            struct LoadResult
+            {
+                std::map<std::string, configmaps::ConfigMap> functions;
+                std::map<std::string, std::string> sources;
+            };
+
+            // read and parse the files in chunks on all available cores
+            size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+            size_t chunkSize = (files.size() + numThreads - 1) / numThreads;
+            std::vector<std::future<LoadResult>> results;
+            for(size_t begin=0; begin<files.size(); begin+=chunkSize)
+            {
+                size_t end = std::min(begin+chunkSize, files.size());
+                results.push_back(std::async(std::launch::async, [&files, begin, end]()
+                {
+                    LoadResult result;
+                    for(size_t i=begin; i<end; ++i)
+                    {
+                        const std::filesystem::path &file = files[i];
+                        std::string content = readFile(file.string());
+                        if(file.extension() == ".yaml")
+                        {
+                            try
+                            {
+                                result.functions[file.stem().string()] = configmaps::ConfigMap::fromYamlString(content);
+                            }
+                            catch(...)
+                            {
+                                LOG_ERROR("ShaderNodeLibrary: failed to parse %s", file.string().c_str());
+                            }
+                        }
+                        else if(file.extension() != ".yml")
+                        {
+                            // sources are referenced relative to the resources folder
+                            result.sources["graph_shader/" + file.filename().string()] = content;
+                        }
+                    }
+                    return result;
+                }));
+            }
+            for(auto &future: results)
+            {
+                LoadResult result = future.get();
+                functions.insert(result.functions.begin(), result.functions.end());
+                sources.insert(result.sources.begin(), result.sources.end());
+            }
+            LOG_INFO("ShaderNodeLibrary: loaded %zu functions and %zu sources",
+                     functions.size(), sources.size());
+        }
+
+        void ShaderNodeLibrary::clear()
+        {
+            functions.clear();
+            sources.clear();
+        }
+
+        bool ShaderNodeLibrary::reload(const std::string &file)
+        {
+            std::filesystem::path path(file);
+            if(path.extension() == ".yml")
+            {
+                return false;
+            }
+            std::string content = readFile(file);
+            if(path.extension() == ".yaml")
+            {
+                try
+                {
+                    functions[path.stem().string()] = configmaps::ConfigMap::fromYamlString(content);
+                }
+                catch(...)
+                {
+                    LOG_ERROR("ShaderNodeLibrary: failed to parse %s", file.c_str());
+                }
+            }
+            else
+            {
+                sources["graph_shader/" + path.filename().string()] = content;
+            }
+            return true;
+        }
+
+        configmaps::ConfigMap ShaderNodeLibrary::getFunctionInfo(const std::string &functionName)
+        {
+            auto it = functions.find(functionName);
+            if(it != functions.end())
+            {
+                return it->second;
+            }
+            return configmaps::ConfigMap::fromYamlFile(GuiHelper::resourcePath + "/resources/graph_shader/" + functionName + ".yaml");
+        }
+
+        std::string ShaderNodeLibrary::getSource(const std::string &sourceFile)
+        {
+            auto it = sources.find(sourceFile);
+            if(it != sources.end())
+            {
+                return it->second;
+            }
+            return readFile(utils::pathJoin(utils::pathJoin(GuiHelper::resourcePath, "resources"), sourceFile));
+        }
+    }
+}
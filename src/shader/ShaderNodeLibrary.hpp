@@ -0,0 +1,44 @@
+#pragma once
+
+#include <configmaps/ConfigData.h>
+
+#include <map>
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * In-memory index of the shader node functions in
+         * resources/graph_shader. All function descriptions (*.yaml) and
+         * their GLSL sources are read once by load(), thus generating shader
+         * sources needs no file I/O. The library is only modified by load()
+         * and clear() and can be read concurrently in between.
+         */
+        class ShaderNodeLibrary
+        {
+        public:
+            /** Loads all files below <resourcePath>/resources/graph_shader in parallel. */
+            static void load(const std::string &resourcePath);
+            static void clear();
+            /**
+             * Reads one changed file of the library again. Returns false if
+             * the file is not a node function or source, e.g. a shader graph.
+             */
+            static bool reload(const std::string &file);
+
+            /**
+             * Returns the description of a node function, e.g. "dot_max".
+             * Functions not found in the library are read from disk.
+             */
+            static configmaps::ConfigMap getFunctionInfo(const std::string &functionName);
+            /** Returns a source file given relative to the resources folder. */
+            static std::string getSource(const std::string &sourceFile);
+
+        private:
+            static std::map<std::string, configmaps::ConfigMap> functions;
+            static std::map<std::string, std::string> sources;
+        };
+    }
+}
@@ -0,0 +1,84 @@
+#include "ShaderWatcher.hpp"
+
+#include <mars_interfaces/Logging.hpp>
+#include <mars_utils/misc.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        ShaderWatcher::ShaderWatcher(const std::string &directory) : directory(directory), fd(-1), watch(-1)
+        {
+#ifdef __linux__
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if(fd < 0)
+            {
+                LOG_ERROR("ShaderWatcher: inotify_init1 failed: %s", strerror(errno));
+                return;
+            }
+            // editors either write the file in place or rename a temporary
+            // file onto it
+            watch = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if(watch < 0)
+            {
+                LOG_ERROR("ShaderWatcher: can not watch %s: %s", directory.c_str(), strerror(errno));
+                close(fd);
+                fd = -1;
+                return;
+            }
+            LOG_INFO("ShaderWatcher: watching %s", directory.c_str());
+#else
+            LOG_WARN("ShaderWatcher: shader hot reload is only supported on Linux");
+#endif
+        }
+
+        ShaderWatcher::~ShaderWatcher()
+        {
+#ifdef __linux__
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+#endif
+        }
+
+        std::set<std::string> ShaderWatcher::poll()
+        {
+            std::set<std::string> files;
+#ifdef __linux__
+            if(fd < 0)
+            {
+                return files;
+            }
+            alignas(struct inotify_event) char buffer[4096];
+            ssize_t size;
+            while((size = read(fd, buffer, sizeof(buffer))) > 0)
+            {
+                for(char *p=buffer; p<buffer+size; p+=sizeof(struct inotify_event)+((struct inotify_event*)p)->len)
+                {
+                    struct inotify_event *event = (struct inotify_event*)p;
+                    if(event->len == 0 || event->name[0] == '.')
+                    {
+                        continue;
+                    }
+                    std::string name = event->name;
+                    // skip backup files of editors
+                    if(name.back() == '~' || name[0] == '#')
+                    {
+                        continue;
+                    }
+                    files.insert(utils::pathJoin(directory, name));
+                }
+            }
+#endif
+            return files;
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <set>
+#include <string>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Watches the shader graph and node function files of a directory
+         * for changes. On Linux inotify is used, the watcher does not need
+         * a thread of its own: poll() reads the pending events without
+         * blocking. On other platforms no changes are reported.
+         */
+        class ShaderWatcher
+        {
+        public:
+            ShaderWatcher(const std::string &directory);
+            ~ShaderWatcher();
+
+            /** Returns the paths of the files written since the last call. */
+            std::set<std::string> poll();
+
+        private:
+            std::string directory;
+            int fd, watch;
+        };
+    }
+}
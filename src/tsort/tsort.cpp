@@ -1,262 +1,148 @@
-#include <sys/types.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-struct successor
-{
-  unsigned long item;
-  unsigned long next;
-};
+#include "tsort.h"
 
+#include <algorithm>
+#include <queue>
 
-struct item
+namespace mars
 {
-  unsigned long id;
-  unsigned long top;
-  unsigned long checked;
-  unsigned long visited;
-  unsigned long num_incoming;
-};
-
-#define BUFFER_STEPS 100
-
-struct item *node_list = NULL;
-unsigned long nodes_buffer_size, next_node_index;
-
-static struct successor *succ_list = NULL;
-unsigned long succ_buffer_size, next_succ_index;
-
-unsigned long *ids = NULL;
-
-void init(void) {
-  nodes_buffer_size = BUFFER_STEPS;
-  node_list = (struct item*)malloc(sizeof(struct item)*nodes_buffer_size);
-  next_node_index = 0;
-  succ_buffer_size = BUFFER_STEPS;
-  succ_list = (struct successor*)malloc(sizeof(struct successor)*succ_buffer_size);
-  next_succ_index = 0;
-}
-
-void deinit(void) {
-  free(node_list);
-  node_list = NULL;
-  free(succ_list);
-  succ_list = NULL;
-}
-
-
-/* return index of existing or newly node */
-
-unsigned long search_item (unsigned long id) {
-  unsigned long i;
-  unsigned long new_node_index;
-
-  new_node_index = next_node_index;
-
-  for(i=0; i<next_node_index; ++i) {
-    if(node_list[i].id == id) {
-      return i;
-    }
-  }
-
-  if(new_node_index == nodes_buffer_size) {
-    /* reallocate memory */
-    void *buffer;
-    buffer = malloc(sizeof(struct item)*(nodes_buffer_size+BUFFER_STEPS));
-    memcpy(buffer, node_list, sizeof(struct item)*nodes_buffer_size);
-    free(node_list);
-    node_list = (struct item *)buffer;
-    nodes_buffer_size += BUFFER_STEPS;
-  }
-
-  /* add new node */
-  node_list[new_node_index].id = id;
-  node_list[new_node_index].top = 0;
-  node_list[new_node_index].visited = 0;
-  node_list[new_node_index].checked = 0;
-  node_list[new_node_index].num_incoming = 0;
-  ++next_node_index;
-  return next_node_index-1;
-}
-
-
-void add_relation(unsigned long id1, unsigned long id2) {
-  unsigned long j;
-  unsigned long k;
-
-  /* don't add relation if id1 == id2 */
-  if(id1 == id2) {
-    return;
-  }
-  /*fprintf(stderr, "add relation: %lu %lu\n", id1, id2);*/
-  /* init tsort if not already done */
-  if(node_list == NULL) {
-    init();
-  }
-
-  j = search_item(id1);
-  k = search_item(id2);
-
-  /* reallocate memory if required */
-  if(++next_succ_index == succ_buffer_size) {
-    void *buffer;
-    buffer = malloc(sizeof(struct successor)*(succ_buffer_size+BUFFER_STEPS));
-    memcpy(buffer, succ_list, sizeof(struct successor)*succ_buffer_size);
-    free(succ_list);
-    succ_list = (struct successor *)buffer;
-    succ_buffer_size += BUFFER_STEPS;
-  }
-
-  /* add succ to j */
-  succ_list[next_succ_index].item = k;
-  succ_list[next_succ_index].next = node_list[j].top;
-  node_list[j].top = next_succ_index;
-
-  /* increment incoming count for k */
-  node_list[k].num_incoming++;
-}
-
-
-void detect_loops_for_node(struct item *item) {
-  unsigned long sid;
-  unsigned long *last_link;
-  struct successor *s;
-
-  /* set checked */
-  item->visited = 1;
-  item->checked = 1;
-
-  /* loop over successors */
-  sid = item->top;
-  last_link = &(item->top);
-  while(sid != 0) {
-    s = succ_list+sid;
-    if(node_list[s->item].checked) {
-      /* we have a loop */
-
-      /* remove successor */
-      *last_link = s->next;
-
-      /* decrease num incomming for target node */
-      node_list[s->item].num_incoming--;
-
-      /* for debugging purpose */
-      /*fprintf(stderr, "remove relation: %lu -> %lu\n", item->id, node_list[s->item].id);*/
-    }
-    else if(node_list[s->item].visited == 0) {
-      /* this node wasn't checked before */
-      detect_loops_for_node(node_list + s->item);
-    }
-    /* else it is known that the node doesn't produce a loop */
-    last_link = &(s->next);
-    sid = s->next;
-  }
-  item->checked = 0;
-}
-
-void detect_loops(void) {
-  unsigned long i;
-
-  for(i=0; i<next_node_index; ++i) {
-    if(node_list[i].visited == 0) {
-      detect_loops_for_node(node_list+i);
-    }
-  }
-}
-
-void debug_graph(void) {
-  unsigned long i, sid;
-
-  for(i=0; i<next_node_index; ++i) {
-    fprintf(stderr, "node: %lu (%lu)\n", node_list[i].id, node_list[i].num_incoming);
-    sid = node_list[i].top;
-    while(sid!=0) {
-      fprintf(stderr, "    -> %lu\n", node_list[succ_list[sid].item].id);
-      sid = succ_list[sid].next;
-    }
-  }
-}
-
-int tsort (void) {
-  unsigned long next_id = 0;
-  unsigned long *buffer1, *buffer2;
-  unsigned long *src_vertices, *cpy_vertices;
-  unsigned long num_src_vertices, num_cpy_vertices;
-  unsigned long sid, i;
-
-  /* detect loops */
-  detect_loops();
-
-  /* allocate memory for return ids */
-  if(ids) {
-    free(ids);
-  }
-  ids = (unsigned long*)malloc(sizeof(unsigned long)*(next_node_index+1));
-  ids[next_node_index] = 0;
-  /* allocate memory for fast sort */
-  buffer1 = (unsigned long*)malloc(sizeof(unsigned long)*next_node_index);
-  buffer2 = (unsigned long*)malloc(sizeof(unsigned long)*next_node_index);
+    namespace vsg_graphics
+    {
+
+        size_t TSort::getNode(unsigned long id)
+        {
+            auto it = nodeIndex.find(id);
+            if(it != nodeIndex.end())
+            {
+                return it->second;
+            }
+            nodes.push_back(Node{id, {}, 0});
+            nodeIndex[id] = nodes.size()-1;
+            return nodes.size()-1;
+        }
 
-  /* init buffers */
-  num_src_vertices = 0;
-  for(i=0; i<next_node_index; ++i) {
-    if(node_list[i].num_incoming == 0) {
-      /* add to id list */
-      ids[next_id++] = node_list[i].id;
-      /* decrease incoming of successors */
-      sid = node_list[i].top;
-      while(sid != 0) {
-        node_list[succ_list[sid].item].num_incoming--;
-        sid = succ_list[sid].next;
-      }
-    }
-    else {
-      buffer1[num_src_vertices++] = i;
-    }
-  }
+        void TSort::addRelation(unsigned long id1, unsigned long id2)
+        {
+            // don't add relation if id1 == id2
+            if(id1 == id2)
+            {
+                return;
+            }
+            size_t j = getNode(id1);
+            size_t k = getNode(id2);
+            nodes[j].successors.push_back(k);
+            nodes[k].numIncoming++;
+        }
 
-  src_vertices = buffer1;
-  num_cpy_vertices = 0;
-  cpy_vertices = buffer2;
+        void TSort::detectLoops()
+        {
+            // Iterative depth first search, a relation to a node on the
+            // current path closes a loop and is removed. Nodes are visited
+            // in the order they were added and their successors from the
+            // newest relation to the oldest one, like the former recursive
+            // implementation, thus the same relations are removed.
+            std::vector<char> visited(nodes.size(), 0), onPath(nodes.size(), 0);
+            struct Frame
+            {
+                size_t node;
+                // successors[remaining-1] is checked next
+                size_t remaining;
+            };
+            std::vector<Frame> stack;
+            for(size_t start=0; start<nodes.size(); ++start)
+            {
+                if(visited[start])
+                {
+                    continue;
+                }
+                visited[start] = onPath[start] = 1;
+                stack.push_back(Frame{start, nodes[start].successors.size()});
+                while(!stack.empty())
+                {
+                    Frame &frame = stack.back();
+                    std::vector<size_t> &successors = nodes[frame.node].successors;
+                    if(frame.remaining == 0)
+                    {
+                        onPath[frame.node] = 0;
+                        stack.pop_back();
+                        continue;
+                    }
+                    size_t successor = successors[--frame.remaining];
+                    if(onPath[successor])
+                    {
+                        // we have a loop
+                        successors.erase(successors.begin() + frame.remaining);
+                        nodes[successor].numIncoming--;
+                    }
+                    else if(!visited[successor])
+                    {
+                        visited[successor] = onPath[successor] = 1;
+                        stack.push_back(Frame{successor, nodes[successor].successors.size()});
+                    }
+                }
+            }
+        }
 
-  /* loop over nodes and sort them into ids */
-  while(num_src_vertices > 0) {
-    for(i=0; i<num_src_vertices; ++i) {
-      if(node_list[src_vertices[i]].num_incoming == 0) {
-        /* add to id list */
-        ids[next_id++] = node_list[src_vertices[i]].id;
-        /* decrease incoming of successors */
-        sid = node_list[src_vertices[i]].top;
-        while(sid != 0) {
-          node_list[succ_list[sid].item].num_incoming--;
-          sid = succ_list[sid].next;
+        std::vector<unsigned long> TSort::sort()
+        {
+            detectLoops();
+
+            // The former implementation scanned the remaining nodes in the
+            // order they were added again and again, emitting every node
+            // whose predecessors were already emitted. A node is emitted in
+            // the first scan after all predecessors; in the same scan if
+            // they come before it in the node order, otherwise in the next.
+            // The scan of each node is computed in topological order and the
+            // nodes are ordered by scan and node order with a counting sort,
+            // which gives the same result in O(V+E).
+            std::vector<size_t> numIncoming(nodes.size()), scan(nodes.size(), 0);
+            std::queue<size_t> ready;
+            for(size_t i=0; i<nodes.size(); ++i)
+            {
+                numIncoming[i] = nodes[i].numIncoming;
+                if(numIncoming[i] == 0)
+                {
+                    ready.push(i);
+                }
+            }
+            // number of nodes per scan, a scan is at most the node count
+            std::vector<size_t> scanStart(nodes.size()+1, 0);
+            std::vector<char> emitted(nodes.size(), 0);
+            while(!ready.empty())
+            {
+                size_t i = ready.front();
+                ready.pop();
+                emitted[i] = 1;
+                scanStart[scan[i]+1]++;
+                for(size_t successor: nodes[i].successors)
+                {
+                    scan[successor] = std::max(scan[successor], i < successor ? scan[i] : scan[i]+1);
+                    if(--numIncoming[successor] == 0)
+                    {
+                        ready.push(successor);
+                    }
+                }
+            }
+            for(size_t i=1; i<scanStart.size(); ++i)
+            {
+                scanStart[i] += scanStart[i-1];
+            }
+            // the nodes are placed in node order, thus stay in it per scan
+            std::vector<size_t> order(scanStart.back());
+            for(size_t i=0; i<nodes.size(); ++i)
+            {
+                if(emitted[i])
+                {
+                    order[scanStart[scan[i]]++] = i;
+                }
+            }
+
+            std::vector<unsigned long> ids;
+            ids.reserve(order.size());
+            for(size_t i: order)
+            {
+                ids.push_back(nodes[i].id);
+            }
+            return ids;
         }
-      }
-      else {
-        cpy_vertices[num_cpy_vertices++] = src_vertices[i];
-      }
-    }
-    if(src_vertices == buffer1) {
-      src_vertices = buffer2;
-      cpy_vertices = buffer1;
-    }
-    else {
-      src_vertices = buffer1;
-      cpy_vertices = buffer2;
     }
-    num_src_vertices = num_cpy_vertices;
-    num_cpy_vertices = 0;
-  }
-
-  /* free memory */
-  free(buffer1);
-  free(buffer2);
-  deinit();
-  return 1;
-}
-
-unsigned long* get_sorted_ids(void) {
-  return ids;
 }
@@ -1,3 +1,43 @@
-void add_relation(unsigned long id1, unsigned long id2);
-int tsort (void);
-unsigned long* get_sorted_ids(void);
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+namespace mars
+{
+    namespace vsg_graphics
+    {
+        /**
+         * Topological sort of a directed graph given by its relations.
+         * All state is kept in the instance, thus independent graphs can be
+         * sorted concurrently. Nodes are looked up by a hash map and sorted
+         * with a queue based Kahn algorithm. Loops are broken before sorting
+         * by removing the relations that point back to a node on the current
+         * path of a depth first search. The result is the same order as the
+         * former C implementation.
+         */
+        class TSort
+        {
+        public:
+            /** Adds the relation id1 -> id2, relations to itself are ignored. */
+            void addRelation(unsigned long id1, unsigned long id2);
+            /** Returns the ids of all nodes with relations in sorted order. */
+            std::vector<unsigned long> sort();
+
+        private:
+            struct Node
+            {
+                unsigned long id;
+                std::vector<size_t> successors;
+                size_t numIncoming;
+            };
+
+            std::vector<Node> nodes;
+            std::unordered_map<unsigned long, size_t> nodeIndex;
+
+            size_t getNode(unsigned long id);
+            void detectLoops();
+        };
+    }
+}
@@ -0,0 +1,209 @@
+/**
+ * Regression test of TSort: fixed graphs with known orders and loops, and
+ * random graphs compared with the former C implementation of the shader
+ * graph sort, which is kept below as reference.
+ */
+
+#include "tsort/tsort.h"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using mars::vsg_graphics::TSort;
+
+namespace
+{
+    // the former implementation: successors as linked lists, newest
+    // relation first, loops removed by a recursive depth first search and
+    // the nodes emitted by repeated scans in node order
+    class ReferenceSort
+    {
+    public:
+        void addRelation(unsigned long id1, unsigned long id2)
+        {
+            if(id1 == id2)
+            {
+                return;
+            }
+            unsigned long j = searchItem(id1);
+            unsigned long k = searchItem(id2);
+            successors.push_back(Successor{k, items[j].top});
+            items[j].top = successors.size()-1;
+            items[k].numIncoming++;
+        }
+
+        std::vector<unsigned long> sort()
+        {
+            for(auto &item: items)
+            {
+                if(!item.visited)
+                {
+                    detectLoopsForNode(item);
+                }
+            }
+            std::vector<unsigned long> ids, remaining;
+            auto emit = [&](Item &item)
+            {
+                ids.push_back(item.id);
+                for(unsigned long sid = item.top; sid != 0; sid = successors[sid].next)
+                {
+                    items[successors[sid].item].numIncoming--;
+                }
+            };
+            for(unsigned long i=0; i<items.size(); ++i)
+            {
+                if(items[i].numIncoming == 0)
+                {
+                    emit(items[i]);
+                }
+                else
+                {
+                    remaining.push_back(i);
+                }
+            }
+            while(!remaining.empty())
+            {
+                std::vector<unsigned long> next;
+                for(unsigned long i: remaining)
+                {
+                    if(items[i].numIncoming == 0)
+                    {
+                        emit(items[i]);
+                    }
+                    else
+                    {
+                        next.push_back(i);
+                    }
+                }
+                if(next.size() == remaining.size())
+                {
+                    // not reached if all loops were removed
+                    break;
+                }
+                remaining.swap(next);
+            }
+            return ids;
+        }
+
+    private:
+        struct Successor
+        {
+            unsigned long item, next;
+        };
+        struct Item
+        {
+            unsigned long id, top;
+            bool checked, visited;
+            unsigned long numIncoming;
+        };
+        // index 0 terminates the successor lists
+        std::vector<Successor> successors{Successor{0, 0}};
+        std::vector<Item> items;
+
+        unsigned long searchItem(unsigned long id)
+        {
+            for(unsigned long i=0; i<items.size(); ++i)
+            {
+                if(items[i].id == id)
+                {
+                    return i;
+                }
+            }
+            items.push_back(Item{id, 0, false, false, 0});
+            return items.size()-1;
+        }
+
+        void detectLoopsForNode(Item &item)
+        {
+            item.visited = item.checked = true;
+            unsigned long *lastLink = &item.top;
+            for(unsigned long sid = item.top; sid != 0;)
+            {
+                Successor &s = successors[sid];
+                if(items[s.item].checked)
+                {
+                    *lastLink = s.next;
+                    items[s.item].numIncoming--;
+                }
+                else if(!items[s.item].visited)
+                {
+                    detectLoopsForNode(items[s.item]);
+                }
+                lastLink = &s.next;
+                sid = s.next;
+            }
+            item.checked = false;
+        }
+    };
+
+    int failures = 0;
+
+    void expect(const char *name, const std::vector<unsigned long> &result,
+                const std::vector<unsigned long> &expected)
+    {
+        if(result != expected)
+        {
+            fprintf(stderr, "tsort_test: %s:", name);
+            for(unsigned long id: result)
+            {
+                fprintf(stderr, " %lu", id);
+            }
+            fprintf(stderr, ", expected");
+            for(unsigned long id: expected)
+            {
+                fprintf(stderr, " %lu", id);
+            }
+            fprintf(stderr, "\n");
+            ++failures;
+        }
+    }
+
+    std::vector<unsigned long> sortRelations(const std::vector<std::pair<unsigned long, unsigned long>> &relations)
+    {
+        TSort tsort;
+        for(auto &relation: relations)
+        {
+            tsort.addRelation(relation.first, relation.second);
+        }
+        return tsort.sort();
+    }
+}
+
+int main()
+{
+    expect("chain", sortRelations({{3, 2}, {2, 1}}), {3, 2, 1});
+    // 1 is only ready after 2, which is added later
+    expect("scan order", sortRelations({{1, 3}, {2, 1}, {4, 3}}), {2, 4, 1, 3});
+    expect("diamond", sortRelations({{1, 2}, {1, 3}, {2, 4}, {3, 4}}), {1, 2, 3, 4});
+    expect("self relation", sortRelations({{5, 5}, {5, 6}}), {5, 6});
+    // the relation closing the loop is dropped
+    expect("loop", sortRelations({{1, 2}, {2, 3}, {3, 1}}), {1, 2, 3});
+    expect("two loops", sortRelations({{1, 2}, {2, 1}, {3, 4}, {4, 3}, {2, 3}}), {1, 2, 3, 4});
+
+    std::mt19937 random(42);
+    for(int graph=0; graph<2000; ++graph)
+    {
+        unsigned long numNodes = 1 + random()%40;
+        unsigned long numRelations = random()%(3*numNodes);
+        TSort tsort;
+        ReferenceSort reference;
+        for(unsigned long i=0; i<numRelations; ++i)
+        {
+            unsigned long a = 100 + random()%numNodes, b = 100 + random()%numNodes;
+            tsort.addRelation(a, b);
+            reference.addRelation(a, b);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "random graph %d", graph);
+        expect(name, tsort.sort(), reference.sort());
+    }
+
+    if(failures)
+    {
+        fprintf(stderr, "tsort_test: %d failures\n", failures);
+        return 1;
+    }
+    printf("tsort_test: passed\n");
+    return 0;
+}